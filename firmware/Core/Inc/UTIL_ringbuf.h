@@ -11,17 +11,17 @@
 //*****************************************************************************
 typedef struct {
     //
-    // The ring buffer size.
+    // The ring buffer size, a power of two.
     //
     uint32_t ulSize;
 
     //
-    // The ring buffer write index.
+    // The ring buffer write index. Only written by the producer.
     //
     volatile uint32_t ulWriteIndex;
 
     //
-    // The ring buffer read index.
+    // The ring buffer read index. Only written by the consumer.
     //
     volatile uint32_t ulReadIndex;
 
@@ -30,6 +30,13 @@ typedef struct {
     //
     uint8_t *pucBuf;
 
+    //
+    // Size of the spill area that follows the ring buffer. A reservation
+    // that runs past the end of the ring is written here and copied to the
+    // start of the ring when it is committed.
+    //
+    uint32_t ulSpillSize;
+
 } tRingBufObject;
 
 //*****************************************************************************
@@ -55,7 +62,13 @@ extern void UTIL_RingBufAdvanceWrite(tRingBufObject *ptRingBuf,
                                 const uint32_t ulNumBytes);
 extern void UTIL_RingBufAdvanceRead(tRingBufObject *ptRingBuf,
                                 const uint32_t ulNumBytes);
+extern uint8_t *UTIL_RingBufReserve(tRingBufObject *ptRingBuf,
+                        const uint32_t ulLength);
+extern void UTIL_RingBufCommit(tRingBufObject *ptRingBuf,
+                        const uint32_t ulLength);
 extern void UTIL_RingBufInit(tRingBufObject *ptRingBuf, uint8_t *pucBuf,
                         const uint32_t ulSize);
+extern void UTIL_RingBufInitSpill(tRingBufObject *ptRingBuf, uint8_t *pucBuf,
+                        const uint32_t ulSize, const uint32_t ulSpillSize);
 
 #endif /* UTIL_RING_BUFFER_H */
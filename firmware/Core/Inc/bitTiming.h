@@ -0,0 +1,57 @@
+#ifndef BIT_TIMING_H
+#define BIT_TIMING_H
+
+#include "stdint.h"
+#include "stdbool.h"
+
+/*
+ * CAN bit timing solver, independent of the HAL so it can be built and
+ * checked on the host.
+ *
+ * A bit is 1 (sync) + seg1 + seg2 time quanta of prescaler kernel clock
+ * periods, sampled after 1 + seg1 quanta. The solver only gives exact bit
+ * rates: the kernel clock must be a multiple of the bit rate. Of the
+ * prescalers that fit the limits, it takes the one with the sample point
+ * closest to the target and, on a tie, the smallest one (most quanta).
+ * SJW is set to seg2, the largest the phase segments allow.
+ *
+ * Transmitter delay compensation (TDC) places the secondary sample point
+ * at the measured transceiver loop delay plus the offset, in kernel clock
+ * periods. Needed in the data phase from BITTIMING_TDC_MIN_BITRATE, where
+ * the loop delay is a large part of the bit.
+ */
+#define BITTIMING_SP_MIN            (500)       /* per mille */
+#define BITTIMING_SP_MAX            (950)       /* per mille */
+#define BITTIMING_TDC_MIN_BITRATE   (2000000)   /* bit/s */
+#define BITTIMING_TDC_MAX           (127)       /* TDCO, TDCF */
+
+#define BITTIMING_OK                (0)
+#define BITTIMING_ERR_SAMPLE_POINT  (1)     /* outside BITTIMING_SP_MIN - BITTIMING_SP_MAX */
+#define BITTIMING_ERR_BITRATE       (2)     /* no exact bit rate within the limits */
+
+typedef struct {
+    uint16_t prescaler;
+    uint16_t seg1;          // Prop_Seg + Phase_Seg1, time quanta
+    uint8_t seg2;           // Phase_Seg2, time quanta
+    uint8_t sjw;            // time quanta
+    uint16_t samplePoint;   // per mille, as solved
+} BitTiming_t;
+
+typedef struct {
+    uint16_t prescalerMax;
+    uint16_t seg1Max;
+    uint8_t seg2Max;
+    uint8_t sjwMax;
+    uint8_t tqMin;          // time quanta per bit
+} BitTimingLimits_t;
+
+extern const BitTimingLimits_t BITTIMING_NOMINAL;   /* FDCAN NBTP */
+extern const BitTimingLimits_t BITTIMING_DATA;      /* FDCAN DBTP */
+extern const BitTimingLimits_t BITTIMING_DATA_TDC;  /* FDCAN DBTP, TDC needs a prescaler of 1 or 2 */
+
+uint8_t BITTIMING_Solve(uint32_t clock, uint32_t bitrate, uint16_t samplePoint,
+        const BitTimingLimits_t * pLimits, BitTiming_t * pTiming);
+uint8_t BITTIMING_TdcOffset(const BitTiming_t * pTiming);
+uint8_t BITTIMING_TdcFilter(const BitTiming_t * pTiming, uint32_t clock, uint32_t minLoopDelayNs);
+
+#endif /* BIT_TIMING_H */
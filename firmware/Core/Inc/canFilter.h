@@ -0,0 +1,66 @@
+#ifndef CAN_FILTER_H
+#define CAN_FILTER_H
+
+#include "stdint.h"
+#include "stdbool.h"
+
+/*
+ * Host lists of FDCAN acceptance filter elements (CMD_SET_FAST_LANE and
+ * CMD_SET_FILTERS), parsed and checked without the HAL so it can be built
+ * and checked on the host. canParser writes the lists into the message RAM.
+ */
+
+/*
+ * Fast lane entry (CMD_SET_FAST_LANE)
+ *   [0]   : 0 - standard ID, 1 - extended ID
+ *   [1-4] : First ID of the range (little-endian)
+ *   [5-8] : Last ID of the range (little-endian)
+ */
+#define CAN_FAST_LANE_ENTRY_SIZE    (9)
+
+/*
+ * Acceptance filter entry (CMD_SET_FILTERS)
+ *   [0]   : 0 - standard ID, 1 - extended ID
+ *   [1]   : CAN_FILTER_TYPE_xxx
+ *   [2]   : CAN_FILTER_ACTION_xxx
+ *   [3-6] : ID1 (little-endian), first ID / first ID / filter ID
+ *   [7-10]: ID2 (little-endian), last ID / second ID / mask
+ */
+#define CAN_FILTER_ENTRY_SIZE       (11)
+
+/* Same values as FDCAN_FILTER_RANGE, _DUAL and _MASK */
+#define CAN_FILTER_TYPE_RANGE       (0)
+#define CAN_FILTER_TYPE_DUAL        (1)
+#define CAN_FILTER_TYPE_MASK        (2)
+
+/* FDCAN_FILTER_TO_RXFIFO0, _TO_RXFIFO1 and _REJECT less one */
+#define CAN_FILTER_ACTION_FIFO0     (0)
+#define CAN_FILTER_ACTION_FIFO1     (1)
+#define CAN_FILTER_ACTION_REJECT    (2)
+
+/* Message RAM of the G4: 28 standard and 8 extended filter elements */
+#define CANFILTER_STD_MAX           (28)
+#define CANFILTER_EXT_MAX           (8)
+#define CANFILTER_MAX               (CANFILTER_STD_MAX + CANFILTER_EXT_MAX)
+
+typedef struct {
+    uint32_t id1;
+    uint32_t id2;
+    uint8_t idType;         // 0 - standard, 1 - extended
+    uint8_t filterType;     // CAN_FILTER_TYPE_xxx
+    uint8_t action;         // CAN_FILTER_ACTION_xxx
+} CanFilter_t;
+
+typedef struct {
+    CanFilter_t entry[CANFILTER_MAX];
+    uint32_t count;
+    uint32_t stdCount;      // standard ID elements
+    uint32_t extCount;      // extended ID elements
+} CanFilterList_t;
+
+bool CANFILTER_ParseFastLane(CanFilterList_t * pList, const uint8_t * pEntries, uint32_t count);
+bool CANFILTER_ParseFilters(CanFilterList_t * pList, const uint8_t * pEntries, uint32_t count);
+bool CANFILTER_Fits(const CanFilterList_t * pList, const CanFilterList_t * pOther,
+        uint32_t stdMax, uint32_t extMax);
+
+#endif /* CAN_FILTER_H */
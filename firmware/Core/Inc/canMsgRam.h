@@ -0,0 +1,45 @@
+#ifndef CAN_MSGRAM_H
+#define CAN_MSGRAM_H
+
+#include "stdint.h"
+
+/*
+ * FDCAN message RAM elements (RM0440, FDCAN message RAM), encoded without
+ * the HAL so it can be built and checked on the host.
+ *
+ * Tx buffer element, 18 words
+ *   T0      : [31] ESI  [30] XTD  [29] RTR  [28:0] ID (standard ID in [28:18])
+ *   T1      : [31:24] MM  [23] EFC  [21] FDF  [20] BRS  [19:16] DLC
+ *   T2..T17 : Data bytes, little-endian
+ *
+ * Rx FIFO element, 18 words
+ *   R0      : [31] ESI  [30] XTD  [29] RTR  [28:0] ID (standard ID in [28:18])
+ *   R1      : [31] ANMF  [30:24] FIDX  [21] FDF  [20] BRS  [19:16] DLC  [15:0] RXTS
+ *   R2..R17 : Data bytes, little-endian
+ *
+ * Tx Event FIFO element, 2 words
+ *   E0      : [31] ESI  [30] XTD  [29] RTR  [28:0] ID (standard ID in [28:18])
+ *   E1      : [31:24] MM  [23:22] ET  [21] FDF  [20] BRS  [19:16] DLC  [15:0] TXTS
+ */
+#define MSGRAM_TX_ELEMENT_WORDS     (18U)
+#define MSGRAM_TX_ELEMENT_SIZE      (MSGRAM_TX_ELEMENT_WORDS * 4U)
+#define MSGRAM_RX_ELEMENT_WORDS     (18U)
+#define MSGRAM_RX_ELEMENT_SIZE      (MSGRAM_RX_ELEMENT_WORDS * 4U)
+#define MSGRAM_TXEVT_ELEMENT_WORDS  (2U)
+#define MSGRAM_TXEVT_ELEMENT_SIZE   (MSGRAM_TXEVT_ELEMENT_WORDS * 4U)
+
+/* MSGRAM_EncodeTx() flags */
+#define MSGRAM_TX_EXTENDED          (0x01U)     /* 29-bit identifier */
+#define MSGRAM_TX_FD                (0x02U)     /* CAN-FD frame */
+#define MSGRAM_TX_BRS               (0x04U)     /* bit rate switch, CAN-FD only */
+#define MSGRAM_TX_EVENT             (0x08U)     /* store a Tx event with the marker */
+
+uint8_t MSGRAM_BytesToDlc(uint8_t bytes);
+uint8_t MSGRAM_DlcToBytes(uint8_t dlc);
+void MSGRAM_EncodeTx(volatile uint32_t * pElement, uint32_t identifier, uint8_t flags,
+        uint8_t marker, const uint8_t * pData, uint8_t len);
+uint8_t MSGRAM_DecodeRx(const volatile uint32_t * pElement, uint32_t * pIdentifier,
+        uint8_t * pType, uint8_t * pData);
+uint8_t MSGRAM_DecodeTxEvent(const volatile uint32_t * pElement, uint16_t * pTxTimestamp);
+
+#endif /* CAN_MSGRAM_H */
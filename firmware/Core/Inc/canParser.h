@@ -8,7 +8,23 @@
 #ifndef INC_CANPARSER_H_
 #define INC_CANPARSER_H_
 
+#include "canFilter.h"
+
 #define CONFIG_CANFD_DATA_SIZE      (64)
+#define CONFIG_UPSTREAM_BATCH_SIZE  (512)   /* bytes, whole protocol frame */
+#define CONFIG_UPSTREAM_BATCH_AGE   (100)   /* 10us ticks (1ms) */
+#define CONFIG_TX_EVENT_BATCH       (16)    /* Tx events per CMD_TX_EVENT frame */
+#define CONFIG_TDC_MIN_LOOP_DELAY   (50)    /* ns, shortest transceiver loop delay (TDC filter) */
+
+/*
+ * CAN_SetBitrate() status, as sent in the CMD_SET_BITRATE response
+ */
+#define CAN_BITRATE_OK              (0)
+#define CAN_BITRATE_ERROR           (1)     /* CAN started or controller not updated */
+#define CAN_BITRATE_NOMINAL_SP      (2)     /* nominal sample point out of range */
+#define CAN_BITRATE_NOMINAL_RATE    (3)     /* nominal bit rate not reachable */
+#define CAN_BITRATE_DATA_SP         (4)     /* data sample point out of range */
+#define CAN_BITRATE_DATA_RATE       (5)     /* data bit rate not reachable */
 
 typedef struct {
     uint16_t TxErrorCnt;
@@ -16,19 +32,27 @@ typedef struct {
     uint16_t RxErrorCnt;
     uint16_t RxErrorCntMax;
     uint16_t PassiveErrorCnt;
+    uint16_t RxLostCnt;     // frames lost by the Rx FIFO 0 or the Rx queue
+    uint16_t TxEventLostCnt;    // Tx events lost by the Tx Event FIFO or queue
 } CanStat_t;
 
-typedef struct {
-    FDCAN_TxHeaderTypeDef header;
-    uint8_t data[CONFIG_CANFD_DATA_SIZE];
-} CanTx_t;
-
-bool CAN_Send(CanTx_t * pCanTx);
+bool CAN_Send(uint32_t identifier, uint8_t flags, uint8_t marker,
+        const uint8_t * pData, uint8_t len);
+bool CAN_SendDirect(uint32_t identifier, uint8_t flags, uint8_t marker,
+        const uint8_t * pData, uint8_t len);
+uint32_t CAN_GetTxFree(uint32_t * pChunks);
+bool CAN_SetTxPriority(bool enable);
+uint8_t CAN_SetBitrate(uint32_t nominalBitrate, uint16_t nominalSamplePoint,
+        uint32_t dataBitrate, uint16_t dataSamplePoint);
 void CANTX_Process(void);
 void CANRX_Process(void);
 void CANErr_Process(void);
 void CAN_stat_send(void);
 CanStat_t CAN_get_stats(void);
 void CAN_reset_stats(void);
+void CAN_SetUpstreamBatch(bool enable, uint16_t maxAge);
+bool CAN_SetFastLane(const uint8_t * pEntries, uint32_t count);
+bool CAN_SetFilters(uint8_t nonMatchingStd, uint8_t nonMatchingExt,
+        uint8_t rejectRemote, const uint8_t * pEntries, uint32_t count);
 
 #endif /* INC_CANPARSER_H_ */
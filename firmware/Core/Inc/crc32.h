@@ -0,0 +1,30 @@
+#ifndef CRC32_H
+#define CRC32_H
+
+#include "stdint.h"
+
+/*
+ * CRC-32 (ISO-HDLC / Ethernet)
+ *   Polynomial : 0x04C11DB7 (reflected 0xEDB88320)
+ *   Init       : 0xFFFFFFFF
+ *   RefIn      : true
+ *   RefOut     : true
+ *   XorOut     : 0xFFFFFFFF
+ *   Check      : CRC32("123456789") = 0xCBF43926
+ *
+ * On target (USE_HAL_DRIVER) CRC32_Calc() uses the CRC peripheral,
+ * elsewhere it falls back to CRC32_CalcSoft(). Both give the same result.
+ */
+
+/*
+ * CRC-32 of any message followed by its own CRC-32 (little-endian)
+ */
+#define CRC32_RESIDUE       (0x2144DF1CUL)
+
+void CRC32_Init(void);
+uint32_t CRC32_Calc(const uint8_t * pBuf, uint32_t len);
+uint32_t CRC32_CalcSoft(const uint8_t * pBuf, uint32_t len);
+uint32_t CRC32_Extend(uint32_t crc, const uint8_t * pBuf, uint32_t len);
+uint32_t CRC32_Combine(uint32_t crc1, uint32_t crc2, uint32_t len2);
+
+#endif /* CRC32_H */
@@ -0,0 +1,74 @@
+#ifndef FRAME_DECODER_H
+#define FRAME_DECODER_H
+
+#include "stdint.h"
+#include "stdbool.h"
+
+/*
+ * Incremental decoder for the frame format described in frameParser.h.
+ *
+ * Bytes are stored by a single producer (USB ISR) with DECODER_Store() and
+ * decoded by a single consumer (thread mode) with DECODER_Next() and
+ * DECODER_Consume(). The producer only writes wrPtr and the consumer only
+ * writes rdPtr, so no critical section is needed.
+ *
+ * The module has no HAL dependency and can be built on the host.
+ */
+#define FRAME_RX_SIZE       (2048)     /* must be a power of two */
+#define FRAME_RX_MASK       (FRAME_RX_SIZE - 1)
+#define FRAME_MAX_SIZE      (1023)
+#define DECODER_CRC_STEP    (16)       /* power of two, CRC-32 checkpoint interval */
+/*
+ * The buffer holds a frame of FRAME_MAX_SIZE bytes plus the USB packets
+ * still in flight, so a partly received frame never stalls the producer
+ * while it is flow controlled on the free space.
+ */
+
+typedef struct {
+    //
+    // Receive buffer. The first FRAME_MAX_SIZE bytes are mirrored right after
+    // its end so a frame starting anywhere in the buffer is contiguous.
+    //
+    uint8_t buffer[FRAME_RX_SIZE + FRAME_MAX_SIZE];
+
+    //
+    // prefixSum[i] is the running 8-bit sum of every byte received up to and
+    // including buffer[i].
+    //
+    uint8_t prefixSum[FRAME_RX_SIZE];
+
+    //
+    // CRC-32 mode only. crcCheckpoint[i] is the running CRC-32 of every byte
+    // received up to and including the last byte of the i-th block of
+    // DECODER_CRC_STEP bytes. The CRC of a candidate frame is combined from
+    // two running values instead of being computed over its length.
+    //
+    uint32_t crcCheckpoint[FRAME_RX_SIZE / DECODER_CRC_STEP];
+
+    //
+    // Producer and consumer indices.
+    //
+    volatile uint32_t wrPtr;
+    volatile uint32_t rdPtr;
+
+    //
+    // Consumer state kept across calls.
+    //
+    uint32_t sumPtr;        // next byte to add to the running sum
+    uint8_t runningSum;     // running sum up to sumPtr
+    uint32_t crcPtr;        // next byte to add to the running CRC
+    uint32_t runningCrc;    // running CRC up to crcPtr
+    uint32_t rdCrc;         // running CRC up to rdPtr
+    bool hasHeader;         // rdPtr is at a TAG with a valid length
+    bool crcMode;           // frames end with a CRC-32 instead of a checksum
+    uint32_t length;        // length of the frame at rdPtr
+} FrameDecoder_t;
+
+void DECODER_Init(FrameDecoder_t * pDec);
+bool DECODER_Store(FrameDecoder_t * pDec, const uint8_t * pBuf, uint32_t len);
+uint32_t DECODER_Free(FrameDecoder_t * pDec);
+const uint8_t * DECODER_Next(FrameDecoder_t * pDec, uint32_t * pLen);
+void DECODER_Consume(FrameDecoder_t * pDec);
+void DECODER_SetCrcMode(FrameDecoder_t * pDec, bool enable);
+
+#endif /* FRAME_DECODER_H */
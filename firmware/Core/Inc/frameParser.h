@@ -10,7 +10,7 @@
  *   Timestamp  : 4 bytes
  *   Packet Seq : 2 bytes
  *   Payload    : N Bytes
- *   Checksum   : 1 byte
+ *   Checksum   : 1 byte (4 bytes CRC-32 in FRAME_MODE_CRC32)
  */
 #define TAG_SOF                 (0xff)  //!< The value of the tag byte for a command packet.
 
@@ -20,6 +20,23 @@
 #define PACKET_SEQ_OFFSET       (7)
 #define PAYLOAD_OFFSET          (9)
 #define FRAME_OVERHEAD          (10)   /* 10 bytes */
+#define FRAME_CRC32_SIZE        (4)
+#define FRAME_CRC32_OVERHEAD    (FRAME_OVERHEAD - 1 + FRAME_CRC32_SIZE)
+
+#define FRAME_TX_SPILL_SIZE     (1024)  /* largest frame reserved in the USB Tx buffer */
+
+#define FRAME_MODE_CHECKSUM     (0)     /* 8-bit two's complement checksum */
+#define FRAME_MODE_CRC32        (1)     /* CRC-32, see crc32.h */
+
+#define SW_FILTER_OP_CONFIG     (0)     /* set the modes, clear the lists */
+#define SW_FILTER_OP_ADD_STD    (1)     /* add standard ID ranges */
+#define SW_FILTER_OP_ADD_EXT    (2)     /* add extended IDs */
+
+#define CONFIG_ACK_COALESCE_COUNT   (16)    /* frames */
+#define CONFIG_ACK_COALESCE_WINDOW  (100)   /* 10us ticks (1ms) */
+#define CONFIG_TX_CREDIT_INTERVAL   (50)    /* 10us ticks (500us) */
+#define CONFIG_TX_CREDIT_LOW        (4)     /* frames */
+#define CONFIG_TX_CREDIT_LOW_CHUNKS (20)    /* Tx slab chunks (4 frames of 64 bytes) */
 
 /*
  * Payload Format
@@ -34,11 +51,29 @@
 #define CMD_PROTOCOL_STATUS     (0x12)
 #define CMD_GET_CAN_STATS       (0x13)
 #define CMD_RESET_CAN_STATS     (0x14)
+#define CMD_SEND_UPSTREAM_BATCH (0x15)
+#define CMD_SEND_DOWNSTREAM_BATCH (0x16)
+#define CMD_DOWNSTREAM_ACK      (0x17)
+#define CMD_TX_CREDIT           (0x18)
+#define CMD_TX_EVENT            (0x19)
+#define CMD_SET_UPSTREAM_BATCH  (0x20)
+#define CMD_SET_ACK_MODE        (0x21)
+#define CMD_SET_FRAME_MODE      (0x22)
+#define CMD_SET_FAST_LANE       (0x23)
+#define CMD_SET_FILTERS         (0x24)
+#define CMD_SET_SW_FILTER       (0x25)
+#define CMD_SET_TX_PRIORITY     (0x26)
+#define CMD_SET_BITRATE         (0x27)
 #define CMD_ENTER_DFU           (0xF0)
 
 void PARSER_Store(uint8_t *pBuf, uint32_t len);
+uint32_t PARSER_GetRxFree(void);
 void PARSER_Process();
 void PARSER_GetTxBlock(uint8_t * pBuf, uint32_t * pSize);
+uint8_t * PARSER_ReserveFrame(uint32_t maxLen);
+void PARSER_CommitFrame(uint8_t *pBuf, uint32_t len);
+void PARSER_CommitFrameTs(uint8_t *pBuf, uint32_t len, uint32_t timestamp);
 uint8_t PARSER_SendFrame(uint8_t *pBuf, uint32_t len);
+uint32_t PARSER_GetTrailerSize(void);
 
 #endif /* FRAME_PARSER_H */
@@ -0,0 +1,32 @@
+#ifndef IDFILTER_H
+#define IDFILTER_H
+
+#include "stdint.h"
+#include "stdbool.h"
+
+/*
+ * Software ID filter, applied to received frames behind the hardware
+ * acceptance filters, for ID lists the 28 standard and 8 extended filter
+ * elements cannot hold.
+ *
+ *   Standard IDs : 2048-bit bitmap, one bit per 11-bit identifier
+ *   Extended IDs : open-addressing hash set (linear probing) of up to
+ *                  IDFILTER_EXT_MAX 29-bit identifiers
+ *
+ * IDFILTER_Accept() is O(1) and is called from the FDCAN1 interrupt. The
+ * list is changed in thread mode; a frame received during a change is
+ * filtered against either the old or the new list.
+ */
+#define IDFILTER_MODE_OFF       (0)     /* pass every ID */
+#define IDFILTER_MODE_PASS      (1)     /* pass only the listed IDs */
+#define IDFILTER_MODE_BLOCK     (2)     /* pass all but the listed IDs */
+
+#define IDFILTER_EXT_MAX        (96)    /* 75% load of a 128-slot table */
+
+bool IDFILTER_Config(uint8_t stdMode, uint8_t extMode);
+bool IDFILTER_AddStd(uint32_t first, uint32_t last);
+bool IDFILTER_AddExt(uint32_t id);
+uint32_t IDFILTER_GetExtFree(void);
+bool IDFILTER_Accept(bool isExtended, uint32_t id);
+
+#endif /* IDFILTER_H */
@@ -0,0 +1,28 @@
+#ifndef TX_QUEUE_H
+#define TX_QUEUE_H
+
+#include "stdint.h"
+#include "stdbool.h"
+
+/*
+ * Order of the CAN Tx queue, independent of the frame storage and of the
+ * HAL so it can be built and checked on the host.
+ *
+ * The caller keeps the frame of each of the TXQUEUE_SIZE slots. Free slots are
+ * tracked in a bitmap, queued slots in a binary min-heap ordered by key,
+ * then by submission order. With every key 0 the queue is a plain FIFO.
+ *
+ * Not reentrant: the caller serialises all calls.
+ */
+#define TXQUEUE_SIZE    (64)    /* multiple of 32, at most 256 */
+
+int32_t TXQUEUE_Alloc(void);
+void TXQUEUE_Free(uint8_t slot);
+void TXQUEUE_Push(uint8_t slot, uint32_t key);
+int32_t TXQUEUE_Pop(void);
+void TXQUEUE_Requeue(uint8_t slot);
+void TXQUEUE_Rekey(uint32_t (*pKeyOf)(uint8_t slot));
+uint32_t TXQUEUE_Count(void);
+uint32_t TXQUEUE_GetFree(void);
+
+#endif /* TX_QUEUE_H */
@@ -0,0 +1,33 @@
+#ifndef TX_SLAB_H
+#define TX_SLAB_H
+
+#include "stdint.h"
+
+/*
+ * Packed storage of the queued CAN Tx frames, independent of the HAL so it
+ * can be built and checked on the host.
+ *
+ * A frame takes a chain of TXSLAB_CHUNK_SIZE byte chunks sized to its data
+ * instead of a full HAL Tx header and a 64-byte data array:
+ *   first chunk : [ID (LE32)][flags][marker][length][-][data 0..7]
+ *   next chunks : [data], 16 bytes each
+ * A classic frame takes one chunk, a 64-byte CAN-FD frame five. Chunks
+ * are linked, so any free chunks can be used and the store does not
+ * fragment. Flags are the MSGRAM_TX_xxx flags of canMsgRam.h.
+ *
+ * Not reentrant: the caller serialises all calls.
+ */
+#define TXSLAB_CHUNK_SIZE       (16)
+#define TXSLAB_CHUNK_COUNT      (160)   /* at most 255 */
+#define TXSLAB_HEADER_SIZE      (8)
+#define TXSLAB_MAX_CHUNKS       ((TXSLAB_HEADER_SIZE + 64 + TXSLAB_CHUNK_SIZE - 1) / TXSLAB_CHUNK_SIZE)
+
+uint32_t TXSLAB_ChunksFor(uint8_t len);
+int32_t TXSLAB_Put(uint32_t identifier, uint8_t flags, uint8_t marker,
+        const uint8_t * pData, uint8_t len);
+uint8_t TXSLAB_Get(uint8_t handle, uint32_t * pIdentifier, uint8_t * pFlags,
+        uint8_t * pMarker, uint8_t * pData);
+void TXSLAB_Free(uint8_t handle);
+uint32_t TXSLAB_GetFree(void);
+
+#endif /* TX_SLAB_H */
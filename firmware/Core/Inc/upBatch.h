@@ -0,0 +1,39 @@
+#ifndef UP_BATCH_H
+#define UP_BATCH_H
+
+#include "stdint.h"
+#include "stdbool.h"
+#include "frameParser.h"
+#include "canParser.h"
+
+/*
+ * Encoder of the upstream batch frame (CMD_SEND_UPSTREAM_BATCH),
+ * independent of the HAL so it can be built and checked on the host.
+ *
+ * The frame is built in place, header and checksum byte included, so a
+ * finished batch goes to PARSER_SendFrame() as it is:
+ *   Payload[0]   : CMD_SEND_UPSTREAM_BATCH
+ *   Payload[1]   : Number of records
+ *   Payload[2-5] : Base timestamp (reception time of first record)
+ *   Records...
+ * A record is [RX_TYPE][DLC][delta (LE16)][ID (LE16 or LE32)][data].
+ */
+#define UPBATCH_COUNT_OFFSET        (PAYLOAD_OFFSET + 1)
+#define UPBATCH_BASE_TS_OFFSET      (PAYLOAD_OFFSET + 2)
+#define UPBATCH_RECORD_OFFSET       (PAYLOAD_OFFSET + 6)
+
+typedef struct {
+    uint8_t buffer[CONFIG_UPSTREAM_BATCH_SIZE];
+    uint32_t len;           // frame bytes so far, without the checksum byte
+    uint32_t baseTs;        // reception time of the first record
+    uint8_t count;
+} UpBatch_t;
+
+uint32_t UPBATCH_RecordSize(uint8_t type, uint8_t dlc);
+void UPBATCH_Init(UpBatch_t * pBatch);
+bool UPBATCH_Add(UpBatch_t * pBatch, uint8_t type, uint32_t identifier, uint8_t dlc,
+        const uint8_t * pData, uint32_t timestamp, uint32_t capacity);
+bool UPBATCH_IsDue(const UpBatch_t * pBatch, uint32_t now, uint16_t maxAge);
+uint32_t UPBATCH_Finish(UpBatch_t * pBatch);
+
+#endif /* UP_BATCH_H */
@@ -1,4 +1,9 @@
+#include "string.h"
+#ifdef USE_HAL_DRIVER
 #include "stm32g4xx.h"
+#else
+#define __DMB()                 __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
 #include "UTIL_ringbuf.h"
 
 //*****************************************************************************
@@ -16,49 +21,63 @@
 
 //*****************************************************************************
 //
-// Change the value of a variable atomically.
+// Single-producer/single-consumer ring buffer.
+//
+// The write index is only written by the producer and the read index is only
+// written by the consumer, so neither index needs a critical section. The
+// producer and the consumer may run in different contexts (e.g. ISR and
+// thread mode). The buffer size is a power of two and indices wrap with a
+// mask.
 //
-// \param pulVal points to the index whose value is to be modified.
-// \param ulDelta is the number of bytes to increment the index by.
-// \param ulSize is the size of the buffer the index refers to.
+// A barrier orders the data accesses against the index update that hands the
+// space over to the other side:
+//  - the producer copies data in, then publishes the write index
+//  - the consumer copies data out, then publishes the read index
 //
-// This function is used to increment a read or write buffer index that may be
-// written in various different contexts. It ensures that the read/modify/write
-// sequence is not interrupted and, hence, guards against corruption of the
-// variable. The new value is adjusted for buffer wrap.
+//*****************************************************************************
+#define RINGBUF_MASK(ptRingBuf)     ((ptRingBuf)->ulSize - 1)
+
+//*****************************************************************************
 //
-// \return None.
+// Copies data into the ring buffer at a given index, in at most two segments.
 //
 //*****************************************************************************
-static void UpdateIndexAtomic(volatile uint32_t *pulVal, uint32_t ulDelta,
-                  uint32_t ulSize)
+static void CopyIn(tRingBufObject *ptRingBuf, uint32_t ulIndex,
+                   const uint8_t *pucData, uint32_t ulLength)
 {
-    uint32_t isrContext = __get_IPSR() & 0x3F;
-    /* Enter Critical Section */
-    if(isrContext == 0) {
-        __disable_irq();
+    uint32_t ulFirst = ptRingBuf->ulSize - ulIndex;
+
+    if(ulFirst > ulLength)
+    {
+        ulFirst = ulLength;
+    }
+    memcpy(&ptRingBuf->pucBuf[ulIndex], pucData, ulFirst);
+    if(ulLength > ulFirst)
+    {
+        memcpy(ptRingBuf->pucBuf, &pucData[ulFirst], ulLength - ulFirst);
     }
+}
 
-    //
-    // Update the variable value.
-    //
-    *pulVal += ulDelta;
+//*****************************************************************************
+//
+// Copies data out of the ring buffer at a given index, in at most two
+// segments.
+//
+//*****************************************************************************
+static void CopyOut(tRingBufObject *ptRingBuf, uint32_t ulIndex,
+                    uint8_t *pucData, uint32_t ulLength)
+{
+    uint32_t ulFirst = ptRingBuf->ulSize - ulIndex;
 
-    //
-    // Correct for wrap. We use a loop here since we don't want to use a
-    // modulus operation with interrupts off but we don't want to fail in
-    // case ulDelta is greater than ulSize (which is extremely unlikely but...)
-    //
-    while(*pulVal >= ulSize)
+    if(ulFirst > ulLength)
     {
-        *pulVal -= ulSize;
+        ulFirst = ulLength;
     }
-
-    /* Exit Critical Section */
-    if(isrContext == 0) {
-        __enable_irq();
+    memcpy(pucData, &ptRingBuf->pucBuf[ulIndex], ulFirst);
+    if(ulLength > ulFirst)
+    {
+        memcpy(&pucData[ulFirst], ptRingBuf->pucBuf, ulLength - ulFirst);
     }
-
 }
 
 //*****************************************************************************
@@ -95,7 +114,7 @@ uint8_t UTIL_RingBufFull(tRingBufObject *ptRingBuf)
     //
     // Return the full status of the buffer.
     //
-    return((((ulWrite + 1) % ptRingBuf->ulSize) == ulRead) ? (uint8_t)1 : (uint8_t)0);
+    return((((ulWrite + 1) & RINGBUF_MASK(ptRingBuf)) == ulRead) ? (uint8_t)1 : (uint8_t)0);
 }
 
 //*****************************************************************************
@@ -141,30 +160,24 @@ uint8_t UTIL_RingBufEmpty(tRingBufObject *ptRingBuf)
 //!
 //! \param ptRingBuf is the ring buffer object to empty.
 //!
-//! Discards all data from the ring buffer.
+//! Discards all data from the ring buffer. This is a consumer operation.
 //!
 //! \return None.
 //
 //*****************************************************************************
 void UTIL_RingBufFlush(tRingBufObject *ptRingBuf)
 {
-    uint32_t isrContext = __get_IPSR() & 0x3F;
     //
     // Check the arguments.
     //
     ASSERT(ptRingBuf != NULL);
 
     //
-    // Set the Read/Write pointers to be the same. Do this with interrupts
-    // disabled to prevent the possibility of corruption of the read index.
+    // Set the Read/Write pointers to be the same. Only the consumer writes
+    // the read index, so no critical section is needed.
     //
-    if(isrContext == 0) {
-        __disable_irq();
-    }
+    __DMB();
     ptRingBuf->ulReadIndex = ptRingBuf->ulWriteIndex;
-    if(isrContext == 0) {
-        __enable_irq();
-    }
 }
 
 //*****************************************************************************
@@ -197,8 +210,7 @@ uint32_t UTIL_RingBufUsed(tRingBufObject *ptRingBuf)
     //
     // Return the number of bytes contained in the ring buffer.
     //
-    return((ulWrite >= ulRead) ? (ulWrite - ulRead) :
-           (ptRingBuf->ulSize - (ulRead - ulWrite)));
+    return((ulWrite - ulRead) & RINGBUF_MASK(ptRingBuf));
 }
 
 //*****************************************************************************
@@ -354,6 +366,7 @@ uint32_t UTIL_RingBufSize(tRingBufObject *ptRingBuf)
 uint8_t UTIL_RingBufReadOne(tRingBufObject *ptRingBuf)
 {
     uint8_t ucTemp;
+    uint32_t ulRead;
 
     //
     // Check the arguments.
@@ -366,14 +379,17 @@ uint8_t UTIL_RingBufReadOne(tRingBufObject *ptRingBuf)
     ASSERT(UTIL_RingBufUsed(ptRingBuf) != 0);
 
     //
-    // Write the data byte.
+    // Read the data byte.
     //
-    ucTemp = ptRingBuf->pucBuf[ptRingBuf->ulReadIndex];
+    ulRead = ptRingBuf->ulReadIndex;
+    __DMB();
+    ucTemp = ptRingBuf->pucBuf[ulRead];
 
     //
     // Increment the read index.
     //
-    UpdateIndexAtomic(&ptRingBuf->ulReadIndex, 1, ptRingBuf->ulSize);
+    __DMB();
+    ptRingBuf->ulReadIndex = (ulRead + 1) & RINGBUF_MASK(ptRingBuf);
 
     //
     // Return the character read.
@@ -397,7 +413,7 @@ uint8_t UTIL_RingBufReadOne(tRingBufObject *ptRingBuf)
 void UTIL_RingBufRead(tRingBufObject *ptRingBuf, uint8_t *pucData,
                const uint32_t ulLength)
 {
-    uint32_t ulTemp;
+    uint32_t ulRead;
 
     //
     // Check the arguments.
@@ -414,10 +430,15 @@ void UTIL_RingBufRead(tRingBufObject *ptRingBuf, uint8_t *pucData,
     //
     // Read the data from the ring buffer.
     //
-    for(ulTemp = 0; ulTemp < ulLength; ulTemp++)
-    {
-        pucData[ulTemp] = UTIL_RingBufReadOne(ptRingBuf);
-    }
+    ulRead = ptRingBuf->ulReadIndex;
+    __DMB();
+    CopyOut(ptRingBuf, ulRead, pucData, ulLength);
+
+    //
+    // Hand the space back to the producer.
+    //
+    __DMB();
+    ptRingBuf->ulReadIndex = (ulRead + ulLength) & RINGBUF_MASK(ptRingBuf);
 }
 
 //*****************************************************************************
@@ -456,8 +477,9 @@ void UTIL_RingBufAdvanceRead(tRingBufObject *ptRingBuf,
     //
     // Advance the buffer read index by the required number of bytes.
     //
-    UpdateIndexAtomic(&ptRingBuf->ulReadIndex, ulCount,
-                      ptRingBuf->ulSize);
+    __DMB();
+    ptRingBuf->ulReadIndex = (ptRingBuf->ulReadIndex + ulCount) &
+                             RINGBUF_MASK(ptRingBuf);
 }
 
 //*****************************************************************************
@@ -469,10 +491,10 @@ void UTIL_RingBufAdvanceRead(tRingBufObject *ptRingBuf,
 //!
 //! This function should be used by clients who wish to add data to the buffer
 //! directly rather than via calls to UTIL_RingBufWrite() or UTIL_RingBufWriteOne().
-//! It advances the write index by a given number of bytes.  If the \e ulNumBytes
-//! parameter is larger than the amount of free space in the buffer, the
-//! read pointer will be advanced to cater for the addition.  Note that this
-//! will result in some of the oldest data in the buffer being discarded.
+//! It advances the write index by a given number of bytes.  The producer
+//! never moves the read index, so if the \e ulNumBytes parameter is larger
+//! than the amount of free space in the buffer, only the free space is
+//! added.
 //!
 //! \return None.
 //
@@ -481,7 +503,6 @@ void UTIL_RingBufAdvanceWrite(tRingBufObject *ptRingBuf,
                        const uint32_t ulNumBytes)
 {
     uint32_t ulCount;
-    uint32_t isrContext = __get_IPSR() & 0x3F;
 
     //
     // Check the arguments.
@@ -497,56 +518,14 @@ void UTIL_RingBufAdvanceWrite(tRingBufObject *ptRingBuf,
     // Determine how much free space we currently think the buffer has.
     //
     ulCount = UTIL_RingBufFree(ptRingBuf);
+    ulCount = (ulCount < ulNumBytes) ? ulCount : ulNumBytes;
 
     //
-    // Advance the buffer write index by the required number of bytes and
-    // check that we have not run past the read index. Note that we must do
-    // this within a critical section (interrupts disabled) to prevent
-    // race conditions that could corrupt one or other of the indices.
-    //
-    if(isrContext == 0) {
-        __disable_irq();
-    }
-
-    //
-    // Update the write pointer.
-    //
-    ptRingBuf->ulWriteIndex += ulNumBytes;
-
-    //
-    // Check and correct for wrap.
-    //
-    if(ptRingBuf->ulWriteIndex >= ptRingBuf->ulSize)
-    {
-        ptRingBuf->ulWriteIndex -= ptRingBuf->ulSize;
-    }
-
-    //
-    // Did the client add more bytes than the buffer had free space for?
-    //
-    if(ulCount < ulNumBytes)
-    {
-        //
-        // Yes - we need to advance the read pointer to ahead of the write
-        // pointer to discard some of the oldest data.
-        //
-        ptRingBuf->ulReadIndex = ptRingBuf->ulWriteIndex + 1;
-
-        //
-        // Correct for buffer wrap if necessary.
-        //
-        if(ptRingBuf->ulReadIndex >= ptRingBuf->ulSize)
-        {
-            ptRingBuf->ulReadIndex -= ptRingBuf->ulSize;
-        }
-    }
-
-    //
-    // Restore interrupts if we turned them off earlier.
+    // Publish the data.
     //
-    if(isrContext == 0) {
-        __enable_irq();
-    }
+    __DMB();
+    ptRingBuf->ulWriteIndex = (ptRingBuf->ulWriteIndex + ulCount) &
+                              RINGBUF_MASK(ptRingBuf);
 }
 
 //*****************************************************************************
@@ -563,6 +542,8 @@ void UTIL_RingBufAdvanceWrite(tRingBufObject *ptRingBuf,
 //*****************************************************************************
 void UTIL_RingBufWriteOne(tRingBufObject *ptRingBuf, const uint8_t ucData)
 {
+    uint32_t ulWrite;
+
     //
     // Check the arguments.
     //
@@ -576,12 +557,14 @@ void UTIL_RingBufWriteOne(tRingBufObject *ptRingBuf, const uint8_t ucData)
     //
     // Write the data byte.
     //
-    ptRingBuf->pucBuf[ptRingBuf->ulWriteIndex] = ucData;
+    ulWrite = ptRingBuf->ulWriteIndex;
+    ptRingBuf->pucBuf[ulWrite] = ucData;
 
     //
     // Increment the write index.
     //
-    UpdateIndexAtomic(&ptRingBuf->ulWriteIndex, 1, ptRingBuf->ulSize);
+    __DMB();
+    ptRingBuf->ulWriteIndex = (ulWrite + 1) & RINGBUF_MASK(ptRingBuf);
 }
 
 //*****************************************************************************
@@ -600,7 +583,7 @@ void UTIL_RingBufWriteOne(tRingBufObject *ptRingBuf, const uint8_t ucData)
 void UTIL_RingBufWrite(tRingBufObject *ptRingBuf, const uint8_t *pucData,
                 uint32_t ulLength)
 {
-    uint32_t ulTemp;
+    uint32_t ulWrite;
 
     //
     // Check the arguments.
@@ -617,10 +600,109 @@ void UTIL_RingBufWrite(tRingBufObject *ptRingBuf, const uint8_t *pucData,
     //
     // Write the data into the ring buffer.
     //
-    for(ulTemp = 0; ulTemp < ulLength; ulTemp++)
+    ulWrite = ptRingBuf->ulWriteIndex;
+    CopyIn(ptRingBuf, ulWrite, pucData, ulLength);
+
+    //
+    // Publish the data.
+    //
+    __DMB();
+    ptRingBuf->ulWriteIndex = (ulWrite + ulLength) & RINGBUF_MASK(ptRingBuf);
+}
+
+//*****************************************************************************
+//
+//! Reserves contiguous space for writing data directly into a ring buffer.
+//!
+//! \param ptRingBuf points to the ring buffer to be written to.
+//! \param ulLength is the number of bytes to reserve.
+//!
+//! This function returns a pointer to \e ulLength bytes of contiguous memory
+//! at the current write index, so a producer can build data in place
+//! instead of copying it in with UTIL_RingBufWrite(). Bytes that fall past
+//! the end of the ring buffer are placed in the spill area given to
+//! UTIL_RingBufInitSpill(). Nothing is visible to the reader until
+//! UTIL_RingBufCommit() is called. Only one reservation may be open at a
+//! time, and it must be committed from the same context.
+//!
+//! \return Returns a pointer to the reserved space, or \b NULL if the buffer
+//! does not have \e ulLength bytes free or the spill area is too small.
+//
+//*****************************************************************************
+uint8_t *UTIL_RingBufReserve(tRingBufObject *ptRingBuf,
+                      const uint32_t ulLength)
+{
+    uint32_t ulWrite;
+
+    //
+    // Check the arguments.
+    //
+    ASSERT(ptRingBuf != NULL);
+
+    //
+    // Copy the write index for calculation.
+    //
+    ulWrite = ptRingBuf->ulWriteIndex;
+
+    if(ulLength > UTIL_RingBufFree(ptRingBuf))
+    {
+        return(NULL);
+    }
+
+    if(ulLength > ((ptRingBuf->ulSize - ulWrite) + ptRingBuf->ulSpillSize))
+    {
+        return(NULL);
+    }
+
+    //
+    // The free space must not be written before the consumer is done
+    // reading it.
+    //
+    __DMB();
+
+    return(&ptRingBuf->pucBuf[ulWrite]);
+}
+
+//*****************************************************************************
+//
+//! Publishes data written into space returned by UTIL_RingBufReserve().
+//!
+//! \param ptRingBuf points to the ring buffer to be written to.
+//! \param ulLength is the number of bytes written, no more than reserved.
+//!
+//! This function moves any bytes written to the spill area to the start of
+//! the ring buffer, then makes all \e ulLength bytes visible to the reader
+//! with a single write index update.
+//!
+//! \return None.
+//
+//*****************************************************************************
+void UTIL_RingBufCommit(tRingBufObject *ptRingBuf, const uint32_t ulLength)
+{
+    uint32_t ulWrite;
+
+    //
+    // Check the arguments.
+    //
+    ASSERT(ptRingBuf != NULL);
+    ASSERT(ulLength <= UTIL_RingBufFree(ptRingBuf));
+
+    ulWrite = ptRingBuf->ulWriteIndex;
+
+    //
+    // Wrap the part written past the end of the ring buffer.
+    //
+    if((ulWrite + ulLength) > ptRingBuf->ulSize)
     {
-        UTIL_RingBufWriteOne(ptRingBuf, pucData[ulTemp]);
+        memcpy(ptRingBuf->pucBuf, &ptRingBuf->pucBuf[ptRingBuf->ulSize],
+               (ulWrite + ulLength) - ptRingBuf->ulSize);
     }
+
+    //
+    // Publish the data.
+    //
+    __DMB();
+    ptRingBuf->ulWriteIndex = (ulWrite + ulLength) & RINGBUF_MASK(ptRingBuf);
 }
 
 //*****************************************************************************
@@ -629,7 +711,7 @@ void UTIL_RingBufWrite(tRingBufObject *ptRingBuf, const uint8_t *pucData,
 //!
 //! \param ptRingBuf points to the ring buffer to be initialized.
 //! \param pucBuf points to the data buffer to be used for the ring buffer.
-//! \param ulSize is the size of the buffer in bytes.
+//! \param ulSize is the size of the buffer in bytes, a power of two.
 //!
 //! This function initializes a ring buffer object, preparing it to store data.
 //!
@@ -645,15 +727,40 @@ void UTIL_RingBufInit(tRingBufObject *ptRingBuf, uint8_t *pucBuf,
     ASSERT(ptRingBuf != NULL);
     ASSERT(pucBuf != NULL);
     ASSERT(ulSize != 0);
+    ASSERT((ulSize & (ulSize - 1)) == 0);
 
     //
     // Initialize the ring buffer object.
     //
     ptRingBuf->ulSize = ulSize;
     ptRingBuf->pucBuf = pucBuf;
+    ptRingBuf->ulSpillSize = 0;
     ptRingBuf->ulWriteIndex = ptRingBuf->ulReadIndex = 0;
 }
 
+//*****************************************************************************
+//
+//! Initialize a ring buffer object with a spill area for reservations.
+//!
+//! \param ptRingBuf points to the ring buffer to be initialized.
+//! \param pucBuf points to the data buffer, \e ulSize + \e ulSpillSize bytes.
+//! \param ulSize is the size of the ring buffer in bytes, a power of two.
+//! \param ulSpillSize is the largest reservation that may wrap, in bytes.
+//!
+//! This function initializes a ring buffer object like UTIL_RingBufInit()
+//! and allows UTIL_RingBufReserve() to return up to \e ulSpillSize bytes
+//! of contiguous space anywhere in the ring.
+//!
+//! \return None.
+//
+//*****************************************************************************
+void UTIL_RingBufInitSpill(tRingBufObject *ptRingBuf, uint8_t *pucBuf,
+               const uint32_t ulSize, const uint32_t ulSpillSize)
+{
+    UTIL_RingBufInit(ptRingBuf, pucBuf, ulSize);
+    ptRingBuf->ulSpillSize = ulSpillSize;
+}
+
 //*****************************************************************************
 //
 // Close the Doxygen group.
@@ -0,0 +1,102 @@
+#include "bitTiming.h"
+
+const BitTimingLimits_t BITTIMING_NOMINAL = { 512, 256, 128, 128, 8 };
+const BitTimingLimits_t BITTIMING_DATA = { 32, 32, 16, 16, 5 };
+const BitTimingLimits_t BITTIMING_DATA_TDC = { 2, 32, 16, 16, 5 };
+
+/*
+ * Solves the bit timing of bitrate (bit/s) from the kernel clock (Hz) with
+ * the sample point closest to samplePoint (per mille). Returns
+ * BITTIMING_OK, BITTIMING_ERR_SAMPLE_POINT if the sample point is out of
+ * range, or BITTIMING_ERR_BITRATE if no prescaler gives the exact bit rate
+ * within the limits.
+ */
+uint8_t BITTIMING_Solve(uint32_t clock, uint32_t bitrate, uint16_t samplePoint,
+        const BitTimingLimits_t * pLimits, BitTiming_t * pTiming)
+{
+    uint32_t bitClocks;
+    uint32_t bestError = UINT32_MAX;
+    uint32_t prescaler;
+
+    if((samplePoint < BITTIMING_SP_MIN) || (samplePoint > BITTIMING_SP_MAX)) {
+        return BITTIMING_ERR_SAMPLE_POINT;
+    }
+    if((bitrate == 0) || ((clock % bitrate) != 0)) {
+        return BITTIMING_ERR_BITRATE;
+    }
+    bitClocks = clock / bitrate;
+
+    for(prescaler = 1; prescaler <= pLimits->prescalerMax; prescaler++) {
+        const uint32_t tq = bitClocks / prescaler;
+        uint32_t seg1;
+        uint32_t seg2;
+        uint32_t error;
+
+        if(tq < pLimits->tqMin) {
+            break;
+        }
+        if(((bitClocks % prescaler) != 0) ||
+           (tq > (1U + pLimits->seg1Max + pLimits->seg2Max))) {
+            continue;
+        }
+
+        // Nearest quantum to the sample point, then into the segment limits
+        seg1 = (tq * samplePoint + 500U) / 1000U - 1U;
+        if(seg1 > (tq - 2U)) {
+            seg1 = tq - 2U;
+        }
+        if(seg1 < 1U) {
+            seg1 = 1U;
+        }
+        seg2 = tq - 1U - seg1;
+        if(seg2 > pLimits->seg2Max) {
+            seg2 = pLimits->seg2Max;
+            seg1 = tq - 1U - seg2;
+        }
+        if(seg1 > pLimits->seg1Max) {
+            seg1 = pLimits->seg1Max;
+            seg2 = tq - 1U - seg1;
+        }
+
+        // Sample point error (per mille) times bitClocks, exact in integers
+        error = (1000U * (1U + seg1) > samplePoint * tq) ?
+                (1000U * (1U + seg1) - samplePoint * tq) * prescaler :
+                (samplePoint * tq - 1000U * (1U + seg1)) * prescaler;
+        if(error < bestError) {
+            bestError = error;
+            pTiming->prescaler = (uint16_t)prescaler;
+            pTiming->seg1 = (uint16_t)seg1;
+            pTiming->seg2 = (uint8_t)seg2;
+            pTiming->sjw = (uint8_t)((seg2 < pLimits->sjwMax) ? seg2 : pLimits->sjwMax);
+            pTiming->samplePoint = (uint16_t)((1000U * (1U + seg1) + tq / 2U) / tq);
+        }
+    }
+
+    return (bestError != UINT32_MAX) ? BITTIMING_OK : BITTIMING_ERR_BITRATE;
+}
+
+
+/*
+ * TDC offset: the secondary sample point at the sample point of the bit,
+ * in kernel clock periods after the measured loop delay
+ */
+uint8_t BITTIMING_TdcOffset(const BitTiming_t * pTiming)
+{
+    const uint32_t offset = (uint32_t)pTiming->prescaler * (1U + pTiming->seg1);
+
+    return (uint8_t)((offset < BITTIMING_TDC_MAX) ? offset : BITTIMING_TDC_MAX);
+}
+
+
+/*
+ * TDC filter window: edges that would put the secondary sample point
+ * earlier than the offset plus the shortest loop delay of the transceiver
+ * are glitches and are not taken as the delay measurement
+ */
+uint8_t BITTIMING_TdcFilter(const BitTiming_t * pTiming, uint32_t clock, uint32_t minLoopDelayNs)
+{
+    const uint32_t filter = BITTIMING_TdcOffset(pTiming) +
+            (uint32_t)(((uint64_t)minLoopDelayNs * clock) / 1000000000ULL);
+
+    return (uint8_t)((filter < BITTIMING_TDC_MAX) ? filter : BITTIMING_TDC_MAX);
+}
@@ -0,0 +1,127 @@
+#include "canFilter.h"
+
+#define CANFILTER_STD_ID_MAX    (0x7FFUL)
+#define CANFILTER_EXT_ID_MAX    (0x1FFFFFFFUL)
+
+static uint32_t _GetLe32(const uint8_t * p)
+{
+    return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+            ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+
+/*
+ * Checks one element: ID type, filter type, action and IDs
+ */
+static bool _Valid(const CanFilter_t * pFilter)
+{
+    const uint32_t maxId = (pFilter->idType == 0) ? CANFILTER_STD_ID_MAX : CANFILTER_EXT_ID_MAX;
+
+    if((pFilter->idType > 1) || (pFilter->filterType > CAN_FILTER_TYPE_MASK) ||
+            (pFilter->action > CAN_FILTER_ACTION_REJECT)) {
+        return false;
+    }
+    if((pFilter->id1 > maxId) || (pFilter->id2 > maxId)) {
+        return false;
+    }
+    if((pFilter->filterType == CAN_FILTER_TYPE_RANGE) && (pFilter->id1 > pFilter->id2)) {
+        return false;
+    }
+    return true;
+}
+
+
+/*
+ * Adds a parsed element to the list, false if it is invalid
+ */
+static bool _Add(CanFilterList_t * pList, const CanFilter_t * pFilter)
+{
+    if(!_Valid(pFilter)) {
+        return false;
+    }
+    pList->entry[pList->count++] = *pFilter;
+    if(pFilter->idType == 0) {
+        pList->stdCount++;
+    } else {
+        pList->extCount++;
+    }
+    return true;
+}
+
+
+/*
+ * Parses count CAN_FAST_LANE_ENTRY_SIZE byte entries into ranges routed to
+ * Rx FIFO 1. Returns false if an entry is invalid or the list is longer
+ * than CANFILTER_MAX; pList is left partly filled then.
+ */
+bool CANFILTER_ParseFastLane(CanFilterList_t * pList, const uint8_t * pEntries, uint32_t count)
+{
+    CanFilter_t filter;
+    uint32_t n;
+
+    pList->count = 0;
+    pList->stdCount = 0;
+    pList->extCount = 0;
+    if(count > CANFILTER_MAX) {
+        return false;
+    }
+
+    for(n = 0; n < count; n++) {
+        const uint8_t * pEntry = &pEntries[n * CAN_FAST_LANE_ENTRY_SIZE];
+
+        filter.idType = pEntry[0];
+        filter.filterType = CAN_FILTER_TYPE_RANGE;
+        filter.action = CAN_FILTER_ACTION_FIFO1;
+        filter.id1 = _GetLe32(&pEntry[1]);
+        filter.id2 = _GetLe32(&pEntry[5]);
+        if(!_Add(pList, &filter)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/*
+ * Parses count CAN_FILTER_ENTRY_SIZE byte entries. Returns false if an
+ * entry is invalid or the list is longer than CANFILTER_MAX; pList is
+ * left partly filled then.
+ */
+bool CANFILTER_ParseFilters(CanFilterList_t * pList, const uint8_t * pEntries, uint32_t count)
+{
+    CanFilter_t filter;
+    uint32_t n;
+
+    pList->count = 0;
+    pList->stdCount = 0;
+    pList->extCount = 0;
+    if(count > CANFILTER_MAX) {
+        return false;
+    }
+
+    for(n = 0; n < count; n++) {
+        const uint8_t * pEntry = &pEntries[n * CAN_FILTER_ENTRY_SIZE];
+
+        filter.idType = pEntry[0];
+        filter.filterType = pEntry[1];
+        filter.action = pEntry[2];
+        filter.id1 = _GetLe32(&pEntry[3]);
+        filter.id2 = _GetLe32(&pEntry[7]);
+        if(!_Add(pList, &filter)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/*
+ * True if both lists fit together in stdMax standard and extMax extended
+ * filter elements
+ */
+bool CANFILTER_Fits(const CanFilterList_t * pList, const CanFilterList_t * pOther,
+        uint32_t stdMax, uint32_t extMax)
+{
+    return (((pList->stdCount + pOther->stdCount) <= stdMax) &&
+            ((pList->extCount + pOther->extCount) <= extMax));
+}
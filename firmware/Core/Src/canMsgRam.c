@@ -0,0 +1,148 @@
+#include "string.h"
+#include "canMsgRam.h"
+
+#define MSGRAM_T0_XTD       (1UL << 30)
+#define MSGRAM_T0_STDID_Pos (18U)
+#define MSGRAM_T1_FDF       (1UL << 21)
+#define MSGRAM_T1_BRS       (1UL << 20)
+#define MSGRAM_T1_DLC_Pos   (16U)
+#define MSGRAM_T1_EFC       (1UL << 23)
+#define MSGRAM_T1_MM_Pos    (24U)
+#define MSGRAM_R0_XTD       (1UL << 30)
+#define MSGRAM_R0_STDID_Pos (18U)
+#define MSGRAM_R1_DLC_Pos   (16U)
+#define MSGRAM_E1_MM_Pos    (24U)
+#define MSGRAM_E1_TXTS_Msk  (0xFFFFUL)
+
+static const uint8_t msgRamDlcBytes[16] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64
+};
+
+/*
+ * RX_TYPE of CMD_SEND_UPSTREAM, indexed by the XTD, FDF and BRS bits of
+ * an Rx element ([2] XTD, [1] FDF, [0] BRS)
+ *   bit0: 1 - CAN-FD
+ *   bit1: 1 - BRS off
+ *   bit2: 1 - extended ID
+ */
+static const uint8_t msgRamRxType[8] = {
+    0x2, 0x0, 0x3, 0x1, 0x6, 0x4, 0x7, 0x5
+};
+
+/*
+ * Smallest DLC code holding the given number of data bytes (up to 64)
+ */
+uint8_t MSGRAM_BytesToDlc(uint8_t bytes)
+{
+    if(bytes <= 8) {
+        return bytes;
+    }
+    if(bytes <= 24) {
+        return 9 + (bytes - 9) / 4;
+    }
+    if(bytes <= 32) {
+        return 13;
+    }
+    if(bytes <= 48) {
+        return 14;
+    }
+    return 15;
+}
+
+
+uint8_t MSGRAM_DlcToBytes(uint8_t dlc)
+{
+    return msgRamDlcBytes[dlc & 0x0F];
+}
+
+
+/*
+ * Writes a data frame into a Tx buffer element. The data field is padded
+ * with 0x00 up to the DLC size. Only whole words are written, as required
+ * by the message RAM. The marker is only used with MSGRAM_TX_EVENT.
+ */
+void MSGRAM_EncodeTx(volatile uint32_t * pElement, uint32_t identifier, uint8_t flags,
+        uint8_t marker, const uint8_t * pData, uint8_t len)
+{
+    const uint8_t dlc = MSGRAM_BytesToDlc(len);
+    const uint32_t size = msgRamDlcBytes[dlc];
+    uint32_t t1 = (uint32_t)dlc << MSGRAM_T1_DLC_Pos;
+    uint32_t word;
+    uint32_t n;
+
+    if((flags & MSGRAM_TX_EXTENDED) != 0) {
+        pElement[0] = MSGRAM_T0_XTD | (identifier & 0x1FFFFFFFUL);
+    } else {
+        pElement[0] = (identifier & 0x7FFUL) << MSGRAM_T0_STDID_Pos;
+    }
+    if((flags & MSGRAM_TX_FD) != 0) {
+        t1 |= MSGRAM_T1_FDF;
+        if((flags & MSGRAM_TX_BRS) != 0) {
+            t1 |= MSGRAM_T1_BRS;
+        }
+    }
+    if((flags & MSGRAM_TX_EVENT) != 0) {
+        t1 |= MSGRAM_T1_EFC | ((uint32_t)marker << MSGRAM_T1_MM_Pos);
+    }
+    pElement[1] = t1;
+    pElement += 2;
+
+    for(n = 0; (n + 4) <= len; n += 4) {
+        memcpy(&word, &pData[n], 4);
+        *pElement++ = word;
+    }
+    if(n < size) {
+        // Last partial word, then padding
+        word = 0;
+        memcpy(&word, &pData[n], len - n);
+        *pElement++ = word;
+        for(n += 4; n < size; n += 4) {
+            *pElement++ = 0;
+        }
+    }
+}
+
+
+/*
+ * Reads an Rx FIFO element in one pass. The identifier, the RX_TYPE and the
+ * data are returned, and the data length in bytes is the return value.
+ * pData may be NULL when only the header is needed. Otherwise it must hold
+ * 64 bytes, because the data is copied in whole words.
+ */
+uint8_t MSGRAM_DecodeRx(const volatile uint32_t * pElement, uint32_t * pIdentifier,
+        uint8_t * pType, uint8_t * pData)
+{
+    const uint32_t r0 = pElement[0];
+    const uint32_t r1 = pElement[1];
+    const uint8_t len = msgRamDlcBytes[(r1 >> MSGRAM_R1_DLC_Pos) & 0x0F];
+    uint32_t word;
+    uint32_t n;
+
+    if((r0 & MSGRAM_R0_XTD) != 0) {
+        *pIdentifier = r0 & 0x1FFFFFFFUL;
+    } else {
+        *pIdentifier = (r0 >> MSGRAM_R0_STDID_Pos) & 0x7FFUL;
+    }
+    *pType = msgRamRxType[((r0 >> 28) & 0x4) | ((r1 >> 20) & 0x3)];
+
+    if(pData != NULL) {
+        for(n = 0; n < len; n += 4) {
+            word = pElement[2 + n / 4];
+            memcpy(&pData[n], &word, 4);
+        }
+    }
+    return len;
+}
+
+
+/*
+ * Reads a Tx Event FIFO element. Returns the message marker of the frame;
+ * the timestamp counter value at its start of frame goes to pTxTimestamp.
+ */
+uint8_t MSGRAM_DecodeTxEvent(const volatile uint32_t * pElement, uint16_t * pTxTimestamp)
+{
+    const uint32_t e1 = pElement[1];
+
+    *pTxTimestamp = (uint16_t)(e1 & MSGRAM_E1_TXTS_Msk);
+    return (uint8_t)(e1 >> MSGRAM_E1_MM_Pos);
+}
@@ -9,37 +9,152 @@
 #include "main.h"
 #include "canParser.h"
 #include "frameParser.h"
+#include "UTIL_ringbuf.h"
+#include "idFilter.h"
+#include "canFilter.h"
+#include "canMsgRam.h"
+#include "txQueue.h"
+#include "txSlab.h"
+#include "bitTiming.h"
+#include "upBatch.h"
 
-#define CANTX_Q_SIZE    (8)
+#define CANRX_Q_SIZE    (64)
+#define CANRX_FAST_Q_SIZE   (16)
+#define CANTXEVT_Q_SIZE     (32)
 
-volatile uint32_t canTxRdPtr = 0;
-volatile uint32_t canTxWrPtr = 0;
-static CanTx_t canTxSto[CANTX_Q_SIZE];
+/*
+ * Received CAN frame, queued by the FDCAN1 interrupt for CANRX_Process()
+ */
+typedef struct {
+    uint32_t identifier;
+    uint32_t timestamp;     // TIM2 counter (10us) at reception
+    uint8_t type;           // RX_TYPE
+    uint8_t dlc;            // data length in bytes
+    uint8_t data[CONFIG_CANFD_DATA_SIZE];
+} CanRx_t;
+
+/*
+ * Queue of received frames, single producer (FDCAN1 interrupt), single
+ * consumer (CANRX_Process)
+ */
+typedef struct {
+    volatile uint32_t rdPtr;
+    volatile uint32_t wrPtr;
+    uint32_t size;
+    CanRx_t * pSto;
+} CanRxQ_t;
+
+/*
+ * Tx event, queued by the FDCAN1 interrupt for CMD_TX_EVENT. TXTS comes
+ * from TIM3 (1us); TIM3 and TIM2 are sampled together when the event is
+ * read, so the host can place TXTS on the TIM2 time base.
+ */
+typedef struct {
+    uint32_t readTime;      // TIM2 counter (10us) when the event was read
+    uint16_t txTimestamp;   // TXTS, TIM3 counter at start of frame
+    uint16_t readTs;        // TIM3 counter when the event was read
+    uint8_t marker;         // message marker given by the host
+} CanTxEvt_t;
+
+// Tx frames, packed in txSlab, slot order kept by txQueue; FIFO order unless canTxPriority
+static uint8_t canTxHandle[TXQUEUE_SIZE];
+static bool canTxPriority = false;
+
+// Tx events, single producer (FDCAN1 interrupt), single consumer (CANTX_Process)
+static CanTxEvt_t canTxEvtSto[CANTXEVT_Q_SIZE];
+static volatile uint32_t canTxEvtRdPtr = 0;
+static volatile uint32_t canTxEvtWrPtr = 0;
+
+// Rx FIFO 0 - all other traffic
+static CanRx_t canRxSto[CANRX_Q_SIZE];
+static CanRxQ_t canRxQ = { 0, 0, CANRX_Q_SIZE, canRxSto };
+// Rx FIFO 1 - fast lane, IDs routed by CAN_SetFastLane() or CAN_SetFilters()
+static CanRx_t canRxFastSto[CANRX_FAST_Q_SIZE];
+static CanRxQ_t canRxFastQ = { 0, 0, CANRX_FAST_Q_SIZE, canRxFastSto };
 
 extern FDCAN_HandleTypeDef hfdcan1;
+extern TIM_HandleTypeDef htim2;
+extern TIM_HandleTypeDef htim3;
+extern tRingBufObject usbTxRb;
+
+static CanFilterList_t canFastLane;     // CAN_SetFastLane()
+static CanFilterList_t canFilters;      // CAN_SetFilters()
+static CanFilterList_t canFilterNew;    // list being checked
 
 static CanStat_t canStat = {0};
 static uint32_t can_tx_loss_packet_count = 0;
 
-static bool CAN_txQ_full()
+// Upstream batch (CMD_SEND_UPSTREAM_BATCH)
+static UpBatch_t upBatch = { .len = UPBATCH_RECORD_OFFSET };
+static bool upBatchEnabled = false;
+static uint16_t upBatchMaxAge = CONFIG_UPSTREAM_BATCH_AGE;
+
+static bool CAN_txQ_empty()
 {
-    return (((canTxWrPtr + 1) % CANTX_Q_SIZE) == canTxRdPtr);
+    return (TXQUEUE_Count() == 0);
 }
 
-static bool CAN_txQ_empty()
+/*
+ * Queue key of a Tx slot: 0 in FIFO mode, otherwise the arbitration order
+ * on the bus, i.e. base ID, then standard before extended, then ID
+ * extension. Ties go out in submission order.
+ */
+static uint32_t CAN_txQ_key(uint32_t identifier, uint8_t flags)
 {
-    return (canTxWrPtr == canTxRdPtr);
+    if(!canTxPriority) {
+        return 0;
+    }
+    if((flags & MSGRAM_TX_EXTENDED) != 0) {
+        return ((identifier & 0x1FFFFFFFUL) << 1) | 1UL;
+    }
+    return (identifier & 0x7FFUL) << 19;
 }
 
-bool CAN_Send(CanTx_t * pCanTx)
+static uint32_t CAN_txQ_rekey(uint8_t slot)
 {
-	bool isOK = true;
+    uint32_t identifier;
+    uint8_t flags;
+    uint8_t marker;
 
-    if(pCanTx == (CanTx_t *)0) {
-        return false;
+    (void)TXSLAB_Get(canTxHandle[slot], &identifier, &flags, &marker, NULL);
+    return CAN_txQ_key(identifier, flags);
+}
+
+/*
+ * Free Tx FIFO/queue elements. In Tx queue mode TFFL reads as zero, the
+ * free elements are the ones without a pending request.
+ */
+static uint32_t CAN_txHw_free(void)
+{
+    if((hfdcan1.Instance->TXBC & FDCAN_TXBC_TFQM) != 0U) {
+        return 3U - (uint32_t)__builtin_popcount(hfdcan1.Instance->TXBRP & 0x7U);
     }
+    return HAL_FDCAN_GetTxFifoFreeLevel(&hfdcan1);
+}
+
+/*
+ * Free Tx queue slots, and in pChunks the free Tx slab chunks. CAN_Send()
+ * accepts a frame of len data bytes while a slot and TXSLAB_ChunksFor(len)
+ * chunks are free, i.e. these are the downstream credits. Only to be
+ * called in Thread mode, like CAN_Send().
+ */
+uint32_t CAN_GetTxFree(uint32_t * pChunks)
+{
+    *pChunks = TXSLAB_GetFree();
+    return TXQUEUE_GetFree();
+}
+
+/*
+ * Queues a data frame for CANTX_Process(), packed to its length. flags are
+ * MSGRAM_TX_xxx, len is the data length in bytes. Returns false if the Tx
+ * queue is full.
+ */
+bool CAN_Send(uint32_t identifier, uint8_t flags, uint8_t marker,
+        const uint8_t * pData, uint8_t len)
+{
+	bool isOK = true;
 
-    if(CAN_txQ_full()) {
+    if((TXQUEUE_GetFree() == 0) || (TXSLAB_GetFree() < TXSLAB_ChunksFor(len))) {
         return false;
     }
 
@@ -51,12 +166,20 @@ bool CAN_Send(CanTx_t * pCanTx)
         __disable_irq();
     }
 
-    if(((canTxWrPtr + 1) % CANTX_Q_SIZE) == canTxRdPtr) {
+    int32_t handle = -1;
+    int32_t slot = TXQUEUE_Alloc();
+    if(slot >= 0) {
+        handle = TXSLAB_Put(identifier, flags, marker, pData, len);
+        if(handle < 0) {
+            TXQUEUE_Free((uint8_t)slot);
+        }
+    }
+    if(handle < 0) {
         // Full
         isOK = false;
     } else {
-        memcpy(&canTxSto[canTxWrPtr], pCanTx, sizeof(CanTx_t));
-        canTxWrPtr = (canTxWrPtr + 1) % CANTX_Q_SIZE;
+        canTxHandle[slot] = (uint8_t)handle;
+        TXQUEUE_Push((uint8_t)slot, CAN_txQ_key(identifier, flags));
     }
     /* Exit Critical Section */
     if(isrContext == 0) {
@@ -69,6 +192,89 @@ bool CAN_Send(CanTx_t * pCanTx)
 }
 
 
+/*
+ * Cut-through transmission: writes a data frame straight into a free Tx
+ * FIFO element and requests it, skipping the Tx queue. Only done when
+ * nothing is queued, so frames keep their order. Returns false if the
+ * frame must go through CAN_Send() instead. Thread mode only, like
+ * CANTX_Process().
+ */
+bool CAN_SendDirect(uint32_t identifier, uint8_t flags, uint8_t marker,
+        const uint8_t * pData, uint8_t len)
+{
+    uint32_t putIndex;
+
+    if((hfdcan1.State != HAL_FDCAN_STATE_BUSY) || !CAN_txQ_empty()) {
+        return false;
+    }
+    if((hfdcan1.Instance->TXFQS & FDCAN_TXFQS_TFQF) != 0U) {
+        return false;
+    }
+
+    putIndex = (hfdcan1.Instance->TXFQS & FDCAN_TXFQS_TFQPI) >> FDCAN_TXFQS_TFQPI_Pos;
+    MSGRAM_EncodeTx((volatile uint32_t *)(hfdcan1.msgRam.TxFIFOQSA + putIndex * MSGRAM_TX_ELEMENT_SIZE),
+            identifier, flags, marker, pData, len);
+    hfdcan1.Instance->TXBAR = (1UL << putIndex);
+    hfdcan1.LatestTxFifoQRequest = (1UL << putIndex);
+
+    return true;
+}
+
+
+/*
+ * Tx events (CMD_TX_EVENT)
+ *   Payload[0]   : CMD_TX_EVENT
+ *   Payload[1]   : Number of records
+ *   Records...   : [marker][TXTS (LE16)][read TIM3 (LE16)][read TIM2 (LE32)]
+ */
+#define TX_EVT_RECORD_SIZE      (9)
+
+static void CAN_txEvt_send(void)
+{
+    uint32_t count = (canTxEvtWrPtr + CANTXEVT_Q_SIZE - canTxEvtRdPtr) % CANTXEVT_Q_SIZE;
+    uint8_t * buffer;
+    uint32_t len = 0;
+
+    if(count == 0) {
+        return;
+    }
+    if(count > CONFIG_TX_EVENT_BATCH) {
+        count = CONFIG_TX_EVENT_BATCH;
+    }
+
+    buffer = PARSER_ReserveFrame(FRAME_OVERHEAD + 2 + count * TX_EVT_RECORD_SIZE);
+    if(buffer == NULL) {
+        // Left queued, retried on the next pass
+        return;
+    }
+
+    buffer[PAYLOAD_OFFSET + len++] = CMD_TX_EVENT;
+    buffer[PAYLOAD_OFFSET + len++] = (uint8_t)count;
+
+    // Read the entries only after seeing the index that published them
+    __DMB();
+    while(count-- > 0) {
+        const CanTxEvt_t * pEvt = &canTxEvtSto[canTxEvtRdPtr];
+
+        buffer[PAYLOAD_OFFSET + len++] = pEvt->marker;
+        buffer[PAYLOAD_OFFSET + len++] = (uint8_t)(pEvt->txTimestamp & 0xFF);
+        buffer[PAYLOAD_OFFSET + len++] = (uint8_t)((pEvt->txTimestamp >> 8) & 0xFF);
+        buffer[PAYLOAD_OFFSET + len++] = (uint8_t)(pEvt->readTs & 0xFF);
+        buffer[PAYLOAD_OFFSET + len++] = (uint8_t)((pEvt->readTs >> 8) & 0xFF);
+        buffer[PAYLOAD_OFFSET + len++] = (uint8_t)(pEvt->readTime & 0xFF);
+        buffer[PAYLOAD_OFFSET + len++] = (uint8_t)((pEvt->readTime >> 8) & 0xFF);
+        buffer[PAYLOAD_OFFSET + len++] = (uint8_t)((pEvt->readTime >> 16) & 0xFF);
+        buffer[PAYLOAD_OFFSET + len++] = (uint8_t)((pEvt->readTime >> 24) & 0xFF);
+
+        // Done with the entry before handing it back to the interrupt
+        __DMB();
+        canTxEvtRdPtr = (canTxEvtRdPtr + 1) % CANTXEVT_Q_SIZE;
+    }
+    len += FRAME_OVERHEAD;
+    PARSER_CommitFrame(buffer, len);
+}
+
+
 void CANTX_Process(void)
 {
     // Note: To avoid data race condition, this function is only
@@ -78,32 +284,514 @@ void CANTX_Process(void)
         Error_Handler();
     }
 
-    if(hfdcan1.State == HAL_FDCAN_STATE_BUSY) {
-        if(HAL_FDCAN_GetTxFifoFreeLevel(&hfdcan1) > 0) {
-            if(!CAN_txQ_empty()) {
-                CanTx_t canTx = canTxSto[canTxRdPtr];
+    // Also after a stop, so the events of the last frames are not held back
+    CAN_txEvt_send();
+
+    if(hfdcan1.State != HAL_FDCAN_STATE_BUSY) {
+        return;
+    }
+
+    // Fill every free Tx FIFO element, so a burst leaves no gap on the bus
+    uint32_t txFree = CAN_txHw_free();
+    while((txFree > 0) && !CAN_txQ_empty()) {
+        /* Enter Critical Section */
+        uint32_t primask_bit = __get_PRIMASK();
+        __disable_irq();
+
+        // Take the first frame, its slot and chunks stay allocated until written
+        int32_t slot = TXQUEUE_Pop();
+
+        /* Exit Critical Section */
+        if(primask_bit == 0) {
+            __enable_irq();
+        }
+
+        if(slot < 0) {
+            break;
+        }
+        // Rebuild the HAL header, the data padded up to the DLC size
+        FDCAN_TxHeaderTypeDef header;
+        uint8_t data[CONFIG_CANFD_DATA_SIZE];
+        uint8_t flags;
+        uint8_t marker;
+        const uint8_t len = TXSLAB_Get(canTxHandle[slot], &header.Identifier, &flags, &marker, data);
+
+        header.DataLength = MSGRAM_BytesToDlc(len);     // FDCAN_DLC_BYTES_xx are the raw DLC values
+        memset(&data[len], 0, MSGRAM_DlcToBytes(header.DataLength) - len);
+        header.IdType = ((flags & MSGRAM_TX_EXTENDED) != 0) ? FDCAN_EXTENDED_ID : FDCAN_STANDARD_ID;
+        header.TxFrameType = FDCAN_DATA_FRAME;
+        header.ErrorStateIndicator = FDCAN_ESI_ACTIVE;
+        header.FDFormat = ((flags & MSGRAM_TX_FD) != 0) ? FDCAN_FD_CAN : FDCAN_CLASSIC_CAN;
+        header.BitRateSwitch = ((flags & MSGRAM_TX_BRS) != 0) ? FDCAN_BRS_ON : FDCAN_BRS_OFF;
+        header.TxEventFifoControl = ((flags & MSGRAM_TX_EVENT) != 0) ? FDCAN_STORE_TX_EVENTS : FDCAN_NO_TX_EVENTS;
+        header.MessageMarker = marker;
+
+        bool isSent = (HAL_OK == HAL_FDCAN_AddMessageToTxFifoQ(&hfdcan1, &header, data));
+
+        /* Enter Critical Section */
+        primask_bit = __get_PRIMASK();
+        __disable_irq();
+
+        if(isSent) {
+            // Success - release the slot
+            TXSLAB_Free(canTxHandle[slot]);
+            TXQUEUE_Free((uint8_t)slot);
+        } else {
+            // Failed - keep packet in queue, in its old place, for retry next time
+            TXQUEUE_Requeue((uint8_t)slot);
+        }
+
+        /* Exit Critical Section */
+        if(primask_bit == 0) {
+            __enable_irq();
+        }
+
+        if(!isSent) {
+            can_tx_loss_packet_count++;
+            break;
+        }
+        txFree--;
+    }
+}
+
+
+/*
+ * Switches between FIFO order and ID priority order, both for the Tx queue
+ * and for the Tx FIFO/queue of FDCAN1 (TXBC.TFQM). In priority mode the
+ * frame with the lowest ID goes out first, as in bus arbitration. Only
+ * while CAN is stopped, TXBC is write protected otherwise.
+ */
+bool CAN_SetTxPriority(bool enable)
+{
+    if(hfdcan1.State != HAL_FDCAN_STATE_READY) {
+        return false;
+    }
+
+    MODIFY_REG(hfdcan1.Instance->TXBC, FDCAN_TXBC_TFQM,
+            enable ? FDCAN_TX_QUEUE_OPERATION : FDCAN_TX_FIFO_OPERATION);
+    hfdcan1.Init.TxFifoQueueMode = enable ? FDCAN_TX_QUEUE_OPERATION : FDCAN_TX_FIFO_OPERATION;
+
+    /* Enter Critical Section */
+    uint32_t primask_bit = __get_PRIMASK();
+    __disable_irq();
+
+    // Frames still queued are reordered
+    canTxPriority = enable;
+    TXQUEUE_Rekey(CAN_txQ_rekey);
+
+    /* Exit Critical Section */
+    if(primask_bit == 0) {
+        __enable_irq();
+    }
+
+    return true;
+}
+
+
+/*
+ * Sets the nominal and data bit rates (bit/s) with their sample points
+ * (per mille), solved for the FDCAN kernel clock by bitTiming. TDC is on
+ * for data rates from BITTIMING_TDC_MIN_BITRATE and off below. Only while
+ * CAN is stopped: NBTP, DBTP and TDCR are write protected otherwise.
+ * Nothing is changed if either rate cannot be solved. Returns a
+ * CAN_BITRATE_xxx status.
+ */
+uint8_t CAN_SetBitrate(uint32_t nominalBitrate, uint16_t nominalSamplePoint,
+        uint32_t dataBitrate, uint16_t dataSamplePoint)
+{
+    BitTiming_t nominal;
+    BitTiming_t data;
+    const bool useTdc = (dataBitrate >= BITTIMING_TDC_MIN_BITRATE);
+    uint32_t clock = HAL_RCCEx_GetPeriphCLKFreq(RCC_PERIPHCLK_FDCAN);
+    uint8_t result;
+
+    if(hfdcan1.State != HAL_FDCAN_STATE_READY) {
+        return CAN_BITRATE_ERROR;
+    }
+    if(hfdcan1.Init.ClockDivider != FDCAN_CLOCK_DIV1) {
+        clock /= (hfdcan1.Init.ClockDivider * 2U);
+    }
+    result = BITTIMING_Solve(clock, nominalBitrate, nominalSamplePoint, &BITTIMING_NOMINAL, &nominal);
+    if(result != BITTIMING_OK) {
+        return (result == BITTIMING_ERR_SAMPLE_POINT) ? CAN_BITRATE_NOMINAL_SP : CAN_BITRATE_NOMINAL_RATE;
+    }
+    result = BITTIMING_Solve(clock, dataBitrate, dataSamplePoint,
+            useTdc ? &BITTIMING_DATA_TDC : &BITTIMING_DATA, &data);
+    if(result != BITTIMING_OK) {
+        return (result == BITTIMING_ERR_SAMPLE_POINT) ? CAN_BITRATE_DATA_SP : CAN_BITRATE_DATA_RATE;
+    }
+
+    hfdcan1.Init.NominalPrescaler = nominal.prescaler;
+    hfdcan1.Init.NominalSyncJumpWidth = nominal.sjw;
+    hfdcan1.Init.NominalTimeSeg1 = nominal.seg1;
+    hfdcan1.Init.NominalTimeSeg2 = nominal.seg2;
+    hfdcan1.Init.DataPrescaler = data.prescaler;
+    hfdcan1.Init.DataSyncJumpWidth = data.sjw;
+    hfdcan1.Init.DataTimeSeg1 = data.seg1;
+    hfdcan1.Init.DataTimeSeg2 = data.seg2;
+
+    // As HAL_FDCAN_Init() writes them, TDC is set below
+    hfdcan1.Instance->NBTP = (((uint32_t)nominal.sjw - 1U) << FDCAN_NBTP_NSJW_Pos) |
+            (((uint32_t)nominal.seg1 - 1U) << FDCAN_NBTP_NTSEG1_Pos) |
+            (((uint32_t)nominal.seg2 - 1U) << FDCAN_NBTP_NTSEG2_Pos) |
+            (((uint32_t)nominal.prescaler - 1U) << FDCAN_NBTP_NBRP_Pos);
+    hfdcan1.Instance->DBTP = (((uint32_t)data.sjw - 1U) << FDCAN_DBTP_DSJW_Pos) |
+            (((uint32_t)data.seg1 - 1U) << FDCAN_DBTP_DTSEG1_Pos) |
+            (((uint32_t)data.seg2 - 1U) << FDCAN_DBTP_DTSEG2_Pos) |
+            (((uint32_t)data.prescaler - 1U) << FDCAN_DBTP_DBRP_Pos);
+
+    if(useTdc) {
+        if((HAL_FDCAN_ConfigTxDelayCompensation(&hfdcan1, BITTIMING_TdcOffset(&data),
+                BITTIMING_TdcFilter(&data, clock, CONFIG_TDC_MIN_LOOP_DELAY)) != HAL_OK) ||
+           (HAL_FDCAN_EnableTxDelayCompensation(&hfdcan1) != HAL_OK)) {
+            return CAN_BITRATE_ERROR;
+        }
+    } else {
+        // Left on from a faster data rate otherwise
+        if(HAL_FDCAN_DisableTxDelayCompensation(&hfdcan1) != HAL_OK) {
+            return CAN_BITRATE_ERROR;
+        }
+    }
+
+    return CAN_BITRATE_OK;
+}
+
+
+static void CAN_upBatch_flush(void)
+{
+    const uint32_t length = UPBATCH_Finish(&upBatch);
+
+    if(length == 0) {
+        return;
+    }
+    PARSER_SendFrame(upBatch.buffer, length);
+    UPBATCH_Init(&upBatch);
+}
+
+
+static void CAN_upBatch_add(uint8_t type, uint32_t identifier, uint8_t dlc,
+        const uint8_t * pData, uint32_t timestamp)
+{
+    uint32_t capacity;
+    uint32_t trailerExtra;
+
+    // Batch frame is limited by the space left in the USB Tx buffer, less
+    // the part of a CRC-32 trailer that is not held in upBatch.buffer
+    capacity = UTIL_RingBufFree(&usbTxRb);
+    trailerExtra = PARSER_GetTrailerSize() - 1;
+    capacity = (capacity > trailerExtra) ? (capacity - trailerExtra) : 0;
+
+    if(!UPBATCH_Add(&upBatch, type, identifier, dlc, pData, timestamp, capacity)) {
+        // An empty batch always takes the record
+        CAN_upBatch_flush();
+        (void)UPBATCH_Add(&upBatch, type, identifier, dlc, pData, timestamp, capacity);
+    }
+}
+
+
+void CAN_SetUpstreamBatch(bool enable, uint16_t maxAge)
+{
+    // Do not mix pending records with the new settings
+    CAN_upBatch_flush();
+
+    upBatchEnabled = enable;
+    upBatchMaxAge = (maxAge == 0) ? CONFIG_UPSTREAM_BATCH_AGE : maxAge;
+}
+
+
+/*
+ * Writes the fast lane elements followed by the host filters into the
+ * message RAM, and disables the remaining elements. The elements are
+ * evaluated in order and the first match wins, so a fast lane ID is
+ * always routed to Rx FIFO 1.
+ */
+static bool CAN_filter_apply(void)
+{
+    FDCAN_FilterTypeDef filter;
+    uint32_t stdCount = 0;
+    uint32_t extCount = 0;
+    uint32_t n;
+
+    for(n = 0; n < (canFastLane.count + canFilters.count); n++) {
+        const CanFilter_t * pFilter = (n < canFastLane.count) ?
+                &canFastLane.entry[n] : &canFilters.entry[n - canFastLane.count];
+
+        if(pFilter->idType == 0) {
+            filter.IdType = FDCAN_STANDARD_ID;
+            filter.FilterIndex = stdCount++;
+        } else {
+            filter.IdType = FDCAN_EXTENDED_ID;
+            filter.FilterIndex = extCount++;
+        }
+        filter.FilterType = pFilter->filterType;
+        filter.FilterConfig = FDCAN_FILTER_TO_RXFIFO0 + pFilter->action;
+        filter.FilterID1 = pFilter->id1;
+        filter.FilterID2 = pFilter->id2;
+        if(HAL_FDCAN_ConfigFilter(&hfdcan1, &filter) != HAL_OK) {
+            return false;
+        }
+    }
+
+    // Disable the elements left over from a longer list
+    filter.FilterType = FDCAN_FILTER_RANGE;
+    filter.FilterConfig = FDCAN_FILTER_DISABLE;
+    filter.FilterID1 = 0;
+    filter.FilterID2 = 0;
+    filter.IdType = FDCAN_STANDARD_ID;
+    for(filter.FilterIndex = stdCount; filter.FilterIndex < hfdcan1.Init.StdFiltersNbr; filter.FilterIndex++) {
+        if(HAL_FDCAN_ConfigFilter(&hfdcan1, &filter) != HAL_OK) {
+            return false;
+        }
+    }
+    filter.IdType = FDCAN_EXTENDED_ID;
+    for(filter.FilterIndex = extCount; filter.FilterIndex < hfdcan1.Init.ExtFiltersNbr; filter.FilterIndex++) {
+        if(HAL_FDCAN_ConfigFilter(&hfdcan1, &filter) != HAL_OK) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+
+/*
+ * Routes the given ID ranges into Rx FIFO 1, served ahead of everything
+ * else by CANRX_Process(). Each range takes one hardware filter element,
+ * ahead of the host filters (CAN_SetFilters). Nothing is changed if the
+ * list is invalid or does not fit next to the host filters.
+ */
+bool CAN_SetFastLane(const uint8_t * pEntries, uint32_t count)
+{
+    if(!CANFILTER_ParseFastLane(&canFilterNew, pEntries, count) ||
+       !CANFILTER_Fits(&canFilterNew, &canFilters,
+               hfdcan1.Init.StdFiltersNbr, hfdcan1.Init.ExtFiltersNbr)) {
+        return false;
+    }
+
+    canFastLane = canFilterNew;
+
+    return CAN_filter_apply();
+}
+
+
+/*
+ * Replaces the host acceptance filters and sets what happens to frames
+ * matching no element. nonMatchingStd/Ext take FDCAN_ACCEPT_IN_RX_FIFO0,
+ * FDCAN_ACCEPT_IN_RX_FIFO1 or FDCAN_REJECT; rejectRemote bit 0 rejects
+ * standard and bit 1 extended remote frames. The global settings can only
+ * change while the controller is stopped, the filter elements any time.
+ * Nothing is changed if the request is invalid or does not fit.
+ */
+bool CAN_SetFilters(uint8_t nonMatchingStd, uint8_t nonMatchingExt,
+        uint8_t rejectRemote, const uint8_t * pEntries, uint32_t count)
+{
+    uint32_t rxgfc;
+
+    if((nonMatchingStd > FDCAN_REJECT) || (nonMatchingExt > FDCAN_REJECT) ||
+            (rejectRemote > 0x03)) {
+        return false;
+    }
+    if(!CANFILTER_ParseFilters(&canFilterNew, pEntries, count) ||
+       !CANFILTER_Fits(&canFilterNew, &canFastLane,
+               hfdcan1.Init.StdFiltersNbr, hfdcan1.Init.ExtFiltersNbr)) {
+        return false;
+    }
+
+    rxgfc = (((uint32_t)nonMatchingStd << FDCAN_RXGFC_ANFS_Pos) |
+            ((uint32_t)nonMatchingExt << FDCAN_RXGFC_ANFE_Pos) |
+            ((uint32_t)(rejectRemote & 0x01) << FDCAN_RXGFC_RRFS_Pos) |
+            ((uint32_t)((rejectRemote >> 1) & 0x01) << FDCAN_RXGFC_RRFE_Pos));
+    if(rxgfc != READ_BIT(hfdcan1.Instance->RXGFC, FDCAN_RXGFC_ANFS |
+            FDCAN_RXGFC_ANFE | FDCAN_RXGFC_RRFS | FDCAN_RXGFC_RRFE)) {
+        if(HAL_FDCAN_ConfigGlobalFilter(&hfdcan1, nonMatchingStd, nonMatchingExt,
+                rejectRemote & 0x01, (rejectRemote >> 1) & 0x01) != HAL_OK) {
+            // Controller started
+            return false;
+        }
+    }
+
+    canFilters = canFilterNew;
+
+    return CAN_filter_apply();
+}
+
+
+static void CAN_rx_lost(void)
+{
+    if(canStat.RxLostCnt < UINT16_MAX) {
+        canStat.RxLostCnt++;
+    }
+}
+
 
-                // Try to send to FDCAN hardware
-                if(HAL_OK == HAL_FDCAN_AddMessageToTxFifoQ(&hfdcan1, &(canTx.header), canTx.data)) {
-                    /* Enter Critical Section */
-                    uint32_t primask_bit = __get_PRIMASK();
-                    __disable_irq();
+/*
+ * Moves every frame in a hardware Rx FIFO into a queue, together with its
+ * reception time. The Rx elements are decoded straight from the message
+ * RAM. Called from the FDCAN1 interrupt.
+ */
+static void CAN_rx_drain(FDCAN_HandleTypeDef *hfdcan, uint32_t rxFifo, CanRxQ_t * pQ)
+{
+    // RXF0S/RXF1S and RXF0A/RXF1A have the same layout
+    volatile uint32_t * const pStatus = (rxFifo == FDCAN_RX_FIFO0) ?
+            &hfdcan->Instance->RXF0S : &hfdcan->Instance->RXF1S;
+    volatile uint32_t * const pAck = (rxFifo == FDCAN_RX_FIFO0) ?
+            &hfdcan->Instance->RXF0A : &hfdcan->Instance->RXF1A;
+    const uint32_t fifoAddr = (rxFifo == FDCAN_RX_FIFO0) ?
+            hfdcan->msgRam.RxFIFO0SA : hfdcan->msgRam.RxFIFO1SA;
+    const uint32_t timestamp = __HAL_TIM_GET_COUNTER(&htim2);
+    uint32_t status;
 
-                    // Success - remove from queue
-                    canTxRdPtr = (canTxRdPtr + 1) % CANTX_Q_SIZE;
+    while(((status = *pStatus) & FDCAN_RXF0S_F0FL) != 0) {
+        const uint32_t getIndex = (status & FDCAN_RXF0S_F0GI) >> FDCAN_RXF0S_F0GI_Pos;
+        const volatile uint32_t * pElement =
+                (const volatile uint32_t *)(fifoAddr + getIndex * MSGRAM_RX_ELEMENT_SIZE);
+        const uint32_t wrPtr = pQ->wrPtr;
+        const uint32_t nextWrPtr = (wrPtr + 1) % pQ->size;
+        CanRx_t * pRx = &pQ->pSto[wrPtr];
 
-                    /* Exit Critical Section */
-                    if(primask_bit == 0) {
-                        __enable_irq();
-                    }
-                } else {
-                    // Failed - keep packet in queue for retry next time
-                    can_tx_loss_packet_count++;
-                }
+        if(nextWrPtr == pQ->rdPtr) {
+            // Queue full - drop the frame so the hardware FIFO keeps running
+            uint32_t identifier;
+            uint8_t type;
 
+            MSGRAM_DecodeRx(pElement, &identifier, &type, NULL);
+            *pAck = getIndex;
+            if(IDFILTER_Accept((type & 0x4) != 0, identifier)) {
+                CAN_rx_lost();
             }
+            continue;
+        }
+
+        pRx->dlc = MSGRAM_DecodeRx(pElement, &pRx->identifier, &pRx->type, pRx->data);
+        *pAck = getIndex;
+        if(!IDFILTER_Accept((pRx->type & 0x4) != 0, pRx->identifier)) {
+            // Dropped by the software ID filter, the slot is reused
+            continue;
+        }
+        pRx->timestamp = timestamp;
+
+        // Entry must be complete before the consumer can see it
+        __DMB();
+        pQ->wrPtr = nextWrPtr;
+    }
+}
+
+
+/*
+ * FDCAN1_IT0: new message, FIFO full and message lost on either Rx FIFO.
+ * The hardware FIFOs only hold 3 frames each, so they are moved into the
+ * software queues right away.
+ */
+void HAL_FDCAN_RxFifo0Callback(FDCAN_HandleTypeDef *hfdcan, uint32_t RxFifo0ITs)
+{
+    if((RxFifo0ITs & FDCAN_IT_RX_FIFO0_MESSAGE_LOST) != 0) {
+        // Hardware FIFO overrun
+        CAN_rx_lost();
+    }
+    CAN_rx_drain(hfdcan, FDCAN_RX_FIFO0, &canRxQ);
+}
+
+
+static void CAN_txEvt_lost(void)
+{
+    if(canStat.TxEventLostCnt < UINT16_MAX) {
+        canStat.TxEventLostCnt++;
+    }
+}
+
+
+/*
+ * FDCAN1_IT0: Tx Event FIFO new element and element lost. The events are
+ * read straight from the message RAM into the Tx event queue.
+ */
+void HAL_FDCAN_TxEventFifoCallback(FDCAN_HandleTypeDef *hfdcan, uint32_t TxEventFifoITs)
+{
+    const uint16_t readTs = (uint16_t)__HAL_TIM_GET_COUNTER(&htim3);
+    const uint32_t readTime = __HAL_TIM_GET_COUNTER(&htim2);
+    uint32_t status;
+
+    if((TxEventFifoITs & FDCAN_IT_TX_EVT_FIFO_ELT_LOST) != 0) {
+        // Hardware FIFO overrun
+        CAN_txEvt_lost();
+    }
+
+    while(((status = hfdcan->Instance->TXEFS) & FDCAN_TXEFS_EFFL) != 0) {
+        const uint32_t getIndex = (status & FDCAN_TXEFS_EFGI) >> FDCAN_TXEFS_EFGI_Pos;
+        const volatile uint32_t * pElement = (const volatile uint32_t *)
+                (hfdcan->msgRam.TxEventFIFOSA + getIndex * MSGRAM_TXEVT_ELEMENT_SIZE);
+        const uint32_t wrPtr = canTxEvtWrPtr;
+        const uint32_t nextWrPtr = (wrPtr + 1) % CANTXEVT_Q_SIZE;
+        CanTxEvt_t * pEvt = &canTxEvtSto[wrPtr];
+
+        if(nextWrPtr == canTxEvtRdPtr) {
+            // Queue full - drop the event so the hardware FIFO keeps running
+            hfdcan->Instance->TXEFA = getIndex;
+            CAN_txEvt_lost();
+            continue;
         }
+
+        pEvt->marker = MSGRAM_DecodeTxEvent(pElement, &pEvt->txTimestamp);
+        hfdcan->Instance->TXEFA = getIndex;
+        pEvt->readTs = readTs;
+        pEvt->readTime = readTime;
+
+        // Entry must be complete before the consumer can see it
+        __DMB();
+        canTxEvtWrPtr = nextWrPtr;
+    }
+}
+
+
+void HAL_FDCAN_RxFifo1Callback(FDCAN_HandleTypeDef *hfdcan, uint32_t RxFifo1ITs)
+{
+    if((RxFifo1ITs & FDCAN_IT_RX_FIFO1_MESSAGE_LOST) != 0) {
+        // Hardware FIFO overrun
+        CAN_rx_lost();
+    }
+    CAN_rx_drain(hfdcan, FDCAN_RX_FIFO1, &canRxFastQ);
+}
+
+
+/*
+ * Sends one queued frame upstream as CMD_SEND_UPSTREAM (0x11)
+ */
+static void CAN_rx_send(const CanRx_t * pRx)
+{
+    const uint32_t FRAME_CMD_OFFSET = PAYLOAD_OFFSET;
+    const uint32_t FRAME_TYPE_OFFSET = PAYLOAD_OFFSET + 1;
+    const uint32_t FRAME_MSGID_OFFSET = PAYLOAD_OFFSET + 2;
+    const uint32_t FRAME_DLC_OFFSET = PAYLOAD_OFFSET + 6;
+    const uint32_t FRAME_DATA_OFFSET = PAYLOAD_OFFSET + 7;
+
+    uint8_t * sendBuffer = PARSER_ReserveFrame(FRAME_DATA_OFFSET + pRx->dlc + 1);
+    uint32_t length = 0;
+    if(sendBuffer == NULL) {
+        return;
+    }
+    sendBuffer[FRAME_CMD_OFFSET] = CMD_SEND_UPSTREAM;
+    length += 1;
+
+    sendBuffer[FRAME_TYPE_OFFSET] = pRx->type;
+    length += 1;
+
+    sendBuffer[FRAME_MSGID_OFFSET] = (uint8_t)(pRx->identifier & 0xFF);
+    sendBuffer[FRAME_MSGID_OFFSET + 1] = (uint8_t)((pRx->identifier >> 8) & 0xFF);
+    sendBuffer[FRAME_MSGID_OFFSET + 2] = (uint8_t)((pRx->identifier >> 16) & 0xFF);
+    sendBuffer[FRAME_MSGID_OFFSET + 3] = (uint8_t)((pRx->identifier >> 24) & 0xFF);
+    length += 4;
+
+    sendBuffer[FRAME_DLC_OFFSET] = pRx->dlc;
+    length += 1;
+
+    if(pRx->dlc > 0) {
+        memcpy(&sendBuffer[FRAME_DATA_OFFSET], pRx->data, pRx->dlc);
+        length += pRx->dlc;
     }
+
+    length += FRAME_OVERHEAD;
+
+    // Header timestamp is the reception time
+    PARSER_CommitFrameTs(sendBuffer, length, pRx->timestamp);
 }
 
 
@@ -117,108 +805,39 @@ void CANRX_Process(void)
         Error_Handler();
     }
 
-    if(hfdcan1.State == HAL_FDCAN_STATE_BUSY) {
-        while(HAL_FDCAN_GetRxFifoFillLevel(&hfdcan1, FDCAN_RX_FIFO0) > 0) {
-            FDCAN_RxHeaderTypeDef rxHeader;
-            uint8_t rxData[CONFIG_CANFD_DATA_SIZE];
-
-            if(HAL_FDCAN_GetRxMessage(&hfdcan1, FDCAN_RX_FIFO0, &rxHeader, rxData) == HAL_OK) {
-                // Process received message
-                /*
-                 * RX_TYPE
-                 *  bit0: 0 - CAN-CC
-                 *        1 - CAN-FD
-                 *
-                 *  bit1: 0 - BRS_ON
-                 *        1 - BRS_OFF
-                 *
-                 *  bit2: 0 - FDCAN_STANDARD_ID (11-bit identifier)
-                 *        1 - FDCAN_EXTENDED_ID (29-bit identifier)
-                 */
-                uint8_t type = 0;
-                if(rxHeader.FDFormat == FDCAN_FD_CAN) {
-                    type |= 0x1;
-                }
-                if(rxHeader.BitRateSwitch == FDCAN_BRS_OFF) {
-                    type |= 0x2;
-                }
-                if(rxHeader.IdType == FDCAN_EXTENDED_ID) {
-                    type |= 0x4;
-                }
-
-                uint8_t dlc = 0;
-                switch(rxHeader.DataLength) {
-                    case FDCAN_DLC_BYTES_0:
-                    case FDCAN_DLC_BYTES_1:
-                    case FDCAN_DLC_BYTES_2:
-                    case FDCAN_DLC_BYTES_3:
-                    case FDCAN_DLC_BYTES_4:
-                    case FDCAN_DLC_BYTES_5:
-                    case FDCAN_DLC_BYTES_6:
-                    case FDCAN_DLC_BYTES_7:
-                    case FDCAN_DLC_BYTES_8:
-                        dlc = (uint8_t)rxHeader.DataLength;
-                        break;
-                    case FDCAN_DLC_BYTES_12:
-                        dlc = 12;
-                        break;
-                    case FDCAN_DLC_BYTES_16:
-                        dlc = 16;
-                        break;
-                    case FDCAN_DLC_BYTES_20:
-                        dlc = 20;
-                        break;
-                    case FDCAN_DLC_BYTES_24:
-                        dlc = 24;
-                        break;
-                    case FDCAN_DLC_BYTES_32:
-                        dlc = 32;
-                        break;
-                    case FDCAN_DLC_BYTES_48:
-                        dlc = 48;
-                        break;
-                    case FDCAN_DLC_BYTES_64:
-                        dlc = 64;
-                        break;
-                    default: {
-                        dlc = 0;
-                        break;
-                    }
-                }
-                // Send upstream via CMD_SEND_UPSTREAM (0x11)
-                const uint32_t FRAME_CMD_OFFSET = PAYLOAD_OFFSET;
-                const uint32_t FRAME_TYPE_OFFSET = PAYLOAD_OFFSET + 1;
-                const uint32_t FRAME_MSGID_OFFSET = PAYLOAD_OFFSET + 2;
-                const uint32_t FRAME_DLC_OFFSET = PAYLOAD_OFFSET + 6;
-                const uint32_t FRAME_DATA_OFFSET = PAYLOAD_OFFSET + 7;
-
-                uint8_t sendBuffer[128];
-                uint32_t length = 0;
-                sendBuffer[FRAME_CMD_OFFSET] = CMD_SEND_UPSTREAM;
-                length += 1;
-
-                sendBuffer[FRAME_TYPE_OFFSET] = type;
-                length += 1;
-
-                sendBuffer[FRAME_MSGID_OFFSET] = (uint8_t)(rxHeader.Identifier & 0xFF);
-                sendBuffer[FRAME_MSGID_OFFSET + 1] = (uint8_t)((rxHeader.Identifier >> 8) & 0xFF);
-                sendBuffer[FRAME_MSGID_OFFSET + 2] = (uint8_t)((rxHeader.Identifier >> 16) & 0xFF);
-                sendBuffer[FRAME_MSGID_OFFSET + 3] = (uint8_t)((rxHeader.Identifier >> 24) & 0xFF);
-                length += 4;
-
-                sendBuffer[FRAME_DLC_OFFSET] = dlc;
-                length += 1;
-
-                if(dlc > 0) {
-                    memcpy(&sendBuffer[FRAME_DATA_OFFSET], rxData, dlc);
-                    length += dlc;
-                }
-
-                length += FRAME_OVERHEAD;
-
-                PARSER_SendFrame(sendBuffer, length);
-            }
+    // Fast lane first, always one frame per CMD_SEND_UPSTREAM so it never
+    // waits for a batch to fill up
+    while(canRxFastQ.rdPtr != canRxFastQ.wrPtr) {
+        // Read the entry only after seeing the index that published it
+        __DMB();
+        CAN_rx_send(&canRxFastQ.pSto[canRxFastQ.rdPtr]);
+
+        // Done with the entry before handing it back to the interrupt
+        __DMB();
+        canRxFastQ.rdPtr = (canRxFastQ.rdPtr + 1) % canRxFastQ.size;
+    }
+
+    while(canRxQ.rdPtr != canRxQ.wrPtr) {
+        const CanRx_t * pRx = &canRxQ.pSto[canRxQ.rdPtr];
+
+        // Read the entry only after seeing the index that published it
+        __DMB();
+
+        if(upBatchEnabled) {
+            CAN_upBatch_add(pRx->type, pRx->identifier, pRx->dlc, pRx->data,
+                    pRx->timestamp);
+        } else {
+            CAN_rx_send(pRx);
         }
+
+        // Done with the entry before handing it back to the interrupt
+        __DMB();
+        canRxQ.rdPtr = (canRxQ.rdPtr + 1) % canRxQ.size;
+    }
+
+    // Flush on age
+    if(UPBATCH_IsDue(&upBatch, __HAL_TIM_GET_COUNTER(&htim2), upBatchMaxAge)) {
+        CAN_upBatch_flush();
     }
 }
 
@@ -317,30 +936,32 @@ void CANErr_Process(void)
          *   bit7: Reserved
          * Payload[5]: TDCvalue
          */
-        uint8_t sendBuffer[32];
+        uint8_t * sendBuffer = PARSER_ReserveFrame(FRAME_OVERHEAD + 6);
         uint32_t length = 0;
         
-        sendBuffer[PAYLOAD_OFFSET + length++] = CMD_PROTOCOL_STATUS;
-        sendBuffer[PAYLOAD_OFFSET + length++] = protocolStatus.LastErrorCode;
-        sendBuffer[PAYLOAD_OFFSET + length++] = protocolStatus.DataLastErrorCode;
-        sendBuffer[PAYLOAD_OFFSET + length++] = protocolStatus.Activity;
+        if(sendBuffer != NULL) {
+            sendBuffer[PAYLOAD_OFFSET + length++] = CMD_PROTOCOL_STATUS;
+            sendBuffer[PAYLOAD_OFFSET + length++] = protocolStatus.LastErrorCode;
+            sendBuffer[PAYLOAD_OFFSET + length++] = protocolStatus.DataLastErrorCode;
+            sendBuffer[PAYLOAD_OFFSET + length++] = protocolStatus.Activity;
         
-        // Pack flags into a single byte
-        uint8_t flags = 0;
-        if(protocolStatus.ErrorPassive) flags |= 0x01;
-        if(protocolStatus.Warning) flags |= 0x02;
-        if(protocolStatus.BusOff) flags |= 0x04;
-        if(protocolStatus.RxESIflag) flags |= 0x08;
-        if(protocolStatus.RxBRSflag) flags |= 0x10;
-        if(protocolStatus.RxFDFflag) flags |= 0x20;
-        if(protocolStatus.ProtocolException) flags |= 0x40;
-        sendBuffer[PAYLOAD_OFFSET + length++] = flags;
+            // Pack flags into a single byte
+            uint8_t flags = 0;
+            if(protocolStatus.ErrorPassive) flags |= 0x01;
+            if(protocolStatus.Warning) flags |= 0x02;
+            if(protocolStatus.BusOff) flags |= 0x04;
+            if(protocolStatus.RxESIflag) flags |= 0x08;
+            if(protocolStatus.RxBRSflag) flags |= 0x10;
+            if(protocolStatus.RxFDFflag) flags |= 0x20;
+            if(protocolStatus.ProtocolException) flags |= 0x40;
+            sendBuffer[PAYLOAD_OFFSET + length++] = flags;
         
-        sendBuffer[PAYLOAD_OFFSET + length++] = protocolStatus.TDCvalue;
+            sendBuffer[PAYLOAD_OFFSET + length++] = protocolStatus.TDCvalue;
         
-        length += FRAME_OVERHEAD;
+            length += FRAME_OVERHEAD;
         
-        PARSER_SendFrame(sendBuffer, length);
+            PARSER_CommitFrame(sendBuffer, length);
+        }
         
         // Update previous status
         prevProtocolStatus = protocolStatus;
@@ -354,7 +975,7 @@ void CANErr_Process(void)
 
 void CAN_stat_send(void)
 {
-    uint8_t buffer[128];
+    uint8_t * buffer;
     uint32_t len = 0;
     extern uint16_t stat_downstream_packet_loss_cnt;
     extern uint16_t stat_upstream_packet_loss_cnt;
@@ -372,8 +993,15 @@ void CAN_stat_send(void)
      * Payload[13-14]: stat_upstream_packet_loss_cnt (uint16_t, little-endian)
      * Payload[15-16]: stat_rx_buffer_overflow_cnt (uint16_t, little-endian)
      * Payload[17]: Status (0 = success)
+     * Payload[18-19]: RxLostCnt (uint16_t, little-endian)
+     * Payload[20-21]: TxEventLostCnt (uint16_t, little-endian)
      */
 
+    buffer = PARSER_ReserveFrame(FRAME_OVERHEAD + 22);
+    if(buffer == NULL) {
+        return;
+    }
+
     len = 0;
     buffer[PAYLOAD_OFFSET + len++] = CMD_GET_CAN_STATS;
 
@@ -411,8 +1039,16 @@ void CAN_stat_send(void)
 
     // Success status
     buffer[PAYLOAD_OFFSET + len++] = 0;
+
+    // CAN Rx lost count
+    buffer[PAYLOAD_OFFSET + len++] = (uint8_t)(canStat.RxLostCnt & 0xFF);
+    buffer[PAYLOAD_OFFSET + len++] = (uint8_t)((canStat.RxLostCnt >> 8) & 0xFF);
+
+    // CAN Tx event lost count
+    buffer[PAYLOAD_OFFSET + len++] = (uint8_t)(canStat.TxEventLostCnt & 0xFF);
+    buffer[PAYLOAD_OFFSET + len++] = (uint8_t)((canStat.TxEventLostCnt >> 8) & 0xFF);
     len += FRAME_OVERHEAD;
-    PARSER_SendFrame(buffer, len);
+    PARSER_CommitFrame(buffer, len);
 }
 
 
@@ -0,0 +1,132 @@
+#include "string.h"
+#include "crc32.h"
+#ifdef USE_HAL_DRIVER
+#include "main.h"
+#endif
+
+static const uint32_t crc32Nibble[16] = {
+    0x00000000UL, 0x1DB71064UL, 0x3B6E20C8UL, 0x26D930ACUL,
+    0x76DC4190UL, 0x6B6B51F4UL, 0x4DB26158UL, 0x5005713CUL,
+    0xEDB88320UL, 0xF00F9344UL, 0xD6D6A3E8UL, 0xCB61B38CUL,
+    0x9B64C2B0UL, 0x86D3D2D4UL, 0xA00AE278UL, 0xBDBDF21CUL
+};
+
+void CRC32_Init(void)
+{
+#ifdef USE_HAL_DRIVER
+    __HAL_RCC_CRC_CLK_ENABLE();
+    CRC->POL = 0x04C11DB7UL;
+    CRC->INIT = 0xFFFFFFFFUL;
+#endif
+}
+
+/*
+ * x^(2^k) modulo the polynomial, reflected, for CRC32_Combine()
+ */
+static const uint32_t crc32X2n[32] = {
+    0x40000000UL, 0x20000000UL, 0x08000000UL, 0x00800000UL,
+    0x00008000UL, 0xEDB88320UL, 0xB1E6B092UL, 0xA06A2517UL,
+    0xED627DAEUL, 0x88D14467UL, 0xD7BBFE6AUL, 0xEC447F11UL,
+    0x8E7EA170UL, 0x6427800EUL, 0x4D47BAE0UL, 0x09FE548FUL,
+    0x83852D0FUL, 0x30362F1AUL, 0x7B5A9CC3UL, 0x31FEC169UL,
+    0x9FEC022AUL, 0x6C8DEDC4UL, 0x15D6874DUL, 0x5FDE7A4EUL,
+    0xBAD90E37UL, 0x2E4E5EEFUL, 0x4EABA214UL, 0xA8A472C0UL,
+    0x429A969EUL, 0x148D302AUL, 0xC40BA6D0UL, 0xC4E22C3CUL
+};
+
+/*
+ * a * b modulo the polynomial, both reflected
+ */
+static uint32_t _MultModP(uint32_t a, uint32_t b)
+{
+    uint32_t m = 1UL << 31;
+    uint32_t p = 0;
+
+    while(a != 0) {
+        if((a & m) != 0) {
+            p ^= b;
+            a ^= m;
+        }
+        m >>= 1;
+        b = ((b & 1) != 0) ? ((b >> 1) ^ 0xEDB88320UL) : (b >> 1);
+    }
+    return p;
+}
+
+uint32_t CRC32_CalcSoft(const uint8_t * pBuf, uint32_t len)
+{
+    return CRC32_Extend(0, pBuf, len);
+}
+
+/*
+ * Continues crc, the CRC-32 of some message, over len more bytes: returns
+ * the CRC-32 of the message followed by pBuf. Software only.
+ */
+uint32_t CRC32_Extend(uint32_t crc, const uint8_t * pBuf, uint32_t len)
+{
+    crc = ~crc;
+    while(len > 0) {
+        crc ^= *pBuf++;
+        crc = (crc >> 4) ^ crc32Nibble[crc & 0x0F];
+        crc = (crc >> 4) ^ crc32Nibble[crc & 0x0F];
+        len--;
+    }
+
+    return ~crc;
+}
+
+/*
+ * CRC-32 of message A followed by message B, from crc1 of A and crc2 of B
+ * of len2 bytes. Costs O(log len2), not O(len2).
+ */
+uint32_t CRC32_Combine(uint32_t crc1, uint32_t crc2, uint32_t len2)
+{
+    uint32_t shift = 1UL << 31;     // x^0
+    uint32_t k = 3;                 // 8 bits per byte
+
+    while(len2 != 0) {
+        if((len2 & 1) != 0) {
+            shift = _MultModP(crc32X2n[k & 31], shift);
+        }
+        len2 >>= 1;
+        k++;
+    }
+    return _MultModP(shift, crc1) ^ crc2;
+}
+
+uint32_t CRC32_Calc(const uint8_t * pBuf, uint32_t len)
+{
+#ifdef USE_HAL_DRIVER
+    uint32_t word;
+
+    /*
+     * Only called from thread mode, so the peripheral is never shared.
+     *
+     * 32-bit polynomial, output reversed. Whole little-endian words are fed
+     * with input reversal by word, which processes byte 0 bit 0 first as
+     * the reflected algorithm does.
+     */
+    CRC->CR = CRC_CR_REV_IN_0 | CRC_CR_REV_IN_1 | CRC_CR_REV_OUT;
+    CRC->CR |= CRC_CR_RESET;
+
+    while(len >= 4) {
+        memcpy(&word, pBuf, 4);
+        CRC->DR = word;
+        pBuf += 4;
+        len -= 4;
+    }
+
+    if(len > 0) {
+        // Remaining bytes are fed one at a time with input reversal by byte
+        CRC->CR = CRC_CR_REV_IN_0 | CRC_CR_REV_OUT;
+        while(len > 0) {
+            *(__IO uint8_t *)(__IO void *)(&CRC->DR) = *pBuf++;
+            len--;
+        }
+    }
+
+    return ~(CRC->DR);
+#else
+    return CRC32_CalcSoft(pBuf, len);
+#endif
+}
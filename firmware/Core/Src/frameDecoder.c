@@ -0,0 +1,271 @@
+#include "string.h"
+#include "frameDecoder.h"
+#include "frameParser.h"
+#include "crc32.h"
+
+/*
+ * Orders buffer accesses against the index that publishes them. This is a
+ * DMB on the Cortex-M4 and a full fence on the host.
+ */
+#define DECODER_BARRIER()   __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+static void _StoreSegment(FrameDecoder_t * pDec, uint32_t index,
+        const uint8_t * pBuf, uint32_t len)
+{
+    memcpy(&pDec->buffer[index], pBuf, len);
+
+    // Keep the mirror of the head of the buffer up to date
+    if(index < FRAME_MAX_SIZE) {
+        if(len > (FRAME_MAX_SIZE - index)) {
+            len = FRAME_MAX_SIZE - index;
+        }
+        memcpy(&pDec->buffer[FRAME_RX_SIZE + index], pBuf, len);
+    }
+}
+
+/*
+ * CRC-32 mode: extends the running CRC over the bytes up to localWrPtr,
+ * with a checkpoint at the end of every block. Each byte is added once.
+ */
+static void _UpdateCrc(FrameDecoder_t * pDec, uint32_t localWrPtr)
+{
+    while(pDec->crcPtr != localWrPtr) {
+        const uint32_t availableBytes = (localWrPtr - pDec->crcPtr) & FRAME_RX_MASK;
+        uint32_t len = DECODER_CRC_STEP - (pDec->crcPtr & (DECODER_CRC_STEP - 1));
+
+        // Blocks never cross the end of the buffer
+        if(len > availableBytes) {
+            len = availableBytes;
+        }
+        pDec->runningCrc = CRC32_Extend(pDec->runningCrc, &pDec->buffer[pDec->crcPtr], len);
+        pDec->crcPtr = (pDec->crcPtr + len) & FRAME_RX_MASK;
+        if((pDec->crcPtr & (DECODER_CRC_STEP - 1)) == 0) {
+            pDec->crcCheckpoint[((pDec->crcPtr - 1) & FRAME_RX_MASK) / DECODER_CRC_STEP] =
+                    pDec->runningCrc;
+        }
+    }
+}
+
+/*
+ * Running CRC up to and including buffer[index], for an index from
+ * rdPtr - 1 to crcPtr - 1. Starts from the checkpoint before index, or
+ * from rdCrc if that checkpoint is behind rdPtr, so it costs less than
+ * DECODER_CRC_STEP bytes.
+ */
+static uint32_t _CrcAt(const FrameDecoder_t * pDec, uint32_t index)
+{
+    const uint32_t fromRd = (index + 1 - pDec->rdPtr) & FRAME_RX_MASK;
+    const uint32_t inBlock = (index + 1) & (DECODER_CRC_STEP - 1);
+
+    if(inBlock < fromRd) {
+        const uint32_t checkpoint = (index - inBlock) & FRAME_RX_MASK;
+        return CRC32_Extend(pDec->crcCheckpoint[checkpoint / DECODER_CRC_STEP],
+                &pDec->buffer[(checkpoint + 1) & FRAME_RX_MASK], inBlock);
+    }
+    return CRC32_Extend(pDec->rdCrc, &pDec->buffer[pDec->rdPtr], fromRd);
+}
+
+/*
+ * Skips the byte at rdPtr and moves rdPtr to the next TAG_SOF candidate
+ * before localWrPtr, so each byte is scanned only once while resynchronizing.
+ */
+static void _SkipToNextTag(FrameDecoder_t * pDec, uint32_t localWrPtr)
+{
+    const uint32_t start = (pDec->rdPtr + 1) & FRAME_RX_MASK;
+    uint32_t availableBytes = (localWrPtr - start) & FRAME_RX_MASK;
+    const uint8_t * pTag;
+
+    pDec->hasHeader = false;
+
+    // Contiguous up to the end of the mirror region, the rest is scanned on
+    // the next call
+    if(availableBytes > (FRAME_RX_SIZE + FRAME_MAX_SIZE - start)) {
+        availableBytes = FRAME_RX_SIZE + FRAME_MAX_SIZE - start;
+    }
+    pTag = memchr(&pDec->buffer[start], TAG_SOF, availableBytes);
+    if(pTag != (const uint8_t *)0) {
+        availableBytes = (uint32_t)(pTag - &pDec->buffer[start]);
+    }
+    if(pDec->crcMode) {
+        pDec->rdCrc = _CrcAt(pDec, (start + availableBytes - 1) & FRAME_RX_MASK);
+    }
+    pDec->rdPtr = (start + availableBytes) & FRAME_RX_MASK;
+}
+
+void DECODER_Init(FrameDecoder_t * pDec)
+{
+    memset(pDec, 0, sizeof(FrameDecoder_t));
+}
+
+uint32_t DECODER_Free(FrameDecoder_t * pDec)
+{
+    // Leave 1 byte margin to distinguish full from empty
+    return (FRAME_RX_SIZE - 1) - ((pDec->wrPtr - pDec->rdPtr) & FRAME_RX_MASK);
+}
+
+/*
+ * Producer side. Returns false, without storing anything, if the buffer
+ * does not have room for all len bytes.
+ */
+bool DECODER_Store(FrameDecoder_t * pDec, const uint8_t * pBuf, uint32_t len)
+{
+    const uint32_t localWrPtr = pDec->wrPtr;
+    uint32_t firstLen;
+
+    if(len > DECODER_Free(pDec)) {
+        return false;
+    }
+
+    // Write in at most two segments
+    firstLen = FRAME_RX_SIZE - localWrPtr;
+    if(firstLen > len) {
+        firstLen = len;
+    }
+    _StoreSegment(pDec, localWrPtr, pBuf, firstLen);
+    if(len > firstLen) {
+        _StoreSegment(pDec, 0, &pBuf[firstLen], len - firstLen);
+    }
+
+    // Data must be in place before the consumer can see it
+    DECODER_BARRIER();
+    pDec->wrPtr = (localWrPtr + len) & FRAME_RX_MASK;
+
+    return true;
+}
+
+/*
+ * Consumer side. Returns a pointer to the next frame with a valid length
+ * and checksum, or a null pointer if no complete frame is available yet.
+ * The frame stays valid until DECODER_Consume() is called.
+ */
+const uint8_t * DECODER_Next(FrameDecoder_t * pDec, uint32_t * pLen)
+{
+    const uint32_t localWrPtr = pDec->wrPtr;  // Snapshot, prefix sums are valid up to here
+    uint32_t availableBytes;
+    uint32_t sumPtr;
+    uint8_t sum;
+    const uint8_t * pFrame;
+
+    DECODER_BARRIER();
+
+    // Extend the running checksum over newly stored bytes (each byte once).
+    // Kept in locals: the byte stores to prefixSum may alias the decoder
+    // fields, which would otherwise be reloaded on every byte.
+    sumPtr = pDec->sumPtr;
+    sum = pDec->runningSum;
+    while(sumPtr != localWrPtr) {
+        sum += pDec->buffer[sumPtr];
+        pDec->prefixSum[sumPtr] = sum;
+        sumPtr = (sumPtr + 1) & FRAME_RX_MASK;
+    }
+    pDec->sumPtr = sumPtr;
+    pDec->runningSum = sum;
+    if(pDec->crcMode) {
+        _UpdateCrc(pDec, localWrPtr);
+    }
+
+    while(localWrPtr != pDec->rdPtr) {
+        pFrame = &pDec->buffer[pDec->rdPtr];
+        availableBytes = (localWrPtr - pDec->rdPtr) & FRAME_RX_MASK;
+
+        if(pDec->hasHeader == false) {
+            /* Check start of command TAG */
+            if(TAG_SOF != pFrame[TAG_OFFSET]) {
+                _SkipToNextTag(pDec, localWrPtr);
+                continue;
+            }
+
+            if(availableBytes < FRAME_OVERHEAD) {
+                /*
+                 * Minimum of 10 bytes to proceed
+                 * 1byte(TAG) + 2bytes(Length) + 4bytes(Timestamp) + 2bytes(Packet Sequence) + 1byte(Checksum)
+                 */
+                break;
+            }
+
+            pDec->length = (uint32_t)(pFrame[LEN_OFFSET]) +
+                    ((uint32_t)(pFrame[LEN_OFFSET + 1]) << 8);
+            if((pDec->length < (pDec->crcMode ? FRAME_CRC32_OVERHEAD : FRAME_OVERHEAD)) ||
+               (pDec->length > FRAME_MAX_SIZE)) {
+                // Either this is not the start of a packet or an invalid
+                // packet was received. Keep scanning.
+                _SkipToNextTag(pDec, localWrPtr);
+                continue;
+            }
+            pDec->hasHeader = true;
+        }
+
+        // If the entire command packet is not in the receive buffer then stop
+        if(availableBytes < pDec->length) {
+            break;
+        }
+
+        if(pDec->crcMode) {
+            // The CRC-32 of a frame including its trailer is CRC32_RESIDUE.
+            // It is combined from the running CRC before the frame and at
+            // its last byte, so like the checksum a false start costs O(1).
+            const uint32_t crc = _CrcAt(pDec, (pDec->rdPtr + pDec->length - 1) & FRAME_RX_MASK) ^
+                    CRC32_Combine(pDec->rdCrc, 0, pDec->length);
+            if(crc != CRC32_RESIDUE) {
+                _SkipToNextTag(pDec, localWrPtr);
+                continue;
+            }
+        } else {
+            // The checksum is the difference of the prefix sums at the last
+            // byte and just before the first byte. The slot before rdPtr is
+            // never overwritten by the producer, so a false start costs O(1).
+            sum = pDec->prefixSum[(pDec->rdPtr + pDec->length - 1) & FRAME_RX_MASK] -
+                    pDec->prefixSum[(pDec->rdPtr - 1) & FRAME_RX_MASK];
+            if(sum != 0) {
+                // Probably not really the start of a packet
+                _SkipToNextTag(pDec, localWrPtr);
+                continue;
+            }
+        }
+
+        *pLen = pDec->length;
+        return pFrame;
+    }
+
+    return (const uint8_t *)0;
+}
+
+/*
+ * Releases the frame returned by DECODER_Next() back to the producer.
+ */
+void DECODER_Consume(FrameDecoder_t * pDec)
+{
+    if(pDec->hasHeader == false) {
+        return;
+    }
+
+    if(pDec->crcMode) {
+        pDec->rdCrc = _CrcAt(pDec, (pDec->rdPtr + pDec->length - 1) & FRAME_RX_MASK);
+    }
+
+    // Done reading the frame before handing its space back
+    DECODER_BARRIER();
+    pDec->rdPtr = (pDec->rdPtr + pDec->length) & FRAME_RX_MASK;
+    pDec->hasHeader = false;
+}
+
+/*
+ * Selects the frame trailer. Only to be called by the consumer, between
+ * frames (e.g. while processing the frame that requested the change).
+ */
+void DECODER_SetCrcMode(FrameDecoder_t * pDec, bool enable)
+{
+    if(enable && (pDec->crcMode == false)) {
+        const uint32_t localWrPtr = pDec->wrPtr;
+
+        DECODER_BARRIER();
+
+        // The running CRC starts at rdPtr, so it covers the frame being
+        // processed and everything after it
+        pDec->crcPtr = pDec->rdPtr;
+        pDec->runningCrc = 0;
+        pDec->rdCrc = 0;
+        _UpdateCrc(pDec, localWrPtr);
+    }
+    pDec->crcMode = enable;
+}
@@ -1,16 +1,26 @@
+#include "string.h"
 #include "frameParser.h"
+#include "frameDecoder.h"
 #include "main.h"
 #include "UTIL_ringbuf.h"
 #include "canParser.h"
+#include "crc32.h"
+#include "idFilter.h"
+#include "canMsgRam.h"
+#include "txSlab.h"
 
-#define FRAME_RX_SIZE       (1024)
 #define FRAME_TX_SIZE       (512)
 
+#define FRAME_RESPONSE_SIZE     (FRAME_OVERHEAD + 3 + 32)  /* largest reply: CMD_SEND_DOWNSTREAM_BATCH */
+
+#define FRAME_TX_DLC_OFFSET     (5)
+#define FRAME_TX_RECORD_HEADER  (6)     /* TX_TYPE + ID + DLC */
+
 extern FDCAN_HandleTypeDef hfdcan1;
+extern TIM_HandleTypeDef htim2;
 
-volatile uint32_t rdPtr = 0;
-volatile uint32_t wrPtr = 0;
-static uint8_t rxFrameBuffer[FRAME_RX_SIZE];
+static FrameDecoder_t rxDecoder;
+static uint8_t frameMode = FRAME_MODE_CHECKSUM;
 
 extern tRingBufObject usbTxRb;
 static uint16_t packetSeq = 0;
@@ -19,17 +29,291 @@ uint16_t stat_downstream_packet_loss_cnt = 0;
 uint16_t stat_upstream_packet_loss_cnt = 0;
 uint16_t stat_rx_buffer_overflow_cnt = 0;
 
-static void _ProcessValidFrame(const uint32_t index, uint32_t len)
+/* Cumulative acknowledgement of CMD_SEND_DOWNSTREAM (CMD_SET_ACK_MODE) */
+static bool ackCoalesce = false;
+static uint8_t ackMaxCount = CONFIG_ACK_COALESCE_COUNT;
+static uint16_t ackWindow = CONFIG_ACK_COALESCE_WINDOW;
+static uint8_t ackPendingCount = 0;
+static uint16_t ackLastSeq = 0;
+static uint32_t ackFirstTs = 0;
+
+/*
+ * Credit-based flow control of downstream CAN frames (CMD_TX_CREDIT).
+ * There are two credit limits: the number of downstream records processed
+ * so far plus the free CAN Tx queue slots, and the Tx slab chunks charged
+ * for those records plus the free chunks. Being absolute, lost
+ * notifications do not leak credits.
+ */
+static bool creditNotify = false;
+static uint16_t creditRecordCount = 0;
+static uint16_t creditChunkCount = 0;
+static uint16_t creditLastLimit = 0;       // last limits sent to the host
+static uint16_t creditLastChunkLimit = 0;
+static uint16_t creditTryLimit = 0;        // last limits a send was attempted for
+static uint16_t creditTryChunkLimit = 0;
+static uint32_t creditLastTs = 0;
+
+static void _FlushAck(void)
+{
+    uint8_t * buffer;
+    uint32_t len = 0;
+    uint8_t count;
+
+    if(ackPendingCount == 0) {
+        return;
+    }
+
+    count = ackPendingCount;
+    ackPendingCount = 0;
+    buffer = PARSER_ReserveFrame(FRAME_OVERHEAD + 4);
+    if(buffer == NULL) {
+        return;
+    }
+
+    buffer[PAYLOAD_OFFSET + len++] = CMD_DOWNSTREAM_ACK;
+    buffer[PAYLOAD_OFFSET + len++] = (uint8_t)(ackLastSeq & 0xFF);
+    buffer[PAYLOAD_OFFSET + len++] = (uint8_t)((ackLastSeq >> 8) & 0xFF);
+    buffer[PAYLOAD_OFFSET + len++] = count;
+    len += FRAME_OVERHEAD;
+    PARSER_CommitFrame(buffer, len);
+}
+
+static void _SendCredit(void)
+{
+    uint8_t * buffer;
+    uint32_t len = 0;
+    uint32_t chunks;
+    const uint8_t freeSlots = (uint8_t)CAN_GetTxFree(&chunks);
+    const uint8_t freeChunks = (uint8_t)chunks;
+
+    creditLastTs = __HAL_TIM_GET_COUNTER(&htim2);
+    creditTryLimit = creditRecordCount + freeSlots;
+    creditTryChunkLimit = creditChunkCount + freeChunks;
+    buffer = PARSER_ReserveFrame(FRAME_OVERHEAD + 7);
+    if(buffer == NULL) {
+        return;
+    }
+
+    buffer[PAYLOAD_OFFSET + len++] = CMD_TX_CREDIT;
+    buffer[PAYLOAD_OFFSET + len++] = (uint8_t)(creditRecordCount & 0xFF);
+    buffer[PAYLOAD_OFFSET + len++] = (uint8_t)((creditRecordCount >> 8) & 0xFF);
+    buffer[PAYLOAD_OFFSET + len++] = freeSlots;
+    buffer[PAYLOAD_OFFSET + len++] = (uint8_t)(creditChunkCount & 0xFF);
+    buffer[PAYLOAD_OFFSET + len++] = (uint8_t)((creditChunkCount >> 8) & 0xFF);
+    buffer[PAYLOAD_OFFSET + len++] = freeChunks;
+    len += FRAME_OVERHEAD;
+    PARSER_CommitFrame(buffer, len);
+
+    creditLastLimit = creditTryLimit;
+    creditLastChunkLimit = creditTryChunkLimit;
+}
+
+static void _QueueAck(uint16_t hostSeq)
+{
+    if(ackPendingCount == 0) {
+        ackFirstTs = __HAL_TIM_GET_COUNTER(&htim2);
+    }
+    ackLastSeq = hostSeq;
+    ackPendingCount++;
+    if(ackPendingCount >= ackMaxCount) {
+        _FlushAck();
+    }
+}
+
+/*
+ * Length of a downstream CAN frame record, see _CheckDownstream()
+ */
+static uint32_t _RecordLength(const uint8_t * pRec)
+{
+    return FRAME_TX_RECORD_HEADER + pRec[FRAME_TX_DLC_OFFSET] + (((pRec[0] & 0x8) != 0) ? 1 : 0);
+}
+
+/*
+ * Tx slab chunks a downstream record is charged in the credit accounting,
+ * from its DLC byte whether the record is valid or not
+ */
+static uint16_t _RecordChunks(const uint8_t * pRec)
+{
+    return (uint16_t)TXSLAB_ChunksFor(pRec[FRAME_TX_DLC_OFFSET]);
+}
+
+/*
+ * Checks one downstream CAN frame record
+ *   [0]   : TX_TYPE
+ *   [1-4] : Message ID (little-endian)
+ *   [5]   : DLC
+ *   [6..] : CAN data bytes
+ *   [6+DLC] : Message marker, only if TX_TYPE bit3 is set
+ *
+ * Returns the record length in bytes, or 0 if the record is invalid.
+ */
+static uint32_t _CheckDownstream(const uint8_t * pRec)
+{
+    /*
+     * TX_TYPE
+     *  bit0: 0 - CAN-CC
+     *        1 - CAN-FD
+     *
+     *  bit1: 0 - BRS_ON (valid if bit0 is 1)
+     *        1 - BRS_OFF
+     *
+     *  bit2: 0 - FDCAN_STANDARD_ID (11-bit identifier)
+     *        1 - FDCAN_EXTENDED_ID (29-bit identifier)
+     *
+     *  bit3: 0 - No Tx event
+     *        1 - Report a Tx event (CMD_TX_EVENT) with the message marker
+     */
+    const uint8_t type = pRec[0];
+    const uint8_t dlc = pRec[FRAME_TX_DLC_OFFSET];
+
+    if((type & 0x1) == 0) {
+        // CAN Classic
+        if((type & 0x2) == 0) {
+            return 0;  // CAN-CC doesn't support BRS
+        }
+        if(dlc > 8) {
+            return 0;  // CAN-CC max DLC is 8
+        }
+    } else if(dlc > 64) {
+        return 0;  // CAN-FD max DLC is 64
+    }
+
+    return _RecordLength(pRec);
+}
+
+/*
+ * Sends one downstream record checked by _CheckDownstream(). It is written
+ * straight into the FDCAN message RAM when a Tx FIFO element is free and
+ * nothing is queued ahead of it, and goes through the Tx queue otherwise.
+ * Returns false if the Tx queue is full.
+ */
+static bool _SendDownstream(const uint8_t * pRec)
+{
+    const uint8_t type = pRec[0];
+    const uint8_t dlc = pRec[FRAME_TX_DLC_OFFSET];
+    const uint32_t identifier = (uint32_t)pRec[1] | ((uint32_t)pRec[2] << 8) |
+            ((uint32_t)pRec[3] << 16) | ((uint32_t)pRec[4] << 24);
+    uint8_t flags = 0;
+    uint8_t marker = 0;
+
+    // TX_TYPE to MSGRAM_TX_xxx
+    if((type & 0x4) != 0) {
+        flags |= MSGRAM_TX_EXTENDED;
+    }
+    if((type & 0x1) != 0) {
+        flags |= MSGRAM_TX_FD;
+        if((type & 0x2) == 0) {
+            flags |= MSGRAM_TX_BRS;
+        }
+    }
+    if((type & 0x8) != 0) {
+        flags |= MSGRAM_TX_EVENT;
+        marker = pRec[FRAME_TX_RECORD_HEADER + dlc];
+    }
+
+    if(CAN_SendDirect(identifier, flags, marker, &pRec[FRAME_TX_RECORD_HEADER], dlc)) {
+        return true;
+    }
+
+    if(CAN_Send(identifier, flags, marker, &pRec[FRAME_TX_RECORD_HEADER], dlc) != true) {
+        if(stat_downstream_packet_loss_cnt < UINT16_MAX) {
+            stat_downstream_packet_loss_cnt++;
+        }
+        return false;
+    }
+    return true;
+}
+
+/*
+ * CMD_SET_SW_FILTER, pParam points to Payload[1]
+ *   [0]  : SW_FILTER_OP_xxx
+ *   SW_FILTER_OP_CONFIG
+ *     [1]  : Standard ID mode (IDFILTER_MODE_xxx)
+ *     [2]  : Extended ID mode (IDFILTER_MODE_xxx)
+ *   SW_FILTER_OP_ADD_STD
+ *     [1..]: N x [first ID (LE16)][last ID (LE16)]
+ *   SW_FILTER_OP_ADD_EXT
+ *     [1..]: N x [ID (LE32)]
+ *
+ * The entries are all checked before the list is changed.
+ * Returns 0 on success, 1 on error.
+ */
+static uint8_t _SetSwFilter(const uint8_t * pParam, uint32_t paramLen)
+{
+    const uint8_t * pEntry = &pParam[1];
+    uint32_t count;
+    uint32_t n;
+
+    if(paramLen < 1) {
+        return 1;
+    }
+    count = (paramLen - 1) / 4;
+
+    if(pParam[0] == SW_FILTER_OP_CONFIG) {
+        if((paramLen >= 3) && IDFILTER_Config(pParam[1], pParam[2])) {
+            return 0;
+        }
+        return 1;
+    }
+
+    if(((paramLen - 1) % 4) != 0) {
+        return 1;
+    }
+
+    if(pParam[0] == SW_FILTER_OP_ADD_STD) {
+        for(n = 0; n < count; n++, pEntry += 4) {
+            const uint32_t first = (uint32_t)pEntry[0] | ((uint32_t)pEntry[1] << 8);
+            const uint32_t last = (uint32_t)pEntry[2] | ((uint32_t)pEntry[3] << 8);
+            if((first > last) || (last > 0x7FF)) {
+                return 1;
+            }
+        }
+        pEntry = &pParam[1];
+        for(n = 0; n < count; n++, pEntry += 4) {
+            IDFILTER_AddStd((uint32_t)pEntry[0] | ((uint32_t)pEntry[1] << 8),
+                    (uint32_t)pEntry[2] | ((uint32_t)pEntry[3] << 8));
+        }
+        return 0;
+    }
+
+    if(pParam[0] == SW_FILTER_OP_ADD_EXT) {
+        // Duplicates are counted too, so a list that fits is never half added
+        if(count > IDFILTER_GetExtFree()) {
+            return 1;
+        }
+        for(n = 0; n < count; n++, pEntry += 4) {
+            const uint32_t id = (uint32_t)pEntry[0] | ((uint32_t)pEntry[1] << 8) |
+                    ((uint32_t)pEntry[2] << 16) | ((uint32_t)pEntry[3] << 24);
+            if(id > 0x1FFFFFFF) {
+                return 1;
+            }
+        }
+        pEntry = &pParam[1];
+        for(n = 0; n < count; n++, pEntry += 4) {
+            IDFILTER_AddExt((uint32_t)pEntry[0] | ((uint32_t)pEntry[1] << 8) |
+                    ((uint32_t)pEntry[2] << 16) | ((uint32_t)pEntry[3] << 24));
+        }
+        return 0;
+    }
+
+    return 1;
+}
+
+static void _ProcessValidFrame(const uint8_t * pFrame, uint32_t len)
 {
-    uint8_t responseBuffer[128];
+    uint8_t * responseBuffer;
     uint32_t respLen = 0;
     uint8_t cmd;
 
     /* Command */
-    cmd = rxFrameBuffer[(index + PAYLOAD_OFFSET) % FRAME_RX_SIZE];
+    cmd = pFrame[PAYLOAD_OFFSET];
 
     switch(cmd) {
         case CMD_GET_DEVICE_ID: {
+            responseBuffer = PARSER_ReserveFrame(FRAME_RESPONSE_SIZE);
+            if(responseBuffer == NULL) {
+                break;
+            }
             respLen = 0;
             responseBuffer[PAYLOAD_OFFSET + respLen++] = CMD_GET_DEVICE_ID;
             responseBuffer[PAYLOAD_OFFSET + respLen++] = 0xAC;
@@ -37,29 +321,37 @@ static void _ProcessValidFrame(const uint32_t index, uint32_t len)
             responseBuffer[PAYLOAD_OFFSET + respLen++] = VERSION_MINOR;
             responseBuffer[PAYLOAD_OFFSET + respLen++] = VERSION_PATCH;
             respLen += FRAME_OVERHEAD;
-            PARSER_SendFrame(responseBuffer, respLen);
+            PARSER_CommitFrame(responseBuffer, respLen);
             break;
         }
 
         case CMD_CAN_START: {
             HAL_StatusTypeDef sts = HAL_FDCAN_Start(&hfdcan1);
 
+            responseBuffer = PARSER_ReserveFrame(FRAME_RESPONSE_SIZE);
+            if(responseBuffer == NULL) {
+                break;
+            }
             respLen = 0;
             responseBuffer[PAYLOAD_OFFSET + respLen++] = CMD_CAN_START;
             responseBuffer[PAYLOAD_OFFSET + respLen++] = (uint8_t)sts;
             respLen += FRAME_OVERHEAD;
-            PARSER_SendFrame(responseBuffer, respLen);
+            PARSER_CommitFrame(responseBuffer, respLen);
             break;
         }
 
         case CMD_CAN_STOP: {
             HAL_StatusTypeDef sts = HAL_FDCAN_Stop(&hfdcan1);
 
+            responseBuffer = PARSER_ReserveFrame(FRAME_RESPONSE_SIZE);
+            if(responseBuffer == NULL) {
+                break;
+            }
             respLen = 0;
             responseBuffer[PAYLOAD_OFFSET + respLen++] = CMD_CAN_STOP;
             responseBuffer[PAYLOAD_OFFSET + respLen++] = sts;
             respLen += FRAME_OVERHEAD;
-            PARSER_SendFrame(responseBuffer, respLen);
+            PARSER_CommitFrame(responseBuffer, respLen);
             break;
         }
 
@@ -76,109 +368,112 @@ static void _ProcessValidFrame(const uint32_t index, uint32_t len)
         }
 
         case CMD_SEND_DOWNSTREAM: {
-            /*
-             * TX_TYPE
-             *  bit0: 0 - CAN-CC
-             *        1 - CAN-FD
-             *
-             *  bit1: 0 - BRS_ON (valid if bit0 is 1)
-             *        1 - BRS_OFF
-             *
-             *  bit2: 0 - FDCAN_STANDARD_ID (11-bit identifier)
-             *        1 - FDCAN_EXTENDED_ID (29-bit identifier)
-             */
-            const uint32_t FRAME_TX_TYPE_OFFSET = (index + PAYLOAD_OFFSET + 1) % FRAME_RX_SIZE;
-            const uint32_t FRAME_TX_MSGID_OFFSET = (index + PAYLOAD_OFFSET + 2) % FRAME_RX_SIZE;
-            const uint32_t FRAME_TX_DLC_OFFSET = (index + PAYLOAD_OFFSET + 6) % FRAME_RX_SIZE;
-            const uint32_t FRAME_TX_DATA_OFFSET = (index + PAYLOAD_OFFSET + 7) % FRAME_RX_SIZE;
-
-            CanTx_t canTx = {0};
             bool hasError = false;
-            const uint8_t type = rxFrameBuffer[FRAME_TX_TYPE_OFFSET];
-            const uint8_t dlc = rxFrameBuffer[FRAME_TX_DLC_OFFSET];
-            uint32_t identifier = rxFrameBuffer[FRAME_TX_MSGID_OFFSET];
-            identifier |= ((uint32_t)rxFrameBuffer[(FRAME_TX_MSGID_OFFSET + 1) % FRAME_RX_SIZE] << 8);
-            identifier |= ((uint32_t)rxFrameBuffer[(FRAME_TX_MSGID_OFFSET + 2) % FRAME_RX_SIZE] << 16);
-            identifier |= ((uint32_t)rxFrameBuffer[(FRAME_TX_MSGID_OFFSET + 3) % FRAME_RX_SIZE] << 24);
-
-            canTx.header.Identifier = identifier;
-            if((type & 0x4) == 0) {
-                canTx.header.IdType = FDCAN_STANDARD_ID;  // 11-bit identifier
+            uint16_t hostSeq = pFrame[PACKET_SEQ_OFFSET];
+            hostSeq |= ((uint16_t)pFrame[PACKET_SEQ_OFFSET + 1] << 8);
+
+            creditRecordCount++;
+            // Record must lie within the frame (excluding checksum). A
+            // record without a header is charged a single chunk.
+            if(len < (FRAME_OVERHEAD + 1 + FRAME_TX_RECORD_HEADER)) {
+                creditChunkCount++;
+                hasError = true;
             } else {
-                canTx.header.IdType = FDCAN_EXTENDED_ID;  // 29-bit identifier
-            }
-            canTx.header.TxFrameType = FDCAN_DATA_FRAME;
-            canTx.header.ErrorStateIndicator = FDCAN_ESI_ACTIVE;
-            if((type & 0x1) == 0) {
-                // CAN Classic
-                canTx.header.FDFormat = FDCAN_CLASSIC_CAN;
-                if((type & 0x2) == 0) {
-                    hasError = true;  // CAN-CC doesn't support BRS
-                } else {
-                    canTx.header.BitRateSwitch = FDCAN_BRS_OFF;
+                creditChunkCount += _RecordChunks(&pFrame[PAYLOAD_OFFSET + 1]);
+                if((len - FRAME_OVERHEAD - 1) < _RecordLength(&pFrame[PAYLOAD_OFFSET + 1])) {
+                    hasError = true;
+                } else if(_CheckDownstream(&pFrame[PAYLOAD_OFFSET + 1]) == 0) {
+                    hasError = true;
+                } else if(_SendDownstream(&pFrame[PAYLOAD_OFFSET + 1]) != true) {
+                    hasError = true;
                 }
+            }
 
-                if(dlc > 8) {
-                    hasError = true;  // CAN-CC max DLC is 8
-                } else {
-                    canTx.header.DataLength = dlc;
-                }
-            } else {
-                // FD
-                canTx.header.FDFormat = FDCAN_FD_CAN;
-                if((type & 0x2) == 0) {
-                    canTx.header.BitRateSwitch = FDCAN_BRS_ON;
-                } else {
-                    canTx.header.BitRateSwitch = FDCAN_BRS_OFF;
+            if(ackCoalesce) {
+                if(hasError != true) {
+                    _QueueAck(hostSeq);
+                    break;
                 }
+                // Acknowledge everything accepted so far before the failure
+                _FlushAck();
+            }
 
-                if(dlc > 64) {
-                    hasError = true; // CAN-FD max DLC is 64
-                } else {
-                    if(dlc <= 8) {
-                        canTx.header.DataLength = dlc;
-                    } else if(dlc <= 12) {
-                        canTx.header.DataLength = FDCAN_DLC_BYTES_12;
-                    } else if(dlc <= 16) {
-                        canTx.header.DataLength = FDCAN_DLC_BYTES_16;
-                    } else if(dlc <= 20) {
-                        canTx.header.DataLength = FDCAN_DLC_BYTES_20;
-                    } else if(dlc <= 24) {
-                        canTx.header.DataLength = FDCAN_DLC_BYTES_24;
-                    } else if(dlc <= 32) {
-                        canTx.header.DataLength = FDCAN_DLC_BYTES_32;
-                    } else if(dlc <= 48) {
-                        canTx.header.DataLength = FDCAN_DLC_BYTES_48;
-                    } else if(dlc <= 64) {
-                        canTx.header.DataLength = FDCAN_DLC_BYTES_64;
-                    } else {
-                        hasError = true;;
-                    }
-                }
+            // Reply
+            responseBuffer = PARSER_ReserveFrame(FRAME_RESPONSE_SIZE);
+            if(responseBuffer == NULL) {
+                break;
             }
-            canTx.header.TxEventFifoControl = FDCAN_NO_TX_EVENTS;
-            canTx.header.MessageMarker = 0;
-            if(hasError != true) {
-                if(dlc > 0) {
-                    for(uint32_t i = 0; i < dlc; i++) {
-                        canTx.data[i] = rxFrameBuffer[(FRAME_TX_DATA_OFFSET + i) % FRAME_RX_SIZE];
-                    }
+            respLen = 0;
+            responseBuffer[PAYLOAD_OFFSET + respLen++] = CMD_SEND_DOWNSTREAM;
+            responseBuffer[PAYLOAD_OFFSET + respLen++] = hasError ? 1 : 0;
+            if(ackCoalesce) {
+                responseBuffer[PAYLOAD_OFFSET + respLen++] = (uint8_t)(hostSeq & 0xFF);
+                responseBuffer[PAYLOAD_OFFSET + respLen++] = (uint8_t)((hostSeq >> 8) & 0xFF);
+            }
+            respLen += FRAME_OVERHEAD;
+            PARSER_CommitFrame(responseBuffer, respLen);
+            break;
+        }
+        case CMD_SEND_DOWNSTREAM_BATCH: {
+            /*
+             * Payload[1]  : Record count N
+             * Payload[2..]: N records, each laid out as the CMD_SEND_DOWNSTREAM
+             *               payload without the command byte
+             */
+            const uint8_t count = pFrame[PAYLOAD_OFFSET + 1];
+            const uint32_t bitmapLen = ((uint32_t)count + 7) / 8;
+            uint32_t offset = PAYLOAD_OFFSET + 2;
+            bool hasError = false;
+            uint8_t accepted[32] = {0};  // 1 bit per record
+
+            // Every record gives its credit back, queued or not. Records
+            // past the end of the frame are charged a single chunk.
+            creditRecordCount += count;
+            creditChunkCount += count;
+
+            for(uint32_t n = 0; n < count; n++) {
+                uint32_t recLen;
+
+                // Record must lie within the frame (excluding checksum)
+                if((offset + FRAME_TX_RECORD_HEADER) > (len - 1)) {
+                    hasError = true;
+                    break;
                 }
-                if(CAN_Send(&canTx) != true) {
-                    if(stat_downstream_packet_loss_cnt < UINT16_MAX) {
-                        stat_downstream_packet_loss_cnt++;
-                    }
+                creditChunkCount += _RecordChunks(&pFrame[offset]) - 1;
+                recLen = _RecordLength(&pFrame[offset]);
+                if((offset + recLen) > (len - 1)) {
                     hasError = true;
+                    break;
+                }
+                if(_CheckDownstream(&pFrame[offset]) == 0) {
+                    hasError = true;
+                    offset += recLen;
+                    continue;
                 }
-            }
 
+                if(_SendDownstream(&pFrame[offset]) != true) {
+                    hasError = true;
+                    offset += recLen;
+                    continue;
+                }
+                offset += recLen;
+                // Accepted
+                accepted[n / 8] |= (uint8_t)(1 << (n % 8));
+            }
 
             // Reply
+            responseBuffer = PARSER_ReserveFrame(FRAME_RESPONSE_SIZE);
+            if(responseBuffer == NULL) {
+                break;
+            }
             respLen = 0;
-            responseBuffer[PAYLOAD_OFFSET + respLen++] = CMD_SEND_DOWNSTREAM;
+            responseBuffer[PAYLOAD_OFFSET + respLen++] = CMD_SEND_DOWNSTREAM_BATCH;
             responseBuffer[PAYLOAD_OFFSET + respLen++] = hasError ? 1 : 0;
+            responseBuffer[PAYLOAD_OFFSET + respLen++] = count;
+            memcpy(&responseBuffer[PAYLOAD_OFFSET + respLen], accepted, bitmapLen);
+            respLen += bitmapLen;
             respLen += FRAME_OVERHEAD;
-            PARSER_SendFrame(responseBuffer, respLen);
+            PARSER_CommitFrame(responseBuffer, respLen);
             break;
         }
         case CMD_GET_CAN_STATS: {
@@ -191,11 +486,250 @@ static void _ProcessValidFrame(const uint32_t index, uint32_t len)
             stat_upstream_packet_loss_cnt = 0;
             stat_rx_buffer_overflow_cnt = 0;
 
+            responseBuffer = PARSER_ReserveFrame(FRAME_RESPONSE_SIZE);
+            if(responseBuffer == NULL) {
+                break;
+            }
             respLen = 0;
             responseBuffer[PAYLOAD_OFFSET + respLen++] = CMD_RESET_CAN_STATS;
             responseBuffer[PAYLOAD_OFFSET + respLen++] = 0;  // Success status
             respLen += FRAME_OVERHEAD;
-            PARSER_SendFrame(responseBuffer, respLen);
+            PARSER_CommitFrame(responseBuffer, respLen);
+            break;
+        }
+        case CMD_SET_UPSTREAM_BATCH: {
+            /*
+             * Payload[1]   : 0 - one CMD_SEND_UPSTREAM per CAN frame
+             *                1 - CMD_SEND_UPSTREAM_BATCH
+             * Payload[2-3] : Maximum batch age in 10us ticks (0 - default)
+             */
+            uint8_t status = 1;
+
+            if(len >= (FRAME_OVERHEAD + 4)) {
+                const uint8_t enable = pFrame[PAYLOAD_OFFSET + 1];
+                uint16_t maxAge = pFrame[PAYLOAD_OFFSET + 2];
+                maxAge |= ((uint16_t)pFrame[PAYLOAD_OFFSET + 3] << 8);
+
+                CAN_SetUpstreamBatch(enable != 0, maxAge);
+                status = 0;
+            }
+
+            responseBuffer = PARSER_ReserveFrame(FRAME_RESPONSE_SIZE);
+            if(responseBuffer == NULL) {
+                break;
+            }
+            respLen = 0;
+            responseBuffer[PAYLOAD_OFFSET + respLen++] = CMD_SET_UPSTREAM_BATCH;
+            responseBuffer[PAYLOAD_OFFSET + respLen++] = status;
+            respLen += FRAME_OVERHEAD;
+            PARSER_CommitFrame(responseBuffer, respLen);
+            break;
+        }
+        case CMD_SET_ACK_MODE: {
+            /*
+             * Payload[1]   : 0 - reply to every CMD_SEND_DOWNSTREAM
+             *                1 - cumulative CMD_DOWNSTREAM_ACK
+             * Payload[2]   : Frames per acknowledgement (0 - default)
+             * Payload[3-4] : Acknowledgement window in 10us ticks (0 - default)
+             */
+            uint8_t status = 1;
+
+            if(len >= (FRAME_OVERHEAD + 5)) {
+                const uint8_t mode = pFrame[PAYLOAD_OFFSET + 1];
+                const uint8_t count = pFrame[PAYLOAD_OFFSET + 2];
+                uint16_t window = pFrame[PAYLOAD_OFFSET + 3];
+                window |= ((uint16_t)pFrame[PAYLOAD_OFFSET + 4] << 8);
+
+                _FlushAck();
+                ackCoalesce = (mode != 0);
+                ackMaxCount = (count == 0) ? CONFIG_ACK_COALESCE_COUNT : count;
+                ackWindow = (window == 0) ? CONFIG_ACK_COALESCE_WINDOW : window;
+                status = 0;
+            }
+
+            responseBuffer = PARSER_ReserveFrame(FRAME_RESPONSE_SIZE);
+            if(responseBuffer == NULL) {
+                break;
+            }
+            respLen = 0;
+            responseBuffer[PAYLOAD_OFFSET + respLen++] = CMD_SET_ACK_MODE;
+            responseBuffer[PAYLOAD_OFFSET + respLen++] = status;
+            respLen += FRAME_OVERHEAD;
+            PARSER_CommitFrame(responseBuffer, respLen);
+            break;
+        }
+        case CMD_TX_CREDIT: {
+            /*
+             * Payload[1] : (optional) 0 - no notifications
+             *                         1 - notify when credits are returned
+             */
+            if(len >= (FRAME_OVERHEAD + 2)) {
+                creditNotify = (pFrame[PAYLOAD_OFFSET + 1] != 0);
+            }
+            _SendCredit();
+            break;
+        }
+        case CMD_SET_FAST_LANE: {
+            /*
+             * Payload[1]  : Entry count N (0 - fast lane off)
+             * Payload[2..]: N entries of CAN_FAST_LANE_ENTRY_SIZE bytes
+             */
+            uint8_t status = 1;
+
+            if(len >= (FRAME_OVERHEAD + 2)) {
+                const uint8_t count = pFrame[PAYLOAD_OFFSET + 1];
+                if((FRAME_OVERHEAD + 2 + (uint32_t)count * CAN_FAST_LANE_ENTRY_SIZE) <= len) {
+                    if(CAN_SetFastLane(&pFrame[PAYLOAD_OFFSET + 2], count)) {
+                        status = 0;
+                    }
+                }
+            }
+
+            responseBuffer = PARSER_ReserveFrame(FRAME_RESPONSE_SIZE);
+            if(responseBuffer == NULL) {
+                break;
+            }
+            respLen = 0;
+            responseBuffer[PAYLOAD_OFFSET + respLen++] = CMD_SET_FAST_LANE;
+            responseBuffer[PAYLOAD_OFFSET + respLen++] = status;
+            respLen += FRAME_OVERHEAD;
+            PARSER_CommitFrame(responseBuffer, respLen);
+            break;
+        }
+        case CMD_SET_FILTERS: {
+            /*
+             * Payload[1]  : Non-matching standard ID (0 - Rx FIFO 0, 1 - Rx FIFO 1, 2 - reject)
+             * Payload[2]  : Non-matching extended ID (same as above)
+             * Payload[3]  : Remote frames (bit0 - reject standard, bit1 - reject extended)
+             * Payload[4]  : Entry count N
+             * Payload[5..]: N entries of CAN_FILTER_ENTRY_SIZE bytes
+             */
+            uint8_t status = 1;
+
+            if(len >= (FRAME_OVERHEAD + 5)) {
+                const uint8_t count = pFrame[PAYLOAD_OFFSET + 4];
+                if((FRAME_OVERHEAD + 5 + (uint32_t)count * CAN_FILTER_ENTRY_SIZE) <= len) {
+                    if(CAN_SetFilters(pFrame[PAYLOAD_OFFSET + 1], pFrame[PAYLOAD_OFFSET + 2],
+                            pFrame[PAYLOAD_OFFSET + 3], &pFrame[PAYLOAD_OFFSET + 5], count)) {
+                        status = 0;
+                    }
+                }
+            }
+
+            responseBuffer = PARSER_ReserveFrame(FRAME_RESPONSE_SIZE);
+            if(responseBuffer == NULL) {
+                break;
+            }
+            respLen = 0;
+            responseBuffer[PAYLOAD_OFFSET + respLen++] = CMD_SET_FILTERS;
+            responseBuffer[PAYLOAD_OFFSET + respLen++] = status;
+            respLen += FRAME_OVERHEAD;
+            PARSER_CommitFrame(responseBuffer, respLen);
+            break;
+        }
+        case CMD_SET_SW_FILTER: {
+            uint8_t status = 1;
+
+            if(len > (FRAME_OVERHEAD + 1)) {
+                status = _SetSwFilter(&pFrame[PAYLOAD_OFFSET + 1], len - FRAME_OVERHEAD - 1);
+            }
+
+            responseBuffer = PARSER_ReserveFrame(FRAME_RESPONSE_SIZE);
+            if(responseBuffer == NULL) {
+                break;
+            }
+            respLen = 0;
+            responseBuffer[PAYLOAD_OFFSET + respLen++] = CMD_SET_SW_FILTER;
+            responseBuffer[PAYLOAD_OFFSET + respLen++] = status;
+            respLen += FRAME_OVERHEAD;
+            PARSER_CommitFrame(responseBuffer, respLen);
+            break;
+        }
+        case CMD_SET_TX_PRIORITY: {
+            /*
+             * Payload[1] : 0 - FIFO order, 1 - lowest CAN ID first
+             */
+            uint8_t status = 1;
+
+            if(len >= (FRAME_OVERHEAD + 2)) {
+                const uint8_t mode = pFrame[PAYLOAD_OFFSET + 1];
+                if((mode <= 1) && CAN_SetTxPriority(mode == 1)) {
+                    status = 0;
+                }
+            }
+
+            responseBuffer = PARSER_ReserveFrame(FRAME_RESPONSE_SIZE);
+            if(responseBuffer == NULL) {
+                break;
+            }
+            respLen = 0;
+            responseBuffer[PAYLOAD_OFFSET + respLen++] = CMD_SET_TX_PRIORITY;
+            responseBuffer[PAYLOAD_OFFSET + respLen++] = status;
+            respLen += FRAME_OVERHEAD;
+            PARSER_CommitFrame(responseBuffer, respLen);
+            break;
+        }
+        case CMD_SET_BITRATE: {
+            /*
+             * Payload[1-4]  : Nominal bit rate (bit/s, little-endian)
+             * Payload[5-6]  : Nominal sample point (per mille, little-endian)
+             * Payload[7-10] : Data bit rate (bit/s, little-endian)
+             * Payload[11-12]: Data sample point (per mille, little-endian)
+             */
+            uint8_t status = CAN_BITRATE_ERROR;
+
+            if(len >= (FRAME_OVERHEAD + 13)) {
+                const uint8_t * pParam = &pFrame[PAYLOAD_OFFSET + 1];
+                status = CAN_SetBitrate(
+                        (uint32_t)pParam[0] | ((uint32_t)pParam[1] << 8) |
+                        ((uint32_t)pParam[2] << 16) | ((uint32_t)pParam[3] << 24),
+                        (uint16_t)(pParam[4] | (pParam[5] << 8)),
+                        (uint32_t)pParam[6] | ((uint32_t)pParam[7] << 8) |
+                        ((uint32_t)pParam[8] << 16) | ((uint32_t)pParam[9] << 24),
+                        (uint16_t)(pParam[10] | (pParam[11] << 8)));
+            }
+
+            responseBuffer = PARSER_ReserveFrame(FRAME_RESPONSE_SIZE);
+            if(responseBuffer == NULL) {
+                break;
+            }
+            respLen = 0;
+            responseBuffer[PAYLOAD_OFFSET + respLen++] = CMD_SET_BITRATE;
+            responseBuffer[PAYLOAD_OFFSET + respLen++] = status;
+            respLen += FRAME_OVERHEAD;
+            PARSER_CommitFrame(responseBuffer, respLen);
+            break;
+        }
+        case CMD_SET_FRAME_MODE: {
+            /*
+             * Payload[1] : FRAME_MODE_CHECKSUM or FRAME_MODE_CRC32
+             *
+             * The reply is sent in the current mode, the new mode applies
+             * to every frame after it in both directions.
+             */
+            uint8_t status = 1;
+            uint8_t mode = frameMode;
+
+            if(len >= (FRAME_OVERHEAD + 2)) {
+                mode = pFrame[PAYLOAD_OFFSET + 1];
+                if((mode == FRAME_MODE_CHECKSUM) || (mode == FRAME_MODE_CRC32)) {
+                    status = 0;
+                }
+            }
+
+            responseBuffer = PARSER_ReserveFrame(FRAME_RESPONSE_SIZE);
+            if(responseBuffer != NULL) {
+                respLen = 0;
+                responseBuffer[PAYLOAD_OFFSET + respLen++] = CMD_SET_FRAME_MODE;
+                responseBuffer[PAYLOAD_OFFSET + respLen++] = status;
+                respLen += FRAME_OVERHEAD;
+                PARSER_CommitFrame(responseBuffer, respLen);
+            }
+
+            if(status == 0) {
+                frameMode = mode;
+                DECODER_SetCrcMode(&rxDecoder, (mode == FRAME_MODE_CRC32));
+            }
             break;
         }
         default:
@@ -205,120 +739,104 @@ static void _ProcessValidFrame(const uint32_t index, uint32_t len)
 
 void PARSER_Store(uint8_t *pBuf, uint32_t len)
 {
-    uint32_t i = 0;
-    uint32_t availableSpace = 0;
-    uint32_t localRdPtr = rdPtr;  // Snapshot for consistent calculation
-    uint32_t localWrPtr = wrPtr;
-
-    // Calculate available space in the buffer
-    // Leave 1 byte margin to distinguish full from empty
-    if(localWrPtr >= localRdPtr) {
-        availableSpace = (FRAME_RX_SIZE - 1) - (localWrPtr - localRdPtr);
-    } else {
-        availableSpace = localRdPtr - localWrPtr - 1;
-    }
-
-    // Check if we have enough space
-    if(len > availableSpace) {
+    if(DECODER_Store(&rxDecoder, pBuf, len) != true) {
         // Buffer overflow - cannot store all data
         // Track the overflow event
         if(stat_rx_buffer_overflow_cnt < UINT16_MAX) {
             stat_rx_buffer_overflow_cnt++;
         }
-        return;
     }
+}
 
-    // Safe to write all data
-    for(i = 0; i < len; i++) {
-        rxFrameBuffer[wrPtr] = pBuf[i];
-        wrPtr = (wrPtr + 1) % FRAME_RX_SIZE;
-    }
+uint32_t PARSER_GetRxFree(void)
+{
+    return DECODER_Free(&rxDecoder);
 }
 
 void PARSER_Process()
 {
-    uint32_t availableBytes = 0;
     uint32_t length = 0;
-    uint32_t idx = 0;
-    uint8_t sum = 0;
-
-    while(wrPtr != rdPtr) {
-        /* Check start of command TAG */
-        if(TAG_SOF != rxFrameBuffer[rdPtr])
-        {
-            // Skip character
-            rdPtr = (rdPtr + 1) % FRAME_RX_SIZE;
-            continue;
-        }
-
-        /* Get available bytes in the buffer */
-        if(wrPtr >= rdPtr) {
-            availableBytes = wrPtr - rdPtr;
-        } else {
-            availableBytes = (wrPtr + FRAME_RX_SIZE) - rdPtr;
-        }
-        if(availableBytes < FRAME_OVERHEAD) {
-            /*
-             * Minimum of 10 bytes to proceed
-             * 1byte(TAG) + 2bytes(Length) + 4bytes(Timestamp) + 2bytes(Packet Sequence) + 1byte(Checksum)
-             */
-            break;
-        }
-        // See if the packet size byte is valid.  A command packet must be at
-        // least four bytes and can not be larger than the receive buffer size.
-        length = (uint32_t)(rxFrameBuffer[(rdPtr+1)%FRAME_RX_SIZE]) +
-                ((uint32_t)(rxFrameBuffer[(rdPtr+2)%FRAME_RX_SIZE]) << 8);
-
-        if((length < FRAME_OVERHEAD) || (length > (FRAME_RX_SIZE-1)))
-        {
-            // The packet size is too small. Minimum packet size is FRAME_OVERHEAD bytes
-            // 1byte(TAG) + 2bytes(Length) + 4bytes(Timestamp) + 2bytes(Packet Sequence) + 1byte(Checksum)
+    const uint8_t * pFrame;
 
-            // The packet size is too large, so either this is not the start of
-            // a packet or an invalid packet was received.  Skip this start of
-            // command packet tag.
-            rdPtr = (rdPtr + 1) % FRAME_RX_SIZE;
+    // The decoder keeps its state across calls, so each received byte is
+    // examined once no matter how the frames were split into USB packets.
+    while((pFrame = DECODER_Next(&rxDecoder, &length)) != (const uint8_t *)0) {
+        // A valid command packet was received, so process it now. Commands
+        // see it as if it had the 1-byte checksum trailer.
+        _ProcessValidFrame(pFrame, length - (PARSER_GetTrailerSize() - 1));
 
-            // Keep scanning for a start of command packet tag.
-            continue;
-        }
+        // Done with processing this command packet.
+        DECODER_Consume(&rxDecoder);
+    }
 
-        // If the entire command packet is not in the receive buffer then stop
-        if(availableBytes < length)
-        {
-            break;
+    // Flush the cumulative acknowledgement on age
+    if(ackPendingCount > 0) {
+        if((__HAL_TIM_GET_COUNTER(&htim2) - ackFirstTs) >= ackWindow) {
+            _FlushAck();
         }
+    }
 
-        // The entire command packet is in the receive buffer, so compute its
-        // checksum.
-        for(idx = 0, sum = 0; idx < length; idx++)
-        {
-            sum += rxFrameBuffer[(rdPtr + idx)%FRAME_RX_SIZE];
+    // Advertise credits returned by the CAN Tx queue. Right away if the host
+    // is about to run out, otherwise at most once per interval (also when
+    // the last notification did not fit in the USB Tx buffer).
+    if(creditNotify) {
+        uint32_t chunks;
+        const uint16_t limit = creditRecordCount + (uint16_t)CAN_GetTxFree(&chunks);
+        const uint16_t chunkLimit = creditChunkCount + (uint16_t)chunks;
+        if((limit != creditLastLimit) || (chunkLimit != creditLastChunkLimit)) {
+            const bool isNew = (limit != creditTryLimit) || (chunkLimit != creditTryChunkLimit);
+            const bool isLow =
+                    ((int16_t)(creditLastLimit - creditRecordCount) <= CONFIG_TX_CREDIT_LOW) ||
+                    ((int16_t)(creditLastChunkLimit - creditChunkCount) <= CONFIG_TX_CREDIT_LOW_CHUNKS);
+            if((isNew && isLow) ||
+               ((__HAL_TIM_GET_COUNTER(&htim2) - creditLastTs) >= CONFIG_TX_CREDIT_INTERVAL)) {
+                _SendCredit();
+            }
         }
+    }
+}
 
-        // Skip this packet if the checksum is not correct (that is, it is
-        // probably not really the start of a packet).
-        if(sum != 0)
-        {
-            // Skip this character
-            rdPtr = (rdPtr + 1) % FRAME_RX_SIZE;
+/*
+ * Reserves space for an upstream frame directly in the USB Tx buffer.
+ * maxLen is the largest frame length the caller may commit, counting a
+ * 1-byte checksum like FRAME_OVERHEAD does. The caller fills the payload
+ * at PAYLOAD_OFFSET and calls PARSER_CommitFrame(). Only one frame can be
+ * reserved at a time. Returns NULL if the frame does not fit.
+ */
+uint8_t * PARSER_ReserveFrame(uint32_t maxLen)
+{
+    uint8_t * pBuf;
 
-            // Keep scanning for a start of command packet tag.
-            continue;
+    pBuf = UTIL_RingBufReserve(&usbTxRb, maxLen - 1 + PARSER_GetTrailerSize());
+    if(pBuf == NULL) {
+        if(stat_upstream_packet_loss_cnt < UINT16_MAX) {
+            stat_upstream_packet_loss_cnt++;
         }
+        // Consume the sequence number so the host sees the gap
+        packetSeq++;
+    }
 
-        // A valid command packet was received, so process it now.
-        _ProcessValidFrame(rdPtr, length);
+    return pBuf;
+}
 
-        // Done with processing this command packet.
-        rdPtr = (rdPtr + length) % FRAME_RX_SIZE;
-    }
+/*
+ * Completes the frame header and trailer of a frame returned by
+ * PARSER_ReserveFrame() and publishes it to the USB Tx buffer.
+ */
+void PARSER_CommitFrame(uint8_t *pBuf, uint32_t len)
+{
+    PARSER_CommitFrameTs(pBuf, len, __HAL_TIM_GET_COUNTER(&htim2));
 }
 
-uint8_t PARSER_SendFrame(uint8_t *pBuf, uint32_t len)
+/*
+ * Same as PARSER_CommitFrame(), with the header timestamp given by the
+ * caller, e.g. the reception time of a CAN frame.
+ */
+void PARSER_CommitFrameTs(uint8_t *pBuf, uint32_t len, uint32_t timestamp)
 {
     uint32_t i;
     uint8_t sum = 0;
+    const uint32_t frameLen = len - 1 + PARSER_GetTrailerSize();
 
     /*
      * Start of Frame
@@ -327,13 +845,11 @@ uint8_t PARSER_SendFrame(uint8_t *pBuf, uint32_t len)
     /*
      * Set Length
      */
-    pBuf[LEN_OFFSET] = (uint8_t)(len & 0xFF);
-    pBuf[LEN_OFFSET + 1] = (uint8_t)((len >> 8) & 0xFF);
+    pBuf[LEN_OFFSET] = (uint8_t)(frameLen & 0xFF);
+    pBuf[LEN_OFFSET + 1] = (uint8_t)((frameLen >> 8) & 0xFF);
     /*
      * Set Timestamp
      */
-    extern TIM_HandleTypeDef htim2;
-    uint32_t timestamp = __HAL_TIM_GET_COUNTER(&htim2);
     pBuf[TIMESTAMP_OFFSET] = (uint8_t)(timestamp & 0xFF);
     pBuf[TIMESTAMP_OFFSET + 1] = (uint8_t)((timestamp >> 8) & 0xFF);
     pBuf[TIMESTAMP_OFFSET + 2] = (uint8_t)((timestamp >> 16) & 0xFF);
@@ -346,26 +862,51 @@ uint8_t PARSER_SendFrame(uint8_t *pBuf, uint32_t len)
     pBuf[PACKET_SEQ_OFFSET + 1] = (uint8_t)((packetSeq >> 8) & 0xFF);
     packetSeq++;
 
-    /*
-     * Calculate Checksum
-     */
-    for(i = 0; i < (len-1); i++) {
-        sum += pBuf[i];
+    if(frameMode == FRAME_MODE_CRC32) {
+        /*
+         * Calculate CRC-32, it replaces the 1-byte checksum
+         */
+        const uint32_t crc = CRC32_Calc(pBuf, len - 1);
+        pBuf[len - 1] = (uint8_t)(crc & 0xFF);
+        pBuf[len] = (uint8_t)((crc >> 8) & 0xFF);
+        pBuf[len + 1] = (uint8_t)((crc >> 16) & 0xFF);
+        pBuf[len + 2] = (uint8_t)((crc >> 24) & 0xFF);
+    } else {
+        /*
+         * Calculate Checksum
+         */
+        for(i = 0; i < (len-1); i++) {
+            sum += pBuf[i];
+        }
+        pBuf[i] = (uint8_t)((~sum) + 1);
     }
-    pBuf[i] = (uint8_t)((~sum) + 1);
 
-    if(len > UTIL_RingBufFree(&usbTxRb)) {
-        if(stat_upstream_packet_loss_cnt < UINT16_MAX) {
-            stat_upstream_packet_loss_cnt++;
-        }
+    UTIL_RingBufCommit(&usbTxRb, frameLen);
+}
+
+/*
+ * Sends a frame that was assembled outside the USB Tx buffer, e.g. one
+ * built up over several calls. Only the payload is copied.
+ */
+uint8_t PARSER_SendFrame(uint8_t *pBuf, uint32_t len)
+{
+    uint8_t * pFrame = PARSER_ReserveFrame(len);
+
+    if(pFrame == NULL) {
         // Not enough space
         return 1;
     }
 
-    /*
-     * Write to Tx Buffer
-     */
-    UTIL_RingBufWrite(&usbTxRb, pBuf, len);
+    memcpy(&pFrame[PAYLOAD_OFFSET], &pBuf[PAYLOAD_OFFSET], len - FRAME_OVERHEAD);
+    PARSER_CommitFrame(pFrame, len);
 
     return 0;
 }
+
+/*
+ * Returns the size of the frame trailer in the current frame mode.
+ */
+uint32_t PARSER_GetTrailerSize(void)
+{
+    return (frameMode == FRAME_MODE_CRC32) ? FRAME_CRC32_SIZE : 1;
+}
@@ -0,0 +1,131 @@
+#include "string.h"
+#include "idFilter.h"
+
+/*
+ * Keeps the list updates between the mode changes, the interrupt only
+ * reads the lists while the mode is not IDFILTER_MODE_OFF.
+ */
+#define IDFILTER_BARRIER()      __atomic_thread_fence(__ATOMIC_SEQ_CST)
+
+#define IDFILTER_STD_ID_MAX     (0x7FFUL)
+#define IDFILTER_EXT_ID_MAX     (0x1FFFFFFFUL)
+
+#define IDFILTER_EXT_SLOTS_LOG2 (7)
+#define IDFILTER_EXT_SLOTS      (1UL << IDFILTER_EXT_SLOTS_LOG2)
+#define IDFILTER_EXT_EMPTY      (0xFFFFFFFFUL)     /* not a valid 29-bit ID */
+
+static uint32_t stdBitmap[(IDFILTER_STD_ID_MAX + 1) / 32];
+static uint32_t extSlots[IDFILTER_EXT_SLOTS];
+static uint32_t extCount = 0;
+static volatile uint8_t stdMode = IDFILTER_MODE_OFF;
+static volatile uint8_t extMode = IDFILTER_MODE_OFF;
+
+/*
+ * Fibonacci hashing, the top bits of the product index the table
+ */
+static uint32_t _ExtSlot(uint32_t id)
+{
+    return (uint32_t)(id * 0x9E3779B1UL) >> (32 - IDFILTER_EXT_SLOTS_LOG2);
+}
+
+
+/*
+ * Returns the slot holding id, or the empty slot where it would go. The
+ * table is never more than 75% full, so the probe always terminates.
+ */
+static uint32_t _ExtFind(uint32_t id)
+{
+    uint32_t slot = _ExtSlot(id);
+
+    while((extSlots[slot] != id) && (extSlots[slot] != IDFILTER_EXT_EMPTY)) {
+        slot = (slot + 1) & (IDFILTER_EXT_SLOTS - 1);
+    }
+    return slot;
+}
+
+
+/*
+ * Sets the mode of each ID type and clears both lists
+ */
+bool IDFILTER_Config(uint8_t newStdMode, uint8_t newExtMode)
+{
+    if((newStdMode > IDFILTER_MODE_BLOCK) || (newExtMode > IDFILTER_MODE_BLOCK)) {
+        return false;
+    }
+
+    // Pass everything while the lists are rebuilt
+    stdMode = IDFILTER_MODE_OFF;
+    extMode = IDFILTER_MODE_OFF;
+    IDFILTER_BARRIER();
+
+    memset(stdBitmap, 0, sizeof(stdBitmap));
+    memset(extSlots, 0xFF, sizeof(extSlots));
+    extCount = 0;
+
+    IDFILTER_BARRIER();
+    stdMode = newStdMode;
+    extMode = newExtMode;
+    return true;
+}
+
+
+bool IDFILTER_AddStd(uint32_t first, uint32_t last)
+{
+    if((first > last) || (last > IDFILTER_STD_ID_MAX)) {
+        return false;
+    }
+
+    while(first <= last) {
+        stdBitmap[first >> 5] |= (1UL << (first & 0x1F));
+        first++;
+    }
+    return true;
+}
+
+
+bool IDFILTER_AddExt(uint32_t id)
+{
+    uint32_t slot;
+
+    if(id > IDFILTER_EXT_ID_MAX) {
+        return false;
+    }
+
+    slot = _ExtFind(id);
+    if(extSlots[slot] == id) {
+        return true;
+    }
+    if(extCount >= IDFILTER_EXT_MAX) {
+        return false;
+    }
+    extSlots[slot] = id;
+    extCount++;
+    return true;
+}
+
+
+uint32_t IDFILTER_GetExtFree(void)
+{
+    return IDFILTER_EXT_MAX - extCount;
+}
+
+
+bool IDFILTER_Accept(bool isExtended, uint32_t id)
+{
+    bool listed;
+
+    if(isExtended) {
+        if(extMode == IDFILTER_MODE_OFF) {
+            return true;
+        }
+        listed = (extSlots[_ExtFind(id & IDFILTER_EXT_ID_MAX)] != IDFILTER_EXT_EMPTY);
+        return (extMode == IDFILTER_MODE_PASS) ? listed : !listed;
+    }
+
+    if(stdMode == IDFILTER_MODE_OFF) {
+        return true;
+    }
+    id &= IDFILTER_STD_ID_MAX;
+    listed = ((stdBitmap[id >> 5] >> (id & 0x1F)) & 0x01) != 0;
+    return (stdMode == IDFILTER_MODE_PASS) ? listed : !listed;
+}
@@ -0,0 +1,172 @@
+#include "txQueue.h"
+
+#define TXQUEUE_WORDS   (TXQUEUE_SIZE / 32)
+
+// The host test starts the sequence numbers just before they wrap
+#ifndef TXQUEUE_FIRST_SEQ
+#define TXQUEUE_FIRST_SEQ   (0)
+#endif
+
+static uint32_t usedMask[TXQUEUE_WORDS];    // one bit per slot in use
+static uint32_t freeCount = TXQUEUE_SIZE;
+static uint8_t heap[TXQUEUE_SIZE];      // slot indices, heap[0] goes out first
+static uint32_t heapCount = 0;
+static uint32_t slotKey[TXQUEUE_SIZE];
+static uint32_t slotSeq[TXQUEUE_SIZE];
+static uint32_t nextSeq = TXQUEUE_FIRST_SEQ;
+
+/*
+ * True if slot a goes out before slot b. The sequence numbers wrap, the
+ * difference is valid as long as fewer than 2^31 frames are in between.
+ */
+static bool _Before(uint8_t a, uint8_t b)
+{
+    if(slotKey[a] != slotKey[b]) {
+        return (slotKey[a] < slotKey[b]);
+    }
+    return ((int32_t)(slotSeq[a] - slotSeq[b]) < 0);
+}
+
+
+static void _SiftUp(uint32_t pos)
+{
+    const uint8_t slot = heap[pos];
+
+    while(pos > 0) {
+        const uint32_t parent = (pos - 1) / 2;
+        if(!_Before(slot, heap[parent])) {
+            break;
+        }
+        heap[pos] = heap[parent];
+        pos = parent;
+    }
+    heap[pos] = slot;
+}
+
+
+static void _SiftDown(uint32_t pos)
+{
+    const uint8_t slot = heap[pos];
+
+    while(1) {
+        uint32_t child = 2 * pos + 1;
+        if(child >= heapCount) {
+            break;
+        }
+        if(((child + 1) < heapCount) && _Before(heap[child + 1], heap[child])) {
+            child++;
+        }
+        if(!_Before(heap[child], slot)) {
+            break;
+        }
+        heap[pos] = heap[child];
+        pos = child;
+    }
+    heap[pos] = slot;
+}
+
+
+/*
+ * Takes a free slot, returns its index or -1 if all slots are in use
+ */
+int32_t TXQUEUE_Alloc(void)
+{
+    uint32_t n = 0;
+    uint32_t bit;
+
+    if(freeCount == 0) {
+        return -1;
+    }
+    while(usedMask[n] == 0xFFFFFFFFUL) {
+        n++;
+    }
+    bit = (uint32_t)__builtin_ctz(~usedMask[n]);
+    usedMask[n] |= (1UL << bit);
+    freeCount--;
+    return (int32_t)(n * 32 + bit);
+}
+
+
+void TXQUEUE_Free(uint8_t slot)
+{
+    usedMask[slot / 32] &= ~(1UL << (slot % 32));
+    freeCount++;
+}
+
+
+/*
+ * Queues an allocated slot behind every queued slot with a key lower than
+ * or equal to its own
+ */
+void TXQUEUE_Push(uint8_t slot, uint32_t key)
+{
+    slotKey[slot] = key;
+    slotSeq[slot] = nextSeq++;
+    heap[heapCount] = slot;
+    _SiftUp(heapCount);
+    heapCount++;
+}
+
+
+/*
+ * Removes the slot that goes out first and returns its index, or -1 if the
+ * queue is empty. The slot stays allocated until TXQUEUE_Free().
+ */
+int32_t TXQUEUE_Pop(void)
+{
+    uint8_t slot;
+
+    if(heapCount == 0) {
+        return -1;
+    }
+    slot = heap[0];
+    heapCount--;
+    if(heapCount > 0) {
+        heap[0] = heap[heapCount];
+        _SiftDown(0);
+    }
+    return slot;
+}
+
+
+/*
+ * Puts back a popped slot in its old place, e.g. when the hardware did
+ * not take it
+ */
+void TXQUEUE_Requeue(uint8_t slot)
+{
+    heap[heapCount] = slot;
+    _SiftUp(heapCount);
+    heapCount++;
+}
+
+
+/*
+ * Gives every queued slot a new key and restores the heap order
+ */
+void TXQUEUE_Rekey(uint32_t (*pKeyOf)(uint8_t slot))
+{
+    uint32_t n;
+
+    for(n = 0; n < heapCount; n++) {
+        slotKey[heap[n]] = pKeyOf(heap[n]);
+    }
+    for(n = heapCount / 2; n-- > 0;) {
+        _SiftDown(n);
+    }
+}
+
+
+uint32_t TXQUEUE_Count(void)
+{
+    return heapCount;
+}
+
+
+/*
+ * Number of free slots
+ */
+uint32_t TXQUEUE_GetFree(void)
+{
+    return freeCount;
+}
@@ -0,0 +1,143 @@
+#include "string.h"
+#include "txSlab.h"
+
+#define TXSLAB_NONE     (0xFF)
+
+static uint8_t chunkSto[TXSLAB_CHUNK_COUNT][TXSLAB_CHUNK_SIZE];
+static uint8_t chunkNext[TXSLAB_CHUNK_COUNT];   // next chunk of a frame or of the free list
+static uint8_t freeHead = TXSLAB_NONE;          // freed chunks
+static uint32_t freeUnused = 0;                 // chunks from here on were never used
+static uint32_t freeCount = TXSLAB_CHUNK_COUNT;
+
+/*
+ * Number of chunks a frame with len data bytes takes
+ */
+uint32_t TXSLAB_ChunksFor(uint8_t len)
+{
+    return (TXSLAB_HEADER_SIZE + (uint32_t)len + TXSLAB_CHUNK_SIZE - 1) / TXSLAB_CHUNK_SIZE;
+}
+
+
+static uint8_t _Alloc(void)
+{
+    uint8_t chunk;
+
+    if(freeHead != TXSLAB_NONE) {
+        chunk = freeHead;
+        freeHead = chunkNext[chunk];
+    } else {
+        chunk = (uint8_t)freeUnused++;
+    }
+    freeCount--;
+    chunkNext[chunk] = TXSLAB_NONE;
+    return chunk;
+}
+
+
+/*
+ * Stores a frame, returns its handle (first chunk) or -1 if there are not
+ * enough free chunks. len is at most 64.
+ */
+int32_t TXSLAB_Put(uint32_t identifier, uint8_t flags, uint8_t marker,
+        const uint8_t * pData, uint8_t len)
+{
+    uint32_t need = TXSLAB_ChunksFor(len);
+    uint32_t part;
+    uint8_t first;
+    uint8_t chunk;
+
+    if((len > 64) || (need > freeCount)) {
+        return -1;
+    }
+
+    first = _Alloc();
+    chunkSto[first][0] = (uint8_t)(identifier & 0xFF);
+    chunkSto[first][1] = (uint8_t)((identifier >> 8) & 0xFF);
+    chunkSto[first][2] = (uint8_t)((identifier >> 16) & 0xFF);
+    chunkSto[first][3] = (uint8_t)((identifier >> 24) & 0xFF);
+    chunkSto[first][4] = flags;
+    chunkSto[first][5] = marker;
+    chunkSto[first][6] = len;
+    chunkSto[first][7] = 0;
+
+    part = (len < (TXSLAB_CHUNK_SIZE - TXSLAB_HEADER_SIZE)) ? len : (TXSLAB_CHUNK_SIZE - TXSLAB_HEADER_SIZE);
+    memcpy(&chunkSto[first][TXSLAB_HEADER_SIZE], pData, part);
+    pData += part;
+    len -= part;
+
+    chunk = first;
+    while(len > 0) {
+        const uint8_t next = _Alloc();
+        chunkNext[chunk] = next;
+        chunk = next;
+        part = (len < TXSLAB_CHUNK_SIZE) ? len : TXSLAB_CHUNK_SIZE;
+        memcpy(chunkSto[chunk], pData, part);
+        pData += part;
+        len -= part;
+    }
+
+    return first;
+}
+
+
+/*
+ * Reads back a stored frame, returns its data length. pData may be NULL
+ * to read only the header, otherwise it takes up to 64 bytes.
+ */
+uint8_t TXSLAB_Get(uint8_t handle, uint32_t * pIdentifier, uint8_t * pFlags,
+        uint8_t * pMarker, uint8_t * pData)
+{
+    const uint8_t * pChunk = chunkSto[handle];
+    const uint8_t len = pChunk[6];
+    uint32_t left = len;
+    uint32_t part;
+    uint8_t chunk = handle;
+
+    *pIdentifier = (uint32_t)pChunk[0] | ((uint32_t)pChunk[1] << 8) |
+            ((uint32_t)pChunk[2] << 16) | ((uint32_t)pChunk[3] << 24);
+    *pFlags = pChunk[4];
+    *pMarker = pChunk[5];
+    if(pData == NULL) {
+        return len;
+    }
+
+    part = (left < (TXSLAB_CHUNK_SIZE - TXSLAB_HEADER_SIZE)) ? left : (TXSLAB_CHUNK_SIZE - TXSLAB_HEADER_SIZE);
+    memcpy(pData, &pChunk[TXSLAB_HEADER_SIZE], part);
+    pData += part;
+    left -= part;
+    while(left > 0) {
+        chunk = chunkNext[chunk];
+        part = (left < TXSLAB_CHUNK_SIZE) ? left : TXSLAB_CHUNK_SIZE;
+        memcpy(pData, chunkSto[chunk], part);
+        pData += part;
+        left -= part;
+    }
+
+    return len;
+}
+
+
+/*
+ * Returns the chunks of a stored frame to the free list
+ */
+void TXSLAB_Free(uint8_t handle)
+{
+    uint8_t chunk = handle;
+
+    while(chunk != TXSLAB_NONE) {
+        const uint8_t next = chunkNext[chunk];
+        chunkNext[chunk] = freeHead;
+        freeHead = chunk;
+        freeCount++;
+        chunk = next;
+    }
+}
+
+
+/*
+ * Number of free chunks
+ */
+uint32_t TXSLAB_GetFree(void)
+{
+    return freeCount;
+}
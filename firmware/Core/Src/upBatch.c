@@ -0,0 +1,100 @@
+#include "string.h"
+#include "upBatch.h"
+
+/*
+ * Size of a record: the ID takes 2 bytes, or 4 for an extended ID
+ * (RX_TYPE bit2)
+ */
+uint32_t UPBATCH_RecordSize(uint8_t type, uint8_t dlc)
+{
+    return 4 + (((type & 0x4) == 0) ? 2 : 4) + (uint32_t)dlc;
+}
+
+
+void UPBATCH_Init(UpBatch_t * pBatch)
+{
+    pBatch->len = UPBATCH_RECORD_OFFSET;
+    pBatch->baseTs = 0;
+    pBatch->count = 0;
+}
+
+
+/*
+ * Appends a record. capacity is the largest frame the caller can send,
+ * trailer included. Returns false, and leaves the batch as it is, if the
+ * batch has to be sent first: the record does not fit, its timestamp
+ * delta does not fit in 16 bits or the record count is at its maximum.
+ * An empty batch always takes the record.
+ */
+bool UPBATCH_Add(UpBatch_t * pBatch, uint8_t type, uint32_t identifier, uint8_t dlc,
+        const uint8_t * pData, uint32_t timestamp, uint32_t capacity)
+{
+    const uint32_t recLen = UPBATCH_RecordSize(type, dlc);
+    uint32_t delta;
+    uint8_t * pRec;
+
+    if(capacity > CONFIG_UPSTREAM_BATCH_SIZE) {
+        capacity = CONFIG_UPSTREAM_BATCH_SIZE;
+    }
+
+    if(pBatch->count > 0) {
+        // +1 for the checksum byte
+        if(((pBatch->len + recLen + 1) > capacity) ||
+           ((timestamp - pBatch->baseTs) > UINT16_MAX) ||
+           (pBatch->count == UINT8_MAX)) {
+            return false;
+        }
+    } else {
+        pBatch->baseTs = timestamp;
+    }
+
+    delta = timestamp - pBatch->baseTs;
+    pRec = &pBatch->buffer[pBatch->len];
+    pRec[0] = type;
+    pRec[1] = dlc;
+    pRec[2] = (uint8_t)(delta & 0xFF);
+    pRec[3] = (uint8_t)((delta >> 8) & 0xFF);
+    pRec[4] = (uint8_t)(identifier & 0xFF);
+    pRec[5] = (uint8_t)((identifier >> 8) & 0xFF);
+    if((type & 0x4) != 0) {
+        pRec[6] = (uint8_t)((identifier >> 16) & 0xFF);
+        pRec[7] = (uint8_t)((identifier >> 24) & 0xFF);
+    }
+    if(dlc > 0) {
+        memcpy(&pRec[recLen - dlc], pData, dlc);
+    }
+    pBatch->len += recLen;
+    pBatch->count++;
+    return true;
+}
+
+
+/*
+ * True once the oldest record is maxAge ticks old
+ */
+bool UPBATCH_IsDue(const UpBatch_t * pBatch, uint32_t now, uint16_t maxAge)
+{
+    return (pBatch->count > 0) && ((now - pBatch->baseTs) >= maxAge);
+}
+
+
+/*
+ * Fills in the payload header and returns the frame length for
+ * PARSER_SendFrame(), checksum byte included, or 0 if the batch is empty.
+ * The frame stays in the buffer until the next UPBATCH_Init().
+ */
+uint32_t UPBATCH_Finish(UpBatch_t * pBatch)
+{
+    if(pBatch->count == 0) {
+        return 0;
+    }
+
+    pBatch->buffer[PAYLOAD_OFFSET] = CMD_SEND_UPSTREAM_BATCH;
+    pBatch->buffer[UPBATCH_COUNT_OFFSET] = pBatch->count;
+    pBatch->buffer[UPBATCH_BASE_TS_OFFSET] = (uint8_t)(pBatch->baseTs & 0xFF);
+    pBatch->buffer[UPBATCH_BASE_TS_OFFSET + 1] = (uint8_t)((pBatch->baseTs >> 8) & 0xFF);
+    pBatch->buffer[UPBATCH_BASE_TS_OFFSET + 2] = (uint8_t)((pBatch->baseTs >> 16) & 0xFF);
+    pBatch->buffer[UPBATCH_BASE_TS_OFFSET + 3] = (uint8_t)((pBatch->baseTs >> 24) & 0xFF);
+
+    return pBatch->len + 1;
+}
@@ -23,6 +23,7 @@
 
 /* USER CODE BEGIN INCLUDE */
 #include "UTIL_ringbuf.h"
+#include "frameParser.h"
 /* USER CODE END INCLUDE */
 
 /* Private typedef -----------------------------------------------------------*/
@@ -62,6 +63,12 @@
   */
 
 /* USER CODE BEGIN PRIVATE_DEFINES */
+/*
+ * Free space needed in the parser before the OUT endpoint is re-armed. The
+ * endpoint is single buffered and armed for one packet, so it takes no
+ * more than that before CDC_Receive_FS() runs again.
+ */
+#define CDC_RX_RESUME_SPACE  (CDC_DATA_FS_OUT_PACKET_SIZE)
 /* USER CODE END PRIVATE_DEFINES */
 
 /**
@@ -95,6 +102,8 @@ uint8_t UserTxBufferFS[APP_TX_DATA_SIZE];
 
 /* USER CODE BEGIN PRIVATE_VARIABLES */
 extern tRingBufObject usbTxRb;
+// Set when the OUT endpoint was left NAKing because the parser is full
+static volatile uint8_t rxPaused = 0;
 /* USER CODE END PRIVATE_VARIABLES */
 
 /**
@@ -128,7 +137,7 @@ static int8_t CDC_Receive_FS(uint8_t* pbuf, uint32_t *Len);
 static int8_t CDC_TransmitCplt_FS(uint8_t *pbuf, uint32_t *Len, uint8_t epnum);
 
 /* USER CODE BEGIN PRIVATE_FUNCTIONS_DECLARATION */
-
+static void CDC_StartTx(void);
 /* USER CODE END PRIVATE_FUNCTIONS_DECLARATION */
 
 /**
@@ -155,6 +164,8 @@ static int8_t CDC_Init_FS(void)
   /* Set Application Buffers */
   USBD_CDC_SetTxBuffer(&hUsbDeviceFS, UserTxBufferFS, 0);
   USBD_CDC_SetRxBuffer(&hUsbDeviceFS, UserRxBufferFS);
+  // The class arms the OUT endpoint itself after this callback
+  rxPaused = 0;
   return (USBD_OK);
   /* USER CODE END 3 */
 }
@@ -265,7 +276,14 @@ static int8_t CDC_Receive_FS(uint8_t* Buf, uint32_t *Len)
 	  PARSER_Store(Buf, *Len);
   }
   USBD_CDC_SetRxBuffer(&hUsbDeviceFS, &Buf[0]);
-  USBD_CDC_ReceivePacket(&hUsbDeviceFS);
+  if(PARSER_GetRxFree() >= CDC_RX_RESUME_SPACE) {
+    rxPaused = 0;
+    USBD_CDC_ReceivePacket(&hUsbDeviceFS);
+  } else {
+    // Leave the endpoint NAKing, CDC_ProcessRx() re-arms it once
+    // PARSER_Process() has made room
+    rxPaused = 1;
+  }
   return (USBD_OK);
   /* USER CODE END 6 */
 }
@@ -312,27 +330,84 @@ static int8_t CDC_TransmitCplt_FS(uint8_t *Buf, uint32_t *Len, uint8_t epnum)
   uint8_t result = USBD_OK;
   /* USER CODE BEGIN 13 */
   UNUSED(Buf);
-  UNUSED(Len);
   UNUSED(epnum);
+
+  /* The transfer was sent straight from usbTxRb, release it now */
+  UTIL_RingBufAdvanceRead(&usbTxRb, *Len);
+
+  /* Keep the IN endpoint busy while data is queued */
+  CDC_StartTx();
   /* USER CODE END 13 */
   return result;
 }
 
 /* USER CODE BEGIN PRIVATE_FUNCTIONS_IMPLEMENTATION */
-void CDC_ProcessTx(void)
+/*
+ * Starts the next IN transfer if the endpoint is idle. The data ahead of the
+ * read index is sent as one multi-packet transfer, straight from the ring
+ * buffer. The CDC class terminates a transfer that is a multiple of the
+ * packet size with a ZLP. The region belongs to the USB peripheral until
+ * CDC_TransmitCplt_FS() advances the read index, so the producer cannot
+ * reuse it while it is being sent.
+ *
+ * Called from the transmit complete callback (USB interrupt), and from
+ * CDC_ProcessTx() with interrupts disabled.
+ */
+static void CDC_StartTx(void)
 {
     uint32_t size;
     USBD_CDC_HandleTypeDef *hcdc = (USBD_CDC_HandleTypeDef*)hUsbDeviceFS.pClassData;
-    if (hcdc->TxState != 0){
+    if ((hcdc == NULL) || (hcdc->TxState != 0)){
         return;
     }
-    size = UTIL_RingBufUsed(&usbTxRb);
-    if(size > APP_TX_DATA_SIZE) {
-        size = APP_TX_DATA_SIZE;
+    size = UTIL_RingBufContigUsed(&usbTxRb);
+    if(size > CDC_TX_MAX_TRANSFER) {
+        size = CDC_TX_MAX_TRANSFER;
     }
     if(size != 0) {
-        UTIL_RingBufRead(&usbTxRb, UserTxBufferFS, size);
-        CDC_Transmit_FS(UserTxBufferFS, size);
+        CDC_Transmit_FS(&usbTxRb.pucBuf[usbTxRb.ulReadIndex], size);
+    }
+}
+
+/*
+ * Kicks the IN pipeline when new data was queued while the endpoint was
+ * idle. Once running, transfers are chained from CDC_TransmitCplt_FS().
+ */
+void CDC_ProcessTx(void)
+{
+    uint32_t primask_bit = __get_PRIMASK();
+
+    /* Enter Critical Section */
+    __disable_irq();
+    CDC_StartTx();
+    /* Exit Critical Section */
+    if(primask_bit == 0) {
+        __enable_irq();
+    }
+}
+
+/*
+ * Re-arms the OUT endpoint after it was paused by CDC_Receive_FS() and the
+ * parser has room for more packets again.
+ */
+void CDC_ProcessRx(void)
+{
+    uint32_t primask_bit;
+
+    if((rxPaused == 0) || (PARSER_GetRxFree() < CDC_RX_RESUME_SPACE)) {
+        return;
+    }
+
+    primask_bit = __get_PRIMASK();
+    /* Enter Critical Section */
+    __disable_irq();
+    if(rxPaused != 0) {
+        rxPaused = 0;
+        USBD_CDC_ReceivePacket(&hUsbDeviceFS);
+    }
+    /* Exit Critical Section */
+    if(primask_bit == 0) {
+        __enable_irq();
     }
 }
 
@@ -52,7 +52,8 @@
 #define APP_RX_DATA_SIZE  1024
 #define APP_TX_DATA_SIZE  64
 /* USER CODE BEGIN EXPORTED_DEFINES */
-
+/* Largest IN transfer sent from usbTxRb, in bytes (several 64-byte packets) */
+#define CDC_TX_MAX_TRANSFER  1024
 /* USER CODE END EXPORTED_DEFINES */
 
 /**
@@ -110,6 +111,7 @@ uint8_t CDC_Transmit_FS(uint8_t* Buf, uint16_t Len);
 
 /* USER CODE BEGIN EXPORTED_FUNCTIONS */
 void CDC_ProcessTx(void);
+void CDC_ProcessRx(void);
 /* USER CODE END EXPORTED_FUNCTIONS */
 
 /**
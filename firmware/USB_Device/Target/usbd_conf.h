@@ -34,7 +34,12 @@
 #include "stm32g4xx_hal.h"
 
 /* USER CODE BEGIN INCLUDE */
-
+/*
+ * A double-buffered endpoint uses both buffer descriptors of its endpoint
+ * register for one direction. EP1 is taken by the double-buffered CDC data
+ * IN endpoint, so the CDC data OUT endpoint is moved onto EP3.
+ */
+#define CDC_OUT_EP                                  0x03U  /* EP3 for data OUT */
 /* USER CODE END INCLUDE */
 
 /** @addtogroup USBD_OTG_DRIVER
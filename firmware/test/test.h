@@ -0,0 +1,27 @@
+#ifndef TEST_H
+#define TEST_H
+
+#include "stdio.h"
+#include "stdlib.h"
+#include "stdbool.h"
+
+/*
+ * Minimal host test support. A failed CHECK() prints its location and
+ * the test binary exits non-zero once all checks have run.
+ */
+static int testFailures = 0;
+
+#define CHECK(cond) \
+    do { \
+        if(!(cond)) { \
+            printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            testFailures++; \
+        } \
+    } while(0)
+
+#define TEST_RESULT() \
+    ((testFailures == 0) ? \
+        (printf("%s: passed\n", __FILE__), EXIT_SUCCESS) : \
+        (printf("%s: %d check(s) failed\n", __FILE__, testFailures), EXIT_FAILURE))
+
+#endif /* TEST_H */
@@ -0,0 +1,107 @@
+#include "test.h"
+#include "bitTiming.h"
+
+#define CLOCK   (80000000UL)    /* FDCAN kernel clock, PLLQ */
+
+static bool _Solves(uint32_t bitrate, uint16_t samplePoint, const BitTimingLimits_t * pLimits,
+        uint16_t prescaler, uint16_t seg1, uint8_t seg2, uint8_t sjw)
+{
+    BitTiming_t timing;
+
+    if(BITTIMING_Solve(CLOCK, bitrate, samplePoint, pLimits, &timing) != BITTIMING_OK) {
+        return false;
+    }
+    return (timing.prescaler == prescaler) && (timing.seg1 == seg1) &&
+            (timing.seg2 == seg2) && (timing.sjw == sjw) && (timing.samplePoint == samplePoint);
+}
+
+static void test_spec_table(void)
+{
+    // The bit timing table of FRAME_SPECIFICATION.md (CMD_SET_BITRATE)
+    CHECK(_Solves(500000, 875, &BITTIMING_NOMINAL, 1, 139, 20, 20));
+    CHECK(_Solves(1000000, 850, &BITTIMING_NOMINAL, 1, 67, 12, 12));
+    CHECK(_Solves(2000000, 825, &BITTIMING_DATA_TDC, 1, 32, 7, 7));
+    CHECK(_Solves(5000000, 750, &BITTIMING_DATA_TDC, 1, 11, 4, 4));
+    CHECK(_Solves(8000000, 800, &BITTIMING_DATA_TDC, 1, 7, 2, 2));
+}
+
+static void test_limits(void)
+{
+    BitTiming_t timing;
+
+    // 640 quanta are too many, 320 put seg1 past its limit
+    CHECK(BITTIMING_Solve(CLOCK, 125000, 875, &BITTIMING_NOMINAL, &timing) == BITTIMING_OK);
+    CHECK(timing.prescaler == 4);
+    CHECK((timing.seg1 == 139) && (timing.seg2 == 20));
+    CHECK(timing.samplePoint == 875);
+    CHECK(BITTIMING_Solve(CLOCK, 1000000, 800, &BITTIMING_DATA, &timing) == BITTIMING_OK);
+    CHECK(timing.prescaler == 2);
+    CHECK((timing.seg1 == 31) && (timing.seg2 == 8));
+
+    // SJW follows seg2 up to sjwMax
+    CHECK(BITTIMING_Solve(CLOCK, 500000, 500, &BITTIMING_NOMINAL, &timing) == BITTIMING_OK);
+    CHECK((timing.prescaler == 1) && (timing.seg1 == 79) && (timing.seg2 == 80));
+    CHECK(timing.sjw == 80);
+    CHECK(timing.samplePoint == 500);
+}
+
+static void test_reject(void)
+{
+    BitTiming_t timing;
+
+    // Bad sample point
+    CHECK(BITTIMING_Solve(CLOCK, 500000, BITTIMING_SP_MIN - 1, &BITTIMING_NOMINAL, &timing) ==
+            BITTIMING_ERR_SAMPLE_POINT);
+    CHECK(BITTIMING_Solve(CLOCK, 500000, BITTIMING_SP_MAX + 1, &BITTIMING_NOMINAL, &timing) ==
+            BITTIMING_ERR_SAMPLE_POINT);
+    CHECK(BITTIMING_Solve(CLOCK, 500000, BITTIMING_SP_MIN, &BITTIMING_NOMINAL, &timing) == BITTIMING_OK);
+    CHECK(BITTIMING_Solve(CLOCK, 500000, BITTIMING_SP_MAX, &BITTIMING_NOMINAL, &timing) == BITTIMING_OK);
+
+    // Inexact rate
+    CHECK(BITTIMING_Solve(CLOCK, 333000, 875, &BITTIMING_NOMINAL, &timing) == BITTIMING_ERR_BITRATE);
+    CHECK(BITTIMING_Solve(CLOCK, 3000000, 750, &BITTIMING_DATA_TDC, &timing) == BITTIMING_ERR_BITRATE);
+    CHECK(BITTIMING_Solve(CLOCK, 0, 875, &BITTIMING_NOMINAL, &timing) == BITTIMING_ERR_BITRATE);
+
+    // Too few time quanta: 5 nominal, 4 data
+    CHECK(BITTIMING_Solve(CLOCK, 16000000, 800, &BITTIMING_NOMINAL, &timing) == BITTIMING_ERR_BITRATE);
+    CHECK(BITTIMING_Solve(CLOCK, 10000000, 750, &BITTIMING_NOMINAL, &timing) == BITTIMING_OK);
+    CHECK(BITTIMING_Solve(CLOCK, 20000000, 750, &BITTIMING_DATA_TDC, &timing) == BITTIMING_ERR_BITRATE);
+    CHECK(BITTIMING_Solve(CLOCK, 16000000, 800, &BITTIMING_DATA_TDC, &timing) == BITTIMING_OK);
+
+    // Too many: 80 quanta with the TDC prescalers
+    CHECK(BITTIMING_Solve(CLOCK, 500000, 800, &BITTIMING_DATA_TDC, &timing) == BITTIMING_ERR_BITRATE);
+
+    // A bad sample point is reported before an unreachable bit rate
+    CHECK(BITTIMING_Solve(CLOCK, 333000, 400, &BITTIMING_NOMINAL, &timing) ==
+            BITTIMING_ERR_SAMPLE_POINT);
+}
+
+static void test_tdc(void)
+{
+    BitTiming_t timing;
+
+    // Sample point at 33 clocks, plus 4 clocks (50 ns) of minimum loop delay
+    CHECK(BITTIMING_Solve(CLOCK, 2000000, 825, &BITTIMING_DATA_TDC, &timing) == BITTIMING_OK);
+    CHECK(BITTIMING_TdcOffset(&timing) == 33);
+    CHECK(BITTIMING_TdcFilter(&timing, CLOCK, 50) == 37);
+
+    CHECK(BITTIMING_Solve(CLOCK, 8000000, 800, &BITTIMING_DATA_TDC, &timing) == BITTIMING_OK);
+    CHECK(BITTIMING_TdcOffset(&timing) == 8);
+
+    // Both clamp to the register fields
+    timing.prescaler = 2;
+    timing.seg1 = 63;
+    CHECK(BITTIMING_TdcOffset(&timing) == BITTIMING_TDC_MAX);
+    timing.prescaler = 1;
+    timing.seg1 = 120;
+    CHECK(BITTIMING_TdcFilter(&timing, CLOCK, 200) == BITTIMING_TDC_MAX);
+}
+
+int main(void)
+{
+    test_spec_table();
+    test_limits();
+    test_reject();
+    test_tdc();
+    return TEST_RESULT();
+}
@@ -0,0 +1,168 @@
+#include "string.h"
+#include "test.h"
+#include "canFilter.h"
+
+static CanFilterList_t list;
+static CanFilterList_t other;
+
+static uint8_t * _PutLe32(uint8_t * p, uint32_t value)
+{
+    p[0] = (uint8_t)value;
+    p[1] = (uint8_t)(value >> 8);
+    p[2] = (uint8_t)(value >> 16);
+    p[3] = (uint8_t)(value >> 24);
+    return p + 4;
+}
+
+static uint8_t * _Filter(uint8_t * p, uint8_t idType, uint8_t filterType, uint8_t action,
+        uint32_t id1, uint32_t id2)
+{
+    *p++ = idType;
+    *p++ = filterType;
+    *p++ = action;
+    p = _PutLe32(p, id1);
+    return _PutLe32(p, id2);
+}
+
+static uint8_t * _FastLane(uint8_t * p, uint8_t idType, uint32_t first, uint32_t last)
+{
+    *p++ = idType;
+    p = _PutLe32(p, first);
+    return _PutLe32(p, last);
+}
+
+static void test_filters_valid(void)
+{
+    uint8_t entries[4 * CAN_FILTER_ENTRY_SIZE];
+    uint8_t * p = entries;
+
+    p = _Filter(p, 0, CAN_FILTER_TYPE_RANGE, CAN_FILTER_ACTION_FIFO0, 0x100, 0x1FF);
+    p = _Filter(p, 0, CAN_FILTER_TYPE_DUAL, CAN_FILTER_ACTION_FIFO1, 0x7FF, 0x000);
+    p = _Filter(p, 1, CAN_FILTER_TYPE_MASK, CAN_FILTER_ACTION_REJECT, 0x18DA00F1, 0x1FFF00FF);
+    p = _Filter(p, 1, CAN_FILTER_TYPE_RANGE, CAN_FILTER_ACTION_FIFO0, 0x1FFFFFFF, 0x1FFFFFFF);
+    CHECK(p == &entries[sizeof(entries)]);
+
+    CHECK(CANFILTER_ParseFilters(&list, entries, 4));
+    CHECK(list.count == 4);
+    CHECK(list.stdCount == 2);
+    CHECK(list.extCount == 2);
+    CHECK(list.entry[0].id1 == 0x100);
+    CHECK(list.entry[0].id2 == 0x1FF);
+    CHECK(list.entry[1].filterType == CAN_FILTER_TYPE_DUAL);
+    CHECK(list.entry[1].action == CAN_FILTER_ACTION_FIFO1);
+    CHECK(list.entry[2].idType == 1);
+    CHECK(list.entry[2].id1 == 0x18DA00F1);
+    CHECK(list.entry[2].id2 == 0x1FFF00FF);
+    CHECK(list.entry[3].id1 == 0x1FFFFFFF);
+
+    // An empty list is valid
+    CHECK(CANFILTER_ParseFilters(&list, entries, 0));
+    CHECK((list.count == 0) && (list.stdCount == 0) && (list.extCount == 0));
+}
+
+static void test_filters_invalid(void)
+{
+    uint8_t entry[CAN_FILTER_ENTRY_SIZE];
+
+    // Out of range IDs
+    _Filter(entry, 0, CAN_FILTER_TYPE_RANGE, CAN_FILTER_ACTION_FIFO0, 0x000, 0x800);
+    CHECK(!CANFILTER_ParseFilters(&list, entry, 1));
+    _Filter(entry, 0, CAN_FILTER_TYPE_MASK, CAN_FILTER_ACTION_FIFO0, 0x800, 0x7FF);
+    CHECK(!CANFILTER_ParseFilters(&list, entry, 1));
+    _Filter(entry, 1, CAN_FILTER_TYPE_DUAL, CAN_FILTER_ACTION_FIFO0, 0x20000000, 0);
+    CHECK(!CANFILTER_ParseFilters(&list, entry, 1));
+
+    // Reversed range, but reversed IDs are fine for a dual ID filter
+    _Filter(entry, 0, CAN_FILTER_TYPE_RANGE, CAN_FILTER_ACTION_FIFO0, 0x200, 0x1FF);
+    CHECK(!CANFILTER_ParseFilters(&list, entry, 1));
+    _Filter(entry, 1, CAN_FILTER_TYPE_RANGE, CAN_FILTER_ACTION_FIFO0, 0x1000, 0xFFF);
+    CHECK(!CANFILTER_ParseFilters(&list, entry, 1));
+    _Filter(entry, 0, CAN_FILTER_TYPE_DUAL, CAN_FILTER_ACTION_FIFO0, 0x200, 0x1FF);
+    CHECK(CANFILTER_ParseFilters(&list, entry, 1));
+
+    // Bad ID type, filter type and action
+    _Filter(entry, 2, CAN_FILTER_TYPE_RANGE, CAN_FILTER_ACTION_FIFO0, 0, 0);
+    CHECK(!CANFILTER_ParseFilters(&list, entry, 1));
+    _Filter(entry, 0, CAN_FILTER_TYPE_MASK + 1, CAN_FILTER_ACTION_FIFO0, 0, 0);
+    CHECK(!CANFILTER_ParseFilters(&list, entry, 1));
+    _Filter(entry, 0, CAN_FILTER_TYPE_RANGE, CAN_FILTER_ACTION_REJECT + 1, 0, 0);
+    CHECK(!CANFILTER_ParseFilters(&list, entry, 1));
+}
+
+static void test_fast_lane(void)
+{
+    uint8_t entries[3 * CAN_FAST_LANE_ENTRY_SIZE];
+    uint8_t * p = entries;
+
+    p = _FastLane(p, 0, 0x010, 0x01F);
+    p = _FastLane(p, 1, 0x100, 0x100);
+    p = _FastLane(p, 0, 0x7FF, 0x7FF);
+    CHECK(CANFILTER_ParseFastLane(&list, entries, 3));
+    CHECK(list.count == 3);
+    CHECK((list.stdCount == 2) && (list.extCount == 1));
+    CHECK(list.entry[0].filterType == CAN_FILTER_TYPE_RANGE);
+    CHECK(list.entry[0].action == CAN_FILTER_ACTION_FIFO1);
+    CHECK(list.entry[0].id1 == 0x010);
+    CHECK(list.entry[0].id2 == 0x01F);
+    CHECK(list.entry[1].idType == 1);
+
+    _FastLane(entries, 0, 0x020, 0x01F);
+    CHECK(!CANFILTER_ParseFastLane(&list, entries, 1));
+    _FastLane(entries, 0, 0x000, 0x800);
+    CHECK(!CANFILTER_ParseFastLane(&list, entries, 1));
+    _FastLane(entries, 1, 0x000, 0x20000000);
+    CHECK(!CANFILTER_ParseFastLane(&list, entries, 1));
+}
+
+static void test_overflow(void)
+{
+    uint8_t entries[(CANFILTER_MAX + 1) * CAN_FILTER_ENTRY_SIZE];
+    uint8_t lane[CAN_FAST_LANE_ENTRY_SIZE];
+    uint32_t n;
+
+    // Every standard element, then one more
+    for(n = 0; n <= CANFILTER_STD_MAX; n++) {
+        _Filter(&entries[n * CAN_FILTER_ENTRY_SIZE], 0, CAN_FILTER_TYPE_DUAL,
+                CAN_FILTER_ACTION_FIFO0, n, n);
+    }
+    CHECK(CANFILTER_ParseFastLane(&other, entries, 0));
+    CHECK(CANFILTER_ParseFilters(&list, entries, CANFILTER_STD_MAX));
+    CHECK(CANFILTER_Fits(&list, &other, CANFILTER_STD_MAX, CANFILTER_EXT_MAX));
+    CHECK(CANFILTER_ParseFilters(&list, entries, CANFILTER_STD_MAX + 1));
+    CHECK(!CANFILTER_Fits(&list, &other, CANFILTER_STD_MAX, CANFILTER_EXT_MAX));
+
+    // The fast lane takes elements from the same pool
+    _FastLane(lane, 0, 0x100, 0x1FF);
+    CHECK(CANFILTER_ParseFastLane(&other, lane, 1));
+    CHECK(CANFILTER_ParseFilters(&list, entries, CANFILTER_STD_MAX));
+    CHECK(!CANFILTER_Fits(&list, &other, CANFILTER_STD_MAX, CANFILTER_EXT_MAX));
+    CHECK(CANFILTER_ParseFilters(&list, entries, CANFILTER_STD_MAX - 1));
+    CHECK(CANFILTER_Fits(&list, &other, CANFILTER_STD_MAX, CANFILTER_EXT_MAX));
+
+    // Extended elements run out after 8
+    for(n = 0; n <= CANFILTER_EXT_MAX; n++) {
+        _Filter(&entries[n * CAN_FILTER_ENTRY_SIZE], 1, CAN_FILTER_TYPE_DUAL,
+                CAN_FILTER_ACTION_FIFO0, n, n);
+    }
+    CHECK(CANFILTER_ParseFilters(&list, entries, CANFILTER_EXT_MAX));
+    CHECK(CANFILTER_Fits(&list, &other, CANFILTER_STD_MAX, CANFILTER_EXT_MAX));
+    CHECK(CANFILTER_ParseFilters(&list, entries, CANFILTER_EXT_MAX + 1));
+    CHECK(!CANFILTER_Fits(&list, &other, CANFILTER_STD_MAX, CANFILTER_EXT_MAX));
+
+    // More entries than elements in total is refused before parsing
+    for(n = 0; n <= CANFILTER_MAX; n++) {
+        _Filter(&entries[n * CAN_FILTER_ENTRY_SIZE], 0, CAN_FILTER_TYPE_DUAL,
+                CAN_FILTER_ACTION_FIFO0, 0, 0);
+    }
+    CHECK(!CANFILTER_ParseFilters(&list, entries, CANFILTER_MAX + 1));
+    CHECK(!CANFILTER_ParseFastLane(&list, entries, CANFILTER_MAX + 1));
+}
+
+int main(void)
+{
+    test_filters_valid();
+    test_filters_invalid();
+    test_fast_lane();
+    test_overflow();
+    return TEST_RESULT();
+}
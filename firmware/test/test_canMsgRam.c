@@ -0,0 +1,193 @@
+#include "string.h"
+#include "test.h"
+#include "canMsgRam.h"
+
+static void test_dlc(void)
+{
+    static const uint8_t dlcBytes[16] = {
+        0, 1, 2, 3, 4, 5, 6, 7, 8, 12, 16, 20, 24, 32, 48, 64
+    };
+    uint32_t bytes;
+    uint8_t dlc;
+    bool ok = true;
+
+    for(dlc = 0; dlc < 16; dlc++) {
+        ok = ok && (MSGRAM_DlcToBytes(dlc) == dlcBytes[dlc]);
+        ok = ok && (MSGRAM_BytesToDlc(dlcBytes[dlc]) == dlc);
+    }
+    CHECK(ok);
+    CHECK(MSGRAM_DlcToBytes(0x1F) == 64);   // upper bits ignored
+
+    // Every length rounds up to the smallest DLC holding it
+    for(bytes = 0; bytes <= 64; bytes++) {
+        dlc = MSGRAM_BytesToDlc((uint8_t)bytes);
+        ok = ok && (MSGRAM_DlcToBytes(dlc) >= bytes);
+        ok = ok && ((dlc == 0) || (MSGRAM_DlcToBytes(dlc - 1) < bytes));
+    }
+    CHECK(ok);
+    CHECK(MSGRAM_BytesToDlc(9) == 9);
+    CHECK(MSGRAM_BytesToDlc(25) == 13);
+    CHECK(MSGRAM_BytesToDlc(33) == 14);
+    CHECK(MSGRAM_BytesToDlc(49) == 15);
+}
+
+static void test_encode_tx(void)
+{
+    uint32_t element[MSGRAM_TX_ELEMENT_WORDS];
+    uint8_t data[64];
+    uint32_t n;
+
+    for(n = 0; n < sizeof(data); n++) {
+        data[n] = (uint8_t)(0x10 + n);
+    }
+
+    // Classic standard frame, 3 bytes: one partial word
+    memset(element, 0xEE, sizeof(element));
+    MSGRAM_EncodeTx(element, 0x123, 0, 0x55, data, 3);
+    CHECK(element[0] == (0x123UL << 18));
+    CHECK(element[1] == (3UL << 16));           // no EFC, no marker
+    CHECK(element[2] == 0x00121110UL);
+    CHECK(element[3] == 0xEEEEEEEEUL);          // nothing past the data field
+
+    // Extended CAN-FD frame with BRS and a Tx event, 8 bytes
+    memset(element, 0xEE, sizeof(element));
+    MSGRAM_EncodeTx(element, 0x18DAF110, MSGRAM_TX_EXTENDED | MSGRAM_TX_FD |
+            MSGRAM_TX_BRS | MSGRAM_TX_EVENT, 0xA7, data, 8);
+    CHECK(element[0] == ((1UL << 30) | 0x18DAF110UL));
+    CHECK(element[1] == ((0xA7UL << 24) | (1UL << 23) | (1UL << 21) | (1UL << 20) | (8UL << 16)));
+    CHECK(element[2] == 0x13121110UL);
+    CHECK(element[3] == 0x17161514UL);
+    CHECK(element[4] == 0xEEEEEEEEUL);
+
+    // BRS is ignored without FD
+    MSGRAM_EncodeTx(element, 0x7FF, MSGRAM_TX_BRS, 0, data, 0);
+    CHECK(element[0] == (0x7FFUL << 18));
+    CHECK(element[1] == 0);
+
+    // 13 bytes need DLC 10 (16 bytes), padded with zeros
+    memset(element, 0xEE, sizeof(element));
+    MSGRAM_EncodeTx(element, 0x100, MSGRAM_TX_FD, 0, data, 13);
+    CHECK(element[1] == ((1UL << 21) | (10UL << 16)));
+    CHECK(element[4] == 0x1B1A1918UL);
+    CHECK(element[5] == 0x0000001CUL);
+    CHECK(element[6] == 0xEEEEEEEEUL);
+
+    // 33 bytes need DLC 14 (48 bytes)
+    memset(element, 0xEE, sizeof(element));
+    MSGRAM_EncodeTx(element, 0x100, MSGRAM_TX_FD, 0, data, 33);
+    CHECK(element[1] == ((1UL << 21) | (14UL << 16)));
+    CHECK(element[10] == 0x00000030UL);
+    CHECK(element[11] == 0);
+    CHECK(element[13] == 0);
+    CHECK(element[14] == 0xEEEEEEEEUL);
+
+    // 64 bytes fill the element
+    MSGRAM_EncodeTx(element, 0x100, MSGRAM_TX_FD, 0, data, 64);
+    CHECK(element[1] == ((1UL << 21) | (15UL << 16)));
+    CHECK(element[17] == 0x4F4E4D4CUL);
+}
+
+static void test_decode_rx(void)
+{
+    uint32_t element[MSGRAM_RX_ELEMENT_WORDS];
+    uint8_t data[64];
+    uint32_t identifier;
+    uint8_t type;
+    uint8_t len;
+    uint32_t n;
+
+    /*
+     * RX_TYPE for [XTD][FDF][BRS]
+     *   bit0: 1 - CAN-FD, bit1: 1 - BRS off, bit2: 1 - extended ID
+     */
+    static const struct {
+        uint32_t xtd;
+        uint32_t fdf;
+        uint32_t brs;
+        uint8_t type;
+    } types[] = {
+        { 0, 0, 0, 0x2 }, { 0, 1, 1, 0x1 }, { 0, 1, 0, 0x3 }, { 0, 0, 1, 0x0 },
+        { 1, 0, 0, 0x6 }, { 1, 1, 1, 0x5 }, { 1, 1, 0, 0x7 }, { 1, 0, 1, 0x4 },
+    };
+
+    for(n = 0; n < (sizeof(types) / sizeof(types[0])); n++) {
+        element[0] = (types[n].xtd != 0) ? ((1UL << 30) | 0x1ABCDEFUL) : (0x321UL << 18);
+        element[1] = (types[n].fdf << 21) | (types[n].brs << 20) | (8UL << 16) | 0xBEEF;
+        len = MSGRAM_DecodeRx(element, &identifier, &type, NULL);
+        CHECK(len == 8);
+        CHECK(type == types[n].type);
+        CHECK(identifier == ((types[n].xtd != 0) ? 0x1ABCDEFUL : 0x321UL));
+    }
+
+    // ESI, RTR and the ANMF/FIDX bits do not leak into the ID or type
+    element[0] = (1UL << 31) | (1UL << 29) | (0x7FFUL << 18) | 0x3FFFF;
+    element[1] = (1UL << 31) | (0x7FUL << 24) | (1UL << 21) | (12UL << 16);
+    for(n = 0; n < 16; n++) {
+        element[2 + n] = 0x03020100UL + n * 0x04040404UL;
+    }
+    memset(data, 0xEE, sizeof(data));
+    len = MSGRAM_DecodeRx(element, &identifier, &type, data);
+    CHECK(identifier == 0x7FF);
+    CHECK(type == 0x3);
+    CHECK(len == 24);
+    for(n = 0; n < len; n++) {
+        CHECK(data[n] == n);
+    }
+
+    // 64 bytes
+    element[1] = (1UL << 21) | (15UL << 16);
+    len = MSGRAM_DecodeRx(element, &identifier, &type, data);
+    CHECK(len == 64);
+    CHECK(data[63] == 63);
+}
+
+static void test_round_trip(void)
+{
+    uint32_t element[MSGRAM_TX_ELEMENT_WORDS];
+    uint8_t data[64];
+    uint8_t out[64];
+    uint32_t identifier;
+    uint8_t type;
+    uint32_t n;
+    bool ok = true;
+
+    for(n = 0; n < sizeof(data); n++) {
+        data[n] = (uint8_t)(n * 7 + 1);
+    }
+
+    // A Tx element reads back as the Rx element of the same frame
+    for(n = 0; n <= 64; n++) {
+        const uint8_t len = (uint8_t)n;
+        const uint8_t dlcLen = MSGRAM_DlcToBytes(MSGRAM_BytesToDlc(len));
+
+        MSGRAM_EncodeTx(element, 0x1FFFFFFF - n, MSGRAM_TX_EXTENDED | MSGRAM_TX_FD, 0, data, len);
+        memset(out, 0xEE, sizeof(out));
+        ok = ok && (MSGRAM_DecodeRx(element, &identifier, &type, out) == dlcLen);
+        ok = ok && (identifier == (0x1FFFFFFF - n));
+        ok = ok && (type == 0x7);
+        ok = ok && (memcmp(out, data, len) == 0);
+        ok = ok && ((dlcLen == len) || (out[len] == 0));
+    }
+    CHECK(ok);
+}
+
+static void test_tx_event(void)
+{
+    uint32_t element[MSGRAM_TXEVT_ELEMENT_WORDS];
+    uint16_t txts;
+
+    element[0] = (0x123UL << 18);
+    element[1] = (0xC3UL << 24) | (1UL << 22) | (1UL << 21) | (8UL << 16) | 0xA55A;
+    CHECK(MSGRAM_DecodeTxEvent(element, &txts) == 0xC3);
+    CHECK(txts == 0xA55A);
+}
+
+int main(void)
+{
+    test_dlc();
+    test_encode_tx();
+    test_decode_rx();
+    test_round_trip();
+    test_tx_event();
+    return TEST_RESULT();
+}
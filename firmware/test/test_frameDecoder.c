@@ -0,0 +1,584 @@
+#include "string.h"
+#include "time.h"
+#include "test.h"
+#include "frameDecoder.h"
+#include "frameParser.h"
+#include "crc32.h"
+
+static FrameDecoder_t dec;
+
+/*
+ * Work counters, the decoder calls are wrapped at link time (see Makefile)
+ */
+static uint32_t crcBytes;       // bytes through CRC32_Extend()
+static uint32_t crcCombines;    // CRC32_Combine() calls
+static uint32_t scanBytes;      // bytes looked at by memchr()
+
+uint32_t __real_CRC32_Extend(uint32_t crc, const uint8_t * pBuf, uint32_t len);
+uint32_t __real_CRC32_Combine(uint32_t crc1, uint32_t crc2, uint32_t len2);
+void * __real_memchr(const void * pBuf, int c, size_t len);
+
+uint32_t __wrap_CRC32_Extend(uint32_t crc, const uint8_t * pBuf, uint32_t len)
+{
+    crcBytes += len;
+    return __real_CRC32_Extend(crc, pBuf, len);
+}
+
+uint32_t __wrap_CRC32_Combine(uint32_t crc1, uint32_t crc2, uint32_t len2)
+{
+    crcCombines++;
+    return __real_CRC32_Combine(crc1, crc2, len2);
+}
+
+void * __wrap_memchr(const void * pBuf, int c, size_t len)
+{
+    void * pFound = __real_memchr(pBuf, c, len);
+
+    scanBytes += (pFound != NULL) ? (uint32_t)((const uint8_t *)pFound - (const uint8_t *)pBuf) + 1 :
+            (uint32_t)len;
+    return pFound;
+}
+
+/*
+ * Builds a frame around the payload, with a checksum or CRC-32 trailer.
+ * Returns the frame length.
+ */
+static uint32_t _BuildFrame(uint8_t * pBuf, const uint8_t * pPayload, uint32_t payloadLen,
+        uint16_t seq, bool crcMode)
+{
+    const uint32_t len = FRAME_OVERHEAD - 1 + payloadLen + (crcMode ? FRAME_CRC32_SIZE : 1);
+    uint32_t n;
+
+    pBuf[TAG_OFFSET] = TAG_SOF;
+    pBuf[LEN_OFFSET] = (uint8_t)(len & 0xFF);
+    pBuf[LEN_OFFSET + 1] = (uint8_t)(len >> 8);
+    memset(&pBuf[TIMESTAMP_OFFSET], 0x5A, 4);
+    pBuf[PACKET_SEQ_OFFSET] = (uint8_t)(seq & 0xFF);
+    pBuf[PACKET_SEQ_OFFSET + 1] = (uint8_t)(seq >> 8);
+    memcpy(&pBuf[PAYLOAD_OFFSET], pPayload, payloadLen);
+
+    if(crcMode) {
+        const uint32_t crc = CRC32_CalcSoft(pBuf, len - FRAME_CRC32_SIZE);
+        for(n = 0; n < 4; n++) {
+            pBuf[len - FRAME_CRC32_SIZE + n] = (uint8_t)(crc >> (8 * n));
+        }
+    } else {
+        uint8_t sum = 0;
+        for(n = 0; n < (len - 1); n++) {
+            sum += pBuf[n];
+        }
+        pBuf[len - 1] = (uint8_t)((~sum) + 1);
+    }
+    return len;
+}
+
+static uint16_t _Seq(const uint8_t * pFrame)
+{
+    return (uint16_t)(pFrame[PACKET_SEQ_OFFSET] | (pFrame[PACKET_SEQ_OFFSET + 1] << 8));
+}
+
+/*
+ * Decodes every complete frame, returns the number found. The sequence
+ * numbers go to pSeq.
+ */
+static uint32_t _Drain(uint16_t * pSeq, uint32_t max)
+{
+    const uint8_t * pFrame;
+    uint32_t len;
+    uint32_t count = 0;
+
+    while((pFrame = DECODER_Next(&dec, &len)) != NULL) {
+        if(count < max) {
+            pSeq[count] = _Seq(pFrame);
+        }
+        count++;
+        DECODER_Consume(&dec);
+    }
+    return count;
+}
+
+static void test_crc32(void)
+{
+    const uint8_t check[] = "123456789";
+
+    CHECK(CRC32_CalcSoft(check, 9) == 0xCBF43926UL);
+    CHECK(CRC32_Calc(check, 9) == 0xCBF43926UL);
+    CHECK(CRC32_CalcSoft(check, 0) == 0x00000000UL);
+
+    // Combined from its parts, and the residue of a message with its CRC
+    CHECK(CRC32_Combine(CRC32_CalcSoft(check, 4), CRC32_CalcSoft(&check[4], 5), 5) == 0xCBF43926UL);
+    CHECK(CRC32_Extend(CRC32_CalcSoft(check, 2), &check[2], 7) == 0xCBF43926UL);
+    CHECK(CRC32_Combine(0x12345678UL, 0, 0) == 0x12345678UL);
+    CHECK(CRC32_Extend(0xCBF43926UL, (const uint8_t *)"\x26\x39\xF4\xCB", 4) == CRC32_RESIDUE);
+}
+
+static void test_single_frame(void)
+{
+    const uint8_t payload[] = { CMD_GET_DEVICE_ID };
+    uint8_t frame[64];
+    const uint8_t * pFrame;
+    uint32_t frameLen = _BuildFrame(frame, payload, sizeof(payload), 7, false);
+    uint32_t len = 0;
+
+    DECODER_Init(&dec);
+    CHECK(DECODER_Next(&dec, &len) == NULL);
+    CHECK(DECODER_Store(&dec, frame, frameLen));
+    pFrame = DECODER_Next(&dec, &len);
+    CHECK(pFrame != NULL);
+    CHECK(len == frameLen);
+    CHECK((pFrame != NULL) && (memcmp(pFrame, frame, frameLen) == 0));
+    DECODER_Consume(&dec);
+    CHECK(DECODER_Next(&dec, &len) == NULL);
+    CHECK(DECODER_Free(&dec) == (FRAME_RX_SIZE - 1));
+}
+
+static void test_split_delivery(void)
+{
+    const uint8_t payload[] = { CMD_SEND_DOWNSTREAM, 0x02, 0x23, 0x01, 0, 0, 2, 0x11, 0x22 };
+    uint8_t frame[64];
+    uint32_t frameLen = _BuildFrame(frame, payload, sizeof(payload), 1, false);
+    uint16_t seq[4];
+    uint32_t n;
+
+    // One byte at a time, the frame only appears with its last byte
+    DECODER_Init(&dec);
+    for(n = 0; n < frameLen; n++) {
+        CHECK(_Drain(seq, 4) == 0);
+        CHECK(DECODER_Store(&dec, &frame[n], 1));
+    }
+    CHECK(_Drain(seq, 4) == 1);
+    CHECK(seq[0] == 1);
+}
+
+static void test_resync(void)
+{
+    const uint8_t payload[] = { CMD_CAN_START };
+    uint8_t stream[512];
+    uint8_t frame[64];
+    uint16_t seq[4];
+    uint32_t len = 0;
+    uint32_t frameLen;
+
+    // Garbage, a false TAG with a plausible length, a frame with a bad
+    // checksum, then two good frames
+    memset(stream, 0x33, 40);
+    len += 40;
+    stream[len++] = TAG_SOF;
+    stream[len++] = 20;
+    stream[len++] = 0;
+    memset(&stream[len], 0x44, 30);
+    len += 30;
+    frameLen = _BuildFrame(&stream[len], payload, sizeof(payload), 10, false);
+    stream[len + frameLen - 1] ^= 0x01;
+    len += frameLen;
+    len += _BuildFrame(&stream[len], payload, sizeof(payload), 11, false);
+    len += _BuildFrame(&stream[len], payload, sizeof(payload), 12, false);
+
+    DECODER_Init(&dec);
+    CHECK(DECODER_Store(&dec, stream, len));
+    CHECK(_Drain(seq, 4) == 2);
+    CHECK(seq[0] == 11);
+    CHECK(seq[1] == 12);
+
+    // Lengths out of range are skipped right away
+    frameLen = _BuildFrame(frame, payload, sizeof(payload), 13, false);
+    DECODER_Init(&dec);
+    stream[0] = TAG_SOF;
+    stream[1] = 0xFF;
+    stream[2] = 0xFF;
+    stream[3] = TAG_SOF;
+    stream[4] = FRAME_OVERHEAD - 1;
+    stream[5] = 0;
+    CHECK(DECODER_Store(&dec, stream, 6));
+    CHECK(DECODER_Store(&dec, frame, frameLen));
+    CHECK(_Drain(seq, 4) == 1);
+    CHECK(seq[0] == 13);
+}
+
+static void test_wraparound(void)
+{
+    uint8_t payload[200];
+    uint8_t frame[256];
+    uint16_t seq[4];
+    uint32_t frameLen;
+    uint32_t total = 0;
+    uint16_t n;
+
+    // Odd-sized frames walk the start of a frame across the buffer end
+    memset(payload, 0xA5, sizeof(payload));
+    DECODER_Init(&dec);
+    for(n = 0; n < 100; n++) {
+        frameLen = _BuildFrame(frame, payload, 91 + (n % 7), n, false);
+        CHECK(DECODER_Store(&dec, frame, frameLen));
+        CHECK(_Drain(seq, 4) == 1);
+        CHECK(seq[0] == n);
+        total += frameLen;
+    }
+    CHECK(total > (2 * FRAME_RX_SIZE));
+}
+
+static void test_flow_control(void)
+{
+    uint8_t block[256];
+
+    // Never stores part of a block
+    memset(block, 0x00, sizeof(block));
+    DECODER_Init(&dec);
+    while(DECODER_Free(&dec) >= sizeof(block)) {
+        CHECK(DECODER_Store(&dec, block, sizeof(block)));
+    }
+    CHECK(DECODER_Store(&dec, block, sizeof(block)) == false);
+    CHECK(DECODER_Store(&dec, block, DECODER_Free(&dec)));
+    CHECK(DECODER_Free(&dec) == 0);
+}
+
+static void test_crc_mode(void)
+{
+    const uint8_t payload[] = { CMD_SET_FRAME_MODE, FRAME_MODE_CRC32 };
+    uint8_t frame[64];
+    uint16_t seq[4];
+    uint32_t frameLen;
+
+    DECODER_Init(&dec);
+    DECODER_SetCrcMode(&dec, true);
+
+    frameLen = _BuildFrame(frame, payload, sizeof(payload), 20, true);
+    CHECK(frameLen == (FRAME_CRC32_OVERHEAD + sizeof(payload)));
+    CHECK(DECODER_Store(&dec, frame, frameLen));
+    CHECK(_Drain(seq, 4) == 1);
+    CHECK(seq[0] == 20);
+
+    // A corrupted trailer drops the frame, the next one is found
+    frame[frameLen - 2] ^= 0x80;
+    CHECK(DECODER_Store(&dec, frame, frameLen));
+    frameLen = _BuildFrame(frame, payload, sizeof(payload), 21, true);
+    CHECK(DECODER_Store(&dec, frame, frameLen));
+    CHECK(_Drain(seq, 4) == 1);
+    CHECK(seq[0] == 21);
+
+    // A checksum frame does not pass in CRC mode
+    frameLen = _BuildFrame(frame, payload, sizeof(payload), 22, false);
+    CHECK(DECODER_Store(&dec, frame, frameLen));
+    CHECK(_Drain(seq, 4) == 0);
+}
+
+static void test_crc_candidates(void)
+{
+    const uint8_t payload[] = { CMD_CAN_STOP };
+    uint8_t stream[256];
+    uint16_t seq[4];
+    uint32_t len = 0;
+    uint32_t frameLen;
+
+    DECODER_Init(&dec);
+    DECODER_SetCrcMode(&dec, true);
+
+    // Back-to-back frames: each one ends at a TAG, the last at the end of data
+    len += _BuildFrame(&stream[len], payload, sizeof(payload), 30, true);
+    len += _BuildFrame(&stream[len], payload, sizeof(payload), 31, true);
+    CHECK(DECODER_Store(&dec, stream, len));
+    CHECK(_Drain(seq, 4) == 2);
+    CHECK(seq[0] == 30);
+    CHECK(seq[1] == 31);
+
+    // A false TAG with a plausible length is skipped, the frame after it
+    // is still found
+    len = 0;
+    stream[len++] = TAG_SOF;
+    stream[len++] = 24;
+    stream[len++] = 0;
+    memset(&stream[len], 0x12, 40);
+    len += 40;
+    len += _BuildFrame(&stream[len], payload, sizeof(payload), 32, true);
+    CHECK(DECODER_Store(&dec, stream, len));
+    CHECK(_Drain(seq, 4) == 1);
+    CHECK(seq[0] == 32);
+
+    // Padding or noise after a frame does not matter, however the stream
+    // is split
+    frameLen = _BuildFrame(stream, payload, sizeof(payload), 33, true);
+    stream[frameLen] = 0x00;
+    stream[frameLen + 1] = 0x12;
+    CHECK(DECODER_Store(&dec, stream, frameLen + 2));
+    CHECK(_Drain(seq, 4) == 1);
+    CHECK(seq[0] == 33);
+    len = _BuildFrame(stream, payload, sizeof(payload), 34, true);
+    frameLen = _BuildFrame(&stream[len], payload, sizeof(payload), 35, true);
+    stream[len] ^= 0x01;                // corrupted SOF of the next frame
+    len += frameLen;
+    len += _BuildFrame(&stream[len], payload, sizeof(payload), 36, true);
+    CHECK(DECODER_Store(&dec, stream, len));
+    CHECK(_Drain(seq, 4) == 2);
+    CHECK(seq[0] == 34);
+    CHECK(seq[1] == 36);
+}
+
+static void test_crc_switch(void)
+{
+    const uint8_t setMode[] = { CMD_SET_FRAME_MODE, FRAME_MODE_CRC32 };
+    uint8_t payload[200];
+    uint8_t stream[512];
+    const uint8_t * pFrame;
+    uint16_t seq[4];
+    uint32_t frameLen;
+    uint32_t len = 0;
+    uint16_t n;
+
+    // The mode changes while the frame that asked for it is processed,
+    // with CRC-32 frames already received behind it
+    len += _BuildFrame(&stream[len], setMode, sizeof(setMode), 40, false);
+    len += _BuildFrame(&stream[len], setMode, sizeof(setMode), 41, true);
+    DECODER_Init(&dec);
+    CHECK(DECODER_Store(&dec, stream, len));
+    pFrame = DECODER_Next(&dec, &frameLen);
+    CHECK((pFrame != NULL) && (_Seq(pFrame) == 40));
+    DECODER_SetCrcMode(&dec, true);
+    DECODER_Consume(&dec);
+    CHECK(_Drain(seq, 4) == 1);
+    CHECK(seq[0] == 41);
+
+    // Frames walk across the buffer end, some with a junk byte behind them
+    memset(payload, 0x3C, sizeof(payload));
+    for(n = 0; n < 100; n++) {
+        frameLen = _BuildFrame(stream, payload, 93 + (n % 11), n, true);
+        if((n % 3) == 0) {
+            stream[frameLen++] = (uint8_t)n;
+        }
+        CHECK(DECODER_Store(&dec, stream, frameLen));
+        CHECK(_Drain(seq, 4) == 1);
+        CHECK(seq[0] == n);
+    }
+
+    // And back
+    DECODER_SetCrcMode(&dec, false);
+    frameLen = _BuildFrame(stream, setMode, sizeof(setMode), 42, false);
+    CHECK(DECODER_Store(&dec, stream, frameLen));
+    CHECK(_Drain(seq, 4) == 1);
+    CHECK(seq[0] == 42);
+}
+
+/*
+ * A frame that starts a few bytes before the end of the buffer is handed
+ * out in one piece, byte for byte as it was sent
+ */
+static void test_wrap_bytes(void)
+{
+    static const uint32_t backs[] = { 1, 2, 3, 8, 9, 10 };
+    static uint8_t filler[FRAME_RX_SIZE];
+    uint8_t payload[300];
+    uint8_t frame[320];
+    const uint8_t * pFrame;
+    uint32_t frameLen;
+    uint32_t len;
+    uint32_t n;
+    uint32_t mode;
+    bool ok = true;
+
+    for(n = 0; n < sizeof(payload); n++) {
+        payload[n] = (uint8_t)((n * 7) + 1);
+    }
+    memset(filler, 0x00, sizeof(filler));
+
+    for(mode = 0; mode < 2; mode++) {
+        for(n = 0; n < (sizeof(backs) / sizeof(backs[0])); n++) {
+            const uint32_t start = FRAME_RX_SIZE - backs[n];
+
+            // Junk moves rdPtr up to the start position
+            DECODER_Init(&dec);
+            DECODER_SetCrcMode(&dec, mode != 0);
+            ok = ok && DECODER_Store(&dec, filler, start);
+            ok = ok && (DECODER_Next(&dec, &len) == NULL);
+            ok = ok && (dec.rdPtr == start);
+
+            frameLen = _BuildFrame(frame, payload, sizeof(payload), (uint16_t)n, mode != 0);
+            ok = ok && DECODER_Store(&dec, frame, frameLen);
+            pFrame = DECODER_Next(&dec, &len);
+            ok = ok && (pFrame == &dec.buffer[start]);
+            ok = ok && (len == frameLen);
+            ok = ok && (pFrame != NULL) && (memcmp(pFrame, frame, frameLen) == 0);
+            DECODER_Consume(&dec);
+            ok = ok && (dec.rdPtr == ((start + frameLen) & (FRAME_RX_SIZE - 1)));
+        }
+    }
+    CHECK(ok);
+}
+
+/*
+ * Throughput of the decoder against the byte-wise modulo store and parse
+ * it replaced, for a stream of CMD_SEND_DOWNSTREAM frames with 64 data
+ * bytes. Both store a frame, check it and copy its payload out.
+ */
+static uint32_t moduloWrPtr;
+static uint32_t moduloRdPtr;
+
+static void _ModuloStore(uint8_t * pRing, const uint8_t * pBuf, uint32_t len)
+{
+    uint32_t idx;
+
+    for(idx = 0; idx < len; idx++) {
+        pRing[moduloWrPtr] = pBuf[idx];
+        moduloWrPtr = (moduloWrPtr + 1) % FRAME_RX_SIZE;
+    }
+}
+
+static bool _ModuloParse(const uint8_t * pRing, uint8_t * pOut)
+{
+    const uint32_t length = (uint32_t)pRing[(moduloRdPtr + 1) % FRAME_RX_SIZE] |
+            ((uint32_t)pRing[(moduloRdPtr + 2) % FRAME_RX_SIZE] << 8);
+    uint8_t sum = 0;
+    uint32_t idx;
+
+    for(idx = 0; idx < length; idx++) {
+        sum += pRing[(moduloRdPtr + idx) % FRAME_RX_SIZE];
+    }
+    if(sum != 0) {
+        return false;
+    }
+    for(idx = 0; idx < (length - FRAME_OVERHEAD); idx++) {
+        pOut[idx] = pRing[(moduloRdPtr + PAYLOAD_OFFSET + idx) % FRAME_RX_SIZE];
+    }
+    moduloRdPtr = (moduloRdPtr + length) % FRAME_RX_SIZE;
+    return true;
+}
+
+static void test_parse_throughput(void)
+{
+    const uint32_t frames = 500000;
+    static uint8_t ring[FRAME_RX_SIZE];
+    uint8_t payload[1 + 7 + 64];
+    uint8_t frame[128];
+    uint8_t out[128];
+    const uint8_t * pFrame;
+    uint32_t frameLen;
+    uint32_t modulo = 0;
+    uint32_t decoded = 0;
+    uint32_t len;
+    uint32_t n;
+    clock_t start;
+    double tModulo;
+    double tDecoder;
+
+    memset(payload, 0x3C, sizeof(payload));
+    payload[0] = CMD_SEND_DOWNSTREAM;
+    frameLen = _BuildFrame(frame, payload, sizeof(payload), 0, false);
+
+    moduloWrPtr = 0;
+    moduloRdPtr = 0;
+    start = clock();
+    for(n = 0; n < frames; n++) {
+        _ModuloStore(ring, frame, frameLen);
+        modulo += _ModuloParse(ring, out) ? 1 : 0;
+    }
+    tModulo = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    DECODER_Init(&dec);
+    start = clock();
+    for(n = 0; n < frames; n++) {
+        DECODER_Store(&dec, frame, frameLen);
+        pFrame = DECODER_Next(&dec, &len);
+        if(pFrame != NULL) {
+            memcpy(out, &pFrame[PAYLOAD_OFFSET], len - FRAME_OVERHEAD);
+            decoded++;
+            DECODER_Consume(&dec);
+        }
+    }
+    tDecoder = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    CHECK(modulo == frames);
+    CHECK(decoded == frames);
+    printf("parse: modulo %.0f frames/s, decoder %.0f frames/s\n",
+            (tModulo > 0) ? (modulo / tModulo) : 0.0, (tDecoder > 0) ? (decoded / tDecoder) : 0.0);
+}
+
+/*
+ * Worst case for resynchronization: every third byte is a TAG_SOF with the
+ * largest valid length behind it ([0xFF][0xFF][0x03] is a 1023-byte
+ * candidate at the first byte), or a random in-range length. Rescanning
+ * each false start would cost up to 1023 bytes per candidate; the work per
+ * stored byte must stay bounded instead.
+ */
+static void test_worst_case_work(void)
+{
+    const uint32_t streamLen = 96 * 1024;
+    uint8_t packet[64];
+    uint32_t stored;
+    uint32_t candidates;
+    uint32_t rescan;
+    uint32_t found;
+    uint32_t mode;
+    uint32_t pattern;
+    uint32_t seed = 1;
+    uint32_t n;
+    uint16_t seq[4];
+
+    for(pattern = 0; pattern < 2; pattern++) {
+        for(mode = 0; mode < 2; mode++) {
+            DECODER_Init(&dec);
+            DECODER_SetCrcMode(&dec, mode != 0);
+            crcBytes = 0;
+            crcCombines = 0;
+            scanBytes = 0;
+            candidates = 0;
+            rescan = 0;
+            found = 0;
+
+            // Stored a USB packet at a time, decoded after each one
+            for(stored = 0; stored < streamLen; stored += sizeof(packet)) {
+                for(n = 0; n < sizeof(packet); n += 3) {
+                    uint32_t length = 1023;
+
+                    if(pattern != 0) {
+                        seed = seed * 1103515245UL + 12345UL;
+                        length = FRAME_CRC32_OVERHEAD + ((seed >> 8) % (1024 - FRAME_CRC32_OVERHEAD));
+                    }
+                    packet[n] = TAG_SOF;
+                    if((n + 1) < sizeof(packet)) {
+                        packet[n + 1] = (uint8_t)(length & 0xFF);
+                    }
+                    if((n + 2) < sizeof(packet)) {
+                        packet[n + 2] = (uint8_t)(length >> 8);
+                    }
+                    candidates++;
+                    rescan += length;
+                }
+                CHECK(DECODER_Store(&dec, packet, sizeof(packet)));
+                found += _Drain(seq, 4);
+            }
+
+            // Each byte is scanned once, and a CRC candidate costs one
+            // combine and two partial blocks
+            CHECK(scanBytes <= streamLen);
+            if(mode != 0) {
+                CHECK(found == 0);
+                CHECK(crcCombines <= candidates);
+                CHECK(crcBytes <= (streamLen + (candidates * 2 * DECODER_CRC_STEP)));
+            } else {
+                // The 8-bit checksum lets about one false start in 256 through
+                CHECK(found < (candidates / 64));
+                CHECK((crcBytes == 0) && (crcCombines == 0));
+            }
+            printf("resync, %s, %s lengths: %.2f scanned + %.2f CRC bytes per byte "
+                    "(rescanning: %.0f)\n", (mode != 0) ? "CRC" : "checksum",
+                    (pattern != 0) ? "random" : "1023-byte",
+                    (double)scanBytes / streamLen, (double)crcBytes / streamLen,
+                    (double)rescan / streamLen);
+        }
+    }
+}
+
+int main(void)
+{
+    test_crc32();
+    test_single_frame();
+    test_split_delivery();
+    test_resync();
+    test_wraparound();
+    test_flow_control();
+    test_crc_mode();
+    test_crc_candidates();
+    test_crc_switch();
+    test_wrap_bytes();
+    test_parse_throughput();
+    test_worst_case_work();
+    return TEST_RESULT();
+}
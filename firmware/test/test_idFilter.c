@@ -0,0 +1,292 @@
+#include "time.h"
+#include "test.h"
+#include "idFilter.h"
+
+/*
+ * Home slot of an extended ID in the 128-slot table, as in idFilter.c
+ */
+static uint32_t _Slot(uint32_t id)
+{
+    return (uint32_t)(id * 0x9E3779B1UL) >> (32 - 7);
+}
+
+/*
+ * Finds count IDs from start on whose home slot is slot
+ */
+static void _IdsInSlot(uint32_t slot, uint32_t start, uint32_t * pIds, uint32_t count)
+{
+    uint32_t id = start;
+
+    while(count > 0) {
+        if(_Slot(id) == slot) {
+            *pIds++ = id;
+            count--;
+        }
+        id++;
+    }
+}
+
+static void test_off(void)
+{
+    CHECK(IDFILTER_Config(IDFILTER_MODE_OFF, IDFILTER_MODE_OFF));
+    CHECK(IDFILTER_Accept(false, 0x123));
+    CHECK(IDFILTER_Accept(true, 0x1ABCDEF));
+    CHECK(!IDFILTER_Config(IDFILTER_MODE_BLOCK + 1, IDFILTER_MODE_OFF));
+    CHECK(!IDFILTER_Config(IDFILTER_MODE_OFF, IDFILTER_MODE_BLOCK + 1));
+}
+
+static void test_std_bitmap(void)
+{
+    uint32_t id;
+    bool ok = true;
+
+    CHECK(IDFILTER_Config(IDFILTER_MODE_PASS, IDFILTER_MODE_OFF));
+    CHECK(IDFILTER_AddStd(0x000, 0x000));
+    CHECK(IDFILTER_AddStd(0x11F, 0x141));      // across a bitmap word
+    CHECK(IDFILTER_AddStd(0x7FF, 0x7FF));
+    CHECK(!IDFILTER_AddStd(0x200, 0x1FF));     // reversed
+    CHECK(!IDFILTER_AddStd(0x7FF, 0x800));     // out of range
+
+    for(id = 0; id <= 0x7FF; id++) {
+        const bool listed = (id == 0x000) || (id == 0x7FF) || ((id >= 0x11F) && (id <= 0x141));
+        ok = ok && (IDFILTER_Accept(false, id) == listed);
+    }
+    CHECK(ok);
+
+    // Extended IDs are not filtered
+    CHECK(IDFILTER_Accept(true, 0x11F));
+
+    // Block mode inverts, a new config clears the list
+    CHECK(IDFILTER_Config(IDFILTER_MODE_BLOCK, IDFILTER_MODE_OFF));
+    CHECK(IDFILTER_AddStd(0x100, 0x100));
+    CHECK(!IDFILTER_Accept(false, 0x100));
+    CHECK(IDFILTER_Accept(false, 0x11F));
+    CHECK(IDFILTER_Accept(false, 0x101));
+}
+
+static void test_ext_set(void)
+{
+    CHECK(IDFILTER_Config(IDFILTER_MODE_OFF, IDFILTER_MODE_PASS));
+    CHECK(IDFILTER_GetExtFree() == IDFILTER_EXT_MAX);
+    CHECK(IDFILTER_AddExt(0x18DAF110));
+    CHECK(IDFILTER_AddExt(0x00000000));
+    CHECK(IDFILTER_AddExt(0x1FFFFFFF));
+    CHECK(!IDFILTER_AddExt(0x20000000));
+    CHECK(IDFILTER_GetExtFree() == (IDFILTER_EXT_MAX - 3));
+
+    // A duplicate takes no slot
+    CHECK(IDFILTER_AddExt(0x18DAF110));
+    CHECK(IDFILTER_GetExtFree() == (IDFILTER_EXT_MAX - 3));
+
+    CHECK(IDFILTER_Accept(true, 0x18DAF110));
+    CHECK(IDFILTER_Accept(true, 0x00000000));
+    CHECK(IDFILTER_Accept(true, 0x1FFFFFFF));
+    CHECK(!IDFILTER_Accept(true, 0x18DAF111));
+    CHECK(!IDFILTER_Accept(true, 0x00000001));
+
+    // Standard IDs are not filtered
+    CHECK(IDFILTER_Accept(false, 0x123));
+
+    CHECK(IDFILTER_Config(IDFILTER_MODE_OFF, IDFILTER_MODE_BLOCK));
+    CHECK(IDFILTER_AddExt(0x18DAF110));
+    CHECK(!IDFILTER_Accept(true, 0x18DAF110));
+    CHECK(IDFILTER_Accept(true, 0x18DAF111));
+}
+
+static void test_probe_wrap(void)
+{
+    uint32_t ids[4];
+    uint32_t other[1];
+
+    // Three IDs with the last slot as home slot take slots 127, 0 and 1
+    _IdsInSlot(127, 0, ids, 4);
+    _IdsInSlot(0, 0, other, 1);
+
+    CHECK(IDFILTER_Config(IDFILTER_MODE_OFF, IDFILTER_MODE_PASS));
+    CHECK(IDFILTER_AddExt(ids[0]));
+    CHECK(IDFILTER_AddExt(ids[1]));
+    CHECK(IDFILTER_AddExt(ids[2]));
+    CHECK(IDFILTER_Accept(true, ids[0]));
+    CHECK(IDFILTER_Accept(true, ids[1]));
+    CHECK(IDFILTER_Accept(true, ids[2]));
+    CHECK(!IDFILTER_Accept(true, ids[3]));
+
+    // An ID at home in slot 0 probes past the wrapped ones
+    CHECK(!IDFILTER_Accept(true, other[0]));
+    CHECK(IDFILTER_AddExt(other[0]));
+    CHECK(IDFILTER_Accept(true, other[0]));
+    CHECK(IDFILTER_AddExt(ids[3]));
+    CHECK(IDFILTER_Accept(true, ids[3]));
+    CHECK(IDFILTER_GetExtFree() == (IDFILTER_EXT_MAX - 5));
+}
+
+static void test_ext_capacity(void)
+{
+    uint32_t n;
+    bool ok = true;
+
+    CHECK(IDFILTER_Config(IDFILTER_MODE_OFF, IDFILTER_MODE_PASS));
+    for(n = 0; n < IDFILTER_EXT_MAX; n++) {
+        ok = ok && IDFILTER_AddExt(0x10000000 + n * 0x1001);
+    }
+    CHECK(ok);
+    CHECK(IDFILTER_GetExtFree() == 0);
+    CHECK(IDFILTER_EXT_MAX == 96);
+
+    // Full: a new ID is refused, a listed one is still accepted
+    CHECK(!IDFILTER_AddExt(0x00000001));
+    CHECK(IDFILTER_AddExt(0x10000000));
+
+    for(n = 0; n < IDFILTER_EXT_MAX; n++) {
+        ok = ok && IDFILTER_Accept(true, 0x10000000 + n * 0x1001);
+    }
+    CHECK(ok);
+
+    // Lookups of absent IDs terminate and miss with the table full
+    for(n = 0; n < 4096; n++) {
+        ok = ok && !IDFILTER_Accept(true, 0x00100000 + n);
+    }
+    CHECK(ok);
+}
+
+/*
+ * Reference filter: a linear scan of the same lists
+ */
+static uint32_t refStd[64][2];
+static uint32_t refStdCount;
+static uint32_t refExt[IDFILTER_EXT_MAX];
+static uint32_t refExtCount;
+
+static bool _RefListed(bool isExtended, uint32_t id)
+{
+    uint32_t n;
+
+    if(isExtended) {
+        for(n = 0; n < refExtCount; n++) {
+            if(refExt[n] == id) {
+                return true;
+            }
+        }
+    } else {
+        for(n = 0; n < refStdCount; n++) {
+            if((id >= refStd[n][0]) && (id <= refStd[n][1])) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+static uint32_t seed;
+
+static uint32_t _Rand(void)
+{
+    seed = seed * 1103515245UL + 12345UL;
+    return seed >> 8;
+}
+
+/*
+ * Random ID lists against the reference, then lookups/s of both on a
+ * stream of mostly unlisted IDs, as on a busy bus with a short pass list
+ */
+static void test_reference(void)
+{
+    const uint32_t lookups = 2000000;
+    static uint32_t ids[4096];
+    uint32_t mode;
+    uint32_t n;
+    uint32_t hits;
+    uint32_t refHits;
+    clock_t start;
+    double tFilter;
+    double tRef;
+    bool ok = true;
+
+    seed = 7;
+    for(mode = IDFILTER_MODE_PASS; mode <= IDFILTER_MODE_BLOCK; mode++) {
+        CHECK(IDFILTER_Config((uint8_t)mode, (uint8_t)mode));
+        refStdCount = 0;
+        refExtCount = 0;
+        for(n = 0; n < 64; n++) {
+            const uint32_t first = _Rand() & 0x7FF;
+            uint32_t last = first + (((_Rand() % 4) == 0) ? (_Rand() % 16) : 0);
+
+            last = (last > 0x7FF) ? 0x7FF : last;
+            CHECK(IDFILTER_AddStd(first, last));
+            refStd[refStdCount][0] = first;
+            refStd[refStdCount][1] = last;
+            refStdCount++;
+        }
+        while(refExtCount < IDFILTER_EXT_MAX) {
+            const uint32_t id = _Rand() & 0x1FFFFFFF;
+
+            CHECK(IDFILTER_AddExt(id));
+            if(!_RefListed(true, id)) {
+                refExt[refExtCount++] = id;
+            }
+        }
+
+        // Every standard ID, the listed extended IDs and their neighbours
+        for(n = 0; n <= 0x7FF; n++) {
+            ok = ok && (IDFILTER_Accept(false, n) == (_RefListed(false, n) == (mode == IDFILTER_MODE_PASS)));
+        }
+        for(n = 0; n < refExtCount; n++) {
+            const uint32_t id = refExt[n];
+            ok = ok && (IDFILTER_Accept(true, id) == (mode == IDFILTER_MODE_PASS));
+            ok = ok && (IDFILTER_Accept(true, id ^ 1) ==
+                    (_RefListed(true, id ^ 1) == (mode == IDFILTER_MODE_PASS)));
+        }
+        for(n = 0; n < 100000; n++) {
+            const uint32_t id = _Rand() & 0x1FFFFFFF;
+            ok = ok && (IDFILTER_Accept(true, id) == (_RefListed(true, id) == (mode == IDFILTER_MODE_PASS)));
+        }
+    }
+    CHECK(ok);
+
+    // Pass mode, one ID in 16 listed, half of them extended
+    CHECK(IDFILTER_Config(IDFILTER_MODE_PASS, IDFILTER_MODE_PASS));
+    for(n = 0; n < refStdCount; n++) {
+        CHECK(IDFILTER_AddStd(refStd[n][0], refStd[n][1]));
+    }
+    for(n = 0; n < refExtCount; n++) {
+        CHECK(IDFILTER_AddExt(refExt[n]));
+    }
+    for(n = 0; n < 4096; n++) {
+        const bool isExtended = ((n % 2) != 0);
+        if((_Rand() % 16) == 0) {
+            ids[n] = isExtended ? refExt[_Rand() % refExtCount] : refStd[_Rand() % refStdCount][0];
+        } else {
+            ids[n] = isExtended ? (_Rand() & 0x1FFFFFFF) : (_Rand() & 0x7FF);
+        }
+    }
+
+    hits = 0;
+    start = clock();
+    for(n = 0; n < lookups; n++) {
+        hits += IDFILTER_Accept((n % 2) != 0, ids[n % 4096]) ? 1 : 0;
+    }
+    tFilter = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    refHits = 0;
+    start = clock();
+    for(n = 0; n < lookups; n++) {
+        refHits += _RefListed((n % 2) != 0, ids[n % 4096]) ? 1 : 0;
+    }
+    tRef = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    CHECK(hits == refHits);
+    printf("id filter: %.0f lookups/s, linear scan of %u + %u entries: %.0f lookups/s\n",
+            (tFilter > 0) ? (lookups / tFilter) : 0.0, (unsigned)refStdCount, (unsigned)refExtCount,
+            (tRef > 0) ? (lookups / tRef) : 0.0);
+}
+
+int main(void)
+{
+    test_off();
+    test_std_bitmap();
+    test_ext_set();
+    test_probe_wrap();
+    test_ext_capacity();
+    test_reference();
+    return TEST_RESULT();
+}
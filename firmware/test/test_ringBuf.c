@@ -0,0 +1,137 @@
+#define _POSIX_C_SOURCE 200809L
+#include "string.h"
+#include "pthread.h"
+#include "sched.h"
+#include "test.h"
+#include "UTIL_ringbuf.h"
+
+/*
+ * Two-thread stress test of the single-producer/single-consumer ring
+ * buffer. The producer writes a byte stream in chunks of varying length,
+ * through UTIL_RingBufWrite() and through UTIL_RingBufReserve()/Commit()
+ * with the spill area, the way the CAN Rx and USB Tx paths do. The consumer
+ * reads it back through UTIL_RingBufRead() and through UTIL_RingBufContigUsed()
+ * plus UTIL_RingBufAdvanceRead(), the way CDC_StartTx() does, and checks
+ * every byte against the stream.
+ *
+ * A small buffer keeps both sides wrapping and meeting each other all the
+ * time.
+ */
+#define RING_SIZE           (64)
+#define SPILL_SIZE          (24)
+#define STREAM_LEN          (1UL << 22)
+
+static tRingBufObject ring;
+static uint8_t ringBuf[RING_SIZE + SPILL_SIZE];
+
+/* Byte n of the stream, with no period short enough to hide a lost block */
+static uint8_t _StreamByte(uint32_t n)
+{
+    return (uint8_t)(n ^ (n >> 8) ^ (n >> 16));
+}
+
+static uint32_t _Rand(uint32_t * pSeed)
+{
+    *pSeed = *pSeed * 1103515245UL + 12345UL;
+    return *pSeed >> 8;
+}
+
+static void * _Producer(void * pArg)
+{
+    uint32_t seed = 1;
+    uint32_t sent = 0;
+    uint8_t chunk[SPILL_SIZE];
+
+    (void)pArg;
+    while(sent < STREAM_LEN) {
+        uint32_t len = 1 + (_Rand(&seed) % SPILL_SIZE);
+        uint32_t n;
+
+        if(len > (STREAM_LEN - sent)) {
+            len = STREAM_LEN - sent;
+        }
+        if((_Rand(&seed) % 2) == 0) {
+            while(UTIL_RingBufFree(&ring) < len) {
+                sched_yield();
+            }
+            for(n = 0; n < len; n++) {
+                chunk[n] = _StreamByte(sent + n);
+            }
+            UTIL_RingBufWrite(&ring, chunk, len);
+        } else {
+            uint8_t * pDst;
+
+            while((pDst = UTIL_RingBufReserve(&ring, len)) == NULL) {
+                sched_yield();
+            }
+            for(n = 0; n < len; n++) {
+                pDst[n] = _StreamByte(sent + n);
+            }
+            UTIL_RingBufCommit(&ring, len);
+        }
+        sent += len;
+    }
+    return NULL;
+}
+
+static void * _Consumer(void * pArg)
+{
+    uint32_t * pErrors = pArg;
+    uint32_t seed = 2;
+    uint32_t received = 0;
+    uint8_t chunk[RING_SIZE];
+
+    while(received < STREAM_LEN) {
+        uint32_t len;
+        uint32_t n;
+
+        if((_Rand(&seed) % 2) == 0) {
+            len = UTIL_RingBufUsed(&ring);
+            if(len == 0) {
+                sched_yield();
+                continue;
+            }
+            UTIL_RingBufRead(&ring, chunk, len);
+            for(n = 0; n < len; n++) {
+                *pErrors += (chunk[n] != _StreamByte(received + n)) ? 1 : 0;
+            }
+        } else {
+            const uint8_t * pSrc = &ring.pucBuf[ring.ulReadIndex];
+
+            len = UTIL_RingBufContigUsed(&ring);
+            if(len == 0) {
+                sched_yield();
+                continue;
+            }
+            for(n = 0; n < len; n++) {
+                *pErrors += (pSrc[n] != _StreamByte(received + n)) ? 1 : 0;
+            }
+            UTIL_RingBufAdvanceRead(&ring, len);
+        }
+        received += len;
+    }
+    return NULL;
+}
+
+static void test_spsc(void)
+{
+    pthread_t producer;
+    pthread_t consumer;
+    uint32_t errors = 0;
+
+    UTIL_RingBufInitSpill(&ring, ringBuf, RING_SIZE, SPILL_SIZE);
+    CHECK(pthread_create(&consumer, NULL, _Consumer, &errors) == 0);
+    CHECK(pthread_create(&producer, NULL, _Producer, NULL) == 0);
+    pthread_join(producer, NULL);
+    pthread_join(consumer, NULL);
+
+    // Every byte arrived once and in order, and nothing is left over
+    CHECK(errors == 0);
+    CHECK(UTIL_RingBufEmpty(&ring));
+}
+
+int main(void)
+{
+    test_spsc();
+    return TEST_RESULT();
+}
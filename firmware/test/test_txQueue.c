@@ -0,0 +1,264 @@
+#include "test.h"
+#include "txQueue.h"
+
+static uint32_t newKey[TXQUEUE_SIZE];
+
+static uint32_t _KeyOf(uint8_t slot)
+{
+    return newKey[slot];
+}
+
+/*
+ * Pops every queued slot into pSlots and frees them, returns the count
+ */
+static uint32_t _PopAll(uint8_t * pSlots)
+{
+    uint32_t count = 0;
+    int32_t slot;
+
+    while((slot = TXQUEUE_Pop()) >= 0) {
+        pSlots[count++] = (uint8_t)slot;
+        TXQUEUE_Free((uint8_t)slot);
+    }
+    return count;
+}
+
+/*
+ * Built with TXQUEUE_FIRST_SEQ a few pushes short of the wrap (see
+ * Makefile), so this runs first. Equal keys stay in push order while the
+ * sequence numbers wrap from 0xFFFFFFFF to 0, in FIFO and priority order.
+ */
+static void test_seq_wrap(void)
+{
+    uint8_t pushed[TXQUEUE_SIZE];
+    uint8_t popped[TXQUEUE_SIZE];
+    uint32_t n;
+    bool ok = true;
+
+    CHECK(TXQUEUE_FIRST_SEQ > (0xFFFFFFFFUL - TXQUEUE_SIZE));
+    for(n = 0; n < TXQUEUE_SIZE; n++) {
+        pushed[n] = (uint8_t)TXQUEUE_Alloc();
+        TXQUEUE_Push(pushed[n], 0);
+    }
+    CHECK(_PopAll(popped) == TXQUEUE_SIZE);
+    for(n = 0; n < TXQUEUE_SIZE; n++) {
+        ok = ok && (popped[n] == pushed[n]);
+    }
+    CHECK(ok);
+}
+
+/*
+ * The top-priority ID is pushed behind a backlog of lower priority frames.
+ * Its queueing delay, in frames sent before it, is 0 in priority order and
+ * the whole backlog in FIFO order.
+ */
+static uint32_t _TopDelay(uint32_t backlog, bool priority)
+{
+    uint8_t popped[TXQUEUE_SIZE];
+    uint8_t top;
+    uint32_t n;
+
+    for(n = 0; n < backlog; n++) {
+        TXQUEUE_Push((uint8_t)TXQUEUE_Alloc(), priority ? (0x7FFUL << 19) - n : 0);
+    }
+    top = (uint8_t)TXQUEUE_Alloc();
+    TXQUEUE_Push(top, 0);
+
+    CHECK(_PopAll(popped) == (backlog + 1));
+    for(n = 0; popped[n] != top; n++) {
+    }
+    return n;
+}
+
+static void test_overtake(void)
+{
+    uint32_t backlog;
+    bool ok = true;
+
+    for(backlog = 0; backlog < TXQUEUE_SIZE; backlog++) {
+        ok = ok && (_TopDelay(backlog, true) == 0);
+        ok = ok && (_TopDelay(backlog, false) == backlog);
+    }
+    CHECK(ok);
+    CHECK(TXQUEUE_GetFree() == TXQUEUE_SIZE);
+}
+
+static void test_alloc(void)
+{
+    bool used[TXQUEUE_SIZE] = { false };
+    int32_t slot;
+    uint32_t n;
+    bool ok = true;
+
+    CHECK(TXQUEUE_GetFree() == TXQUEUE_SIZE);
+    CHECK(TXQUEUE_Pop() == -1);
+
+    // Every slot once, then none
+    for(n = 0; n < TXQUEUE_SIZE; n++) {
+        slot = TXQUEUE_Alloc();
+        ok = ok && (slot >= 0) && (slot < TXQUEUE_SIZE) && !used[slot];
+        if((slot >= 0) && (slot < TXQUEUE_SIZE)) {
+            used[slot] = true;
+        }
+    }
+    CHECK(ok);
+    CHECK(TXQUEUE_GetFree() == 0);
+    CHECK(TXQUEUE_Alloc() == -1);
+
+    // A freed slot in the second bitmap word is found again
+    TXQUEUE_Free(40);
+    CHECK(TXQUEUE_GetFree() == 1);
+    CHECK(TXQUEUE_Alloc() == 40);
+
+    for(n = 0; n < TXQUEUE_SIZE; n++) {
+        TXQUEUE_Free((uint8_t)n);
+    }
+    CHECK(TXQUEUE_GetFree() == TXQUEUE_SIZE);
+}
+
+static void test_fifo(void)
+{
+    uint8_t pushed[TXQUEUE_SIZE];
+    uint8_t popped[TXQUEUE_SIZE];
+    uint32_t n;
+    bool ok = true;
+
+    // All keys 0: plain FIFO, also across a full queue
+    for(n = 0; n < TXQUEUE_SIZE; n++) {
+        pushed[n] = (uint8_t)TXQUEUE_Alloc();
+        TXQUEUE_Push(pushed[n], 0);
+    }
+    CHECK(TXQUEUE_Count() == TXQUEUE_SIZE);
+    CHECK(_PopAll(popped) == TXQUEUE_SIZE);
+    for(n = 0; n < TXQUEUE_SIZE; n++) {
+        ok = ok && (popped[n] == pushed[n]);
+    }
+    CHECK(ok);
+    CHECK(TXQUEUE_Count() == 0);
+    CHECK(TXQUEUE_GetFree() == TXQUEUE_SIZE);
+}
+
+static void test_key_order(void)
+{
+    uint32_t key[TXQUEUE_SIZE];
+    uint8_t popped[TXQUEUE_SIZE];
+    uint32_t seed = 12345;
+    uint32_t n;
+    bool ok = true;
+
+    // Keys from a small range so many are equal
+    for(n = 0; n < TXQUEUE_SIZE; n++) {
+        const int32_t slot = TXQUEUE_Alloc();
+        seed = seed * 1103515245UL + 12345UL;
+        key[slot] = (seed >> 16) % 8;
+        TXQUEUE_Push((uint8_t)slot, key[slot]);
+    }
+    CHECK(_PopAll(popped) == TXQUEUE_SIZE);
+
+    // Ascending keys, equal keys in push order (here the slot order)
+    for(n = 1; n < TXQUEUE_SIZE; n++) {
+        const uint32_t a = key[popped[n - 1]];
+        const uint32_t b = key[popped[n]];
+        ok = ok && ((a < b) || ((a == b) && (popped[n - 1] < popped[n])));
+    }
+    CHECK(ok);
+}
+
+static void test_stable_equal_ids(void)
+{
+    uint8_t slots[6];
+    uint8_t popped[6];
+    uint32_t n;
+
+    // 0x100 pushed three times around a lower and a higher key
+    for(n = 0; n < 6; n++) {
+        slots[n] = (uint8_t)TXQUEUE_Alloc();
+    }
+    TXQUEUE_Push(slots[0], 0x100);
+    TXQUEUE_Push(slots[1], 0x200);
+    TXQUEUE_Push(slots[2], 0x100);
+    TXQUEUE_Push(slots[3], 0x080);
+    TXQUEUE_Push(slots[4], 0x100);
+    TXQUEUE_Push(slots[5], 0x200);
+
+    CHECK(_PopAll(popped) == 6);
+    CHECK(popped[0] == slots[3]);
+    CHECK(popped[1] == slots[0]);
+    CHECK(popped[2] == slots[2]);
+    CHECK(popped[3] == slots[4]);
+    CHECK(popped[4] == slots[1]);
+    CHECK(popped[5] == slots[5]);
+}
+
+static void test_requeue(void)
+{
+    uint8_t slots[4];
+    uint8_t popped[4];
+    int32_t slot;
+    uint32_t n;
+
+    for(n = 0; n < 4; n++) {
+        slots[n] = (uint8_t)TXQUEUE_Alloc();
+        TXQUEUE_Push(slots[n], 7);
+    }
+
+    // A popped slot the hardware did not take goes back to the front
+    slot = TXQUEUE_Pop();
+    CHECK(slot == slots[0]);
+    TXQUEUE_Requeue((uint8_t)slot);
+    CHECK(TXQUEUE_Count() == 4);
+    CHECK(_PopAll(popped) == 4);
+    for(n = 0; n < 4; n++) {
+        CHECK(popped[n] == slots[n]);
+    }
+}
+
+static void test_rekey(void)
+{
+    uint8_t slots[5];
+    uint8_t popped[5];
+    uint32_t n;
+
+    // Queued in FIFO mode, then switched to priority order
+    for(n = 0; n < 5; n++) {
+        slots[n] = (uint8_t)TXQUEUE_Alloc();
+        TXQUEUE_Push(slots[n], 0);
+    }
+    newKey[slots[0]] = 50;
+    newKey[slots[1]] = 10;
+    newKey[slots[2]] = 30;
+    newKey[slots[3]] = 10;
+    newKey[slots[4]] = 20;
+    TXQUEUE_Rekey(_KeyOf);
+    CHECK(_PopAll(popped) == 5);
+    CHECK(popped[0] == slots[1]);
+    CHECK(popped[1] == slots[3]);
+    CHECK(popped[2] == slots[4]);
+    CHECK(popped[3] == slots[2]);
+    CHECK(popped[4] == slots[0]);
+
+    // And back to FIFO
+    for(n = 0; n < 5; n++) {
+        slots[n] = (uint8_t)TXQUEUE_Alloc();
+        TXQUEUE_Push(slots[n], 5 - n);
+        newKey[slots[n]] = 0;
+    }
+    TXQUEUE_Rekey(_KeyOf);
+    CHECK(_PopAll(popped) == 5);
+    for(n = 0; n < 5; n++) {
+        CHECK(popped[n] == slots[n]);
+    }
+}
+
+int main(void)
+{
+    test_seq_wrap();
+    test_alloc();
+    test_fifo();
+    test_key_order();
+    test_stable_equal_ids();
+    test_requeue();
+    test_rekey();
+    test_overtake();
+    return TEST_RESULT();
+}
@@ -0,0 +1,215 @@
+#include "string.h"
+#include "test.h"
+#include "txSlab.h"
+
+static uint8_t data[64];
+
+/*
+ * Reads back a frame and compares it with what was stored
+ */
+static bool _Matches(uint8_t handle, uint32_t identifier, uint8_t flags, uint8_t marker,
+        const uint8_t * pData, uint8_t len)
+{
+    uint8_t out[64];
+    uint32_t outId;
+    uint8_t outFlags;
+    uint8_t outMarker;
+
+    memset(out, 0xEE, sizeof(out));
+    if(TXSLAB_Get(handle, &outId, &outFlags, &outMarker, out) != len) {
+        return false;
+    }
+    return (outId == identifier) && (outFlags == flags) && (outMarker == marker) &&
+            (memcmp(out, pData, len) == 0);
+}
+
+static void test_chunks_for(void)
+{
+    CHECK(TXSLAB_MAX_CHUNKS == 5);
+    CHECK(TXSLAB_ChunksFor(0) == 1);
+    CHECK(TXSLAB_ChunksFor(8) == 1);
+    CHECK(TXSLAB_ChunksFor(9) == 2);
+    CHECK(TXSLAB_ChunksFor(24) == 2);
+    CHECK(TXSLAB_ChunksFor(25) == 3);
+    CHECK(TXSLAB_ChunksFor(56) == 4);
+    CHECK(TXSLAB_ChunksFor(57) == 5);
+    CHECK(TXSLAB_ChunksFor(64) == TXSLAB_MAX_CHUNKS);
+}
+
+static void test_round_trip(void)
+{
+    uint32_t len;
+    bool ok = true;
+
+    for(len = 0; len <= 64; len++) {
+        const int32_t handle = TXSLAB_Put(0x1FFFFFFF - len, (uint8_t)len, (uint8_t)(0xA0 + len),
+                data, (uint8_t)len);
+        ok = ok && (handle >= 0);
+        ok = ok && (TXSLAB_GetFree() == (TXSLAB_CHUNK_COUNT - TXSLAB_ChunksFor((uint8_t)len)));
+        if(handle >= 0) {
+            uint32_t identifier;
+            uint8_t flags;
+            uint8_t marker;
+
+            ok = ok && _Matches((uint8_t)handle, 0x1FFFFFFF - len, (uint8_t)len,
+                    (uint8_t)(0xA0 + len), data, (uint8_t)len);
+            // Header only
+            ok = ok && (TXSLAB_Get((uint8_t)handle, &identifier, &flags, &marker, NULL) == len);
+            ok = ok && (identifier == (0x1FFFFFFF - len));
+            TXSLAB_Free((uint8_t)handle);
+        }
+        ok = ok && (TXSLAB_GetFree() == TXSLAB_CHUNK_COUNT);
+    }
+    CHECK(ok);
+
+    CHECK(TXSLAB_Put(0x123, 0, 0, data, 65) == -1);
+    CHECK(TXSLAB_GetFree() == TXSLAB_CHUNK_COUNT);
+}
+
+static void test_capacity(void)
+{
+    uint8_t handle[TXSLAB_CHUNK_COUNT];
+    uint32_t n;
+    bool ok = true;
+
+    // One chunk per classic frame
+    for(n = 0; n < TXSLAB_CHUNK_COUNT; n++) {
+        const int32_t h = TXSLAB_Put(n, 0, 0, data, 8);
+        ok = ok && (h >= 0);
+        handle[n] = (uint8_t)h;
+    }
+    CHECK(ok);
+    CHECK(TXSLAB_GetFree() == 0);
+    CHECK(TXSLAB_Put(0, 0, 0, data, 0) == -1);
+    for(n = 0; n < TXSLAB_CHUNK_COUNT; n++) {
+        ok = ok && _Matches(handle[n], n, 0, 0, data, 8);
+        TXSLAB_Free(handle[n]);
+    }
+    CHECK(ok);
+    CHECK(TXSLAB_GetFree() == TXSLAB_CHUNK_COUNT);
+
+    // Five chunks per 64-byte frame
+    for(n = 0; n < (TXSLAB_CHUNK_COUNT / TXSLAB_MAX_CHUNKS); n++) {
+        const int32_t h = TXSLAB_Put(n, 0, 0, data, 64);
+        ok = ok && (h >= 0);
+        handle[n] = (uint8_t)h;
+    }
+    CHECK(ok);
+    CHECK(TXSLAB_GetFree() == 0);
+    CHECK(TXSLAB_Put(0, 0, 0, data, 64) == -1);
+    for(n = 0; n < (TXSLAB_CHUNK_COUNT / TXSLAB_MAX_CHUNKS); n++) {
+        TXSLAB_Free(handle[n]);
+    }
+    CHECK(TXSLAB_GetFree() == TXSLAB_CHUNK_COUNT);
+}
+
+static void test_fragmentation(void)
+{
+    uint8_t handle[TXSLAB_CHUNK_COUNT];
+    uint8_t big[TXSLAB_CHUNK_COUNT / 2 / TXSLAB_MAX_CHUNKS];
+    uint32_t n;
+    bool ok = true;
+
+    // Every other frame freed, the free chunks are scattered over the slab
+    for(n = 0; n < TXSLAB_CHUNK_COUNT; n++) {
+        handle[n] = (uint8_t)TXSLAB_Put(n, 0, 0, data, 4);
+    }
+    for(n = 0; n < TXSLAB_CHUNK_COUNT; n += 2) {
+        TXSLAB_Free(handle[n]);
+    }
+    CHECK(TXSLAB_GetFree() == (TXSLAB_CHUNK_COUNT / 2));
+
+    // The scattered chunks still take 64-byte frames, all of them
+    for(n = 0; n < sizeof(big); n++) {
+        const int32_t h = TXSLAB_Put(0x1000 + n, 0x03, (uint8_t)n, data, 64);
+        ok = ok && (h >= 0);
+        big[n] = (uint8_t)h;
+    }
+    CHECK(ok);
+    CHECK(TXSLAB_GetFree() == 0);
+
+    for(n = 0; n < sizeof(big); n++) {
+        ok = ok && _Matches(big[n], 0x1000 + n, 0x03, (uint8_t)n, data, 64);
+    }
+    for(n = 1; n < TXSLAB_CHUNK_COUNT; n += 2) {
+        ok = ok && _Matches(handle[n], n, 0, 0, data, 4);
+        TXSLAB_Free(handle[n]);
+    }
+    for(n = 0; n < sizeof(big); n++) {
+        TXSLAB_Free(big[n]);
+    }
+    CHECK(ok);
+    CHECK(TXSLAB_GetFree() == TXSLAB_CHUNK_COUNT);
+}
+
+static void test_random(void)
+{
+    struct {
+        bool used;
+        uint8_t handle;
+        uint32_t identifier;
+        uint8_t len;
+        uint8_t data[64];
+    } ref[64];
+    uint32_t seed = 1;
+    uint32_t usedChunks = 0;
+    uint32_t n;
+    uint32_t i;
+    bool ok = true;
+
+    memset(ref, 0, sizeof(ref));
+    for(n = 0; n < 100000; n++) {
+        seed = seed * 1103515245UL + 12345UL;
+        i = (seed >> 16) % 64;
+        if(ref[i].used) {
+            ok = ok && _Matches(ref[i].handle, ref[i].identifier, 0, 0, ref[i].data, ref[i].len);
+            TXSLAB_Free(ref[i].handle);
+            usedChunks -= TXSLAB_ChunksFor(ref[i].len);
+            ref[i].used = false;
+        } else {
+            const uint8_t len = (uint8_t)((seed >> 8) % 65);
+            int32_t h;
+
+            for(uint32_t k = 0; k < len; k++) {
+                ref[i].data[k] = (uint8_t)(seed >> (k % 24));
+            }
+            h = TXSLAB_Put(n, 0, 0, ref[i].data, len);
+            if((usedChunks + TXSLAB_ChunksFor(len)) <= TXSLAB_CHUNK_COUNT) {
+                ok = ok && (h >= 0);
+            } else {
+                ok = ok && (h == -1);
+            }
+            if(h >= 0) {
+                ref[i].used = true;
+                ref[i].handle = (uint8_t)h;
+                ref[i].identifier = n;
+                ref[i].len = len;
+                usedChunks += TXSLAB_ChunksFor(len);
+            }
+        }
+        ok = ok && (TXSLAB_GetFree() == (TXSLAB_CHUNK_COUNT - usedChunks));
+    }
+    CHECK(ok);
+
+    for(i = 0; i < 64; i++) {
+        if(ref[i].used) {
+            TXSLAB_Free(ref[i].handle);
+        }
+    }
+    CHECK(TXSLAB_GetFree() == TXSLAB_CHUNK_COUNT);
+}
+
+int main(void)
+{
+    uint32_t n;
+
+    for(n = 0; n < sizeof(data); n++) {
+        data[n] = (uint8_t)(0x80 ^ (n * 13));
+    }
+    test_chunks_for();
+    test_round_trip();
+    test_capacity();
+    test_fragmentation();
+    test_random();
+    return TEST_RESULT();
+}
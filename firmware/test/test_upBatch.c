@@ -0,0 +1,195 @@
+#include "string.h"
+#include "time.h"
+#include "test.h"
+#include "upBatch.h"
+
+#define RX_TYPE_EXT     (0x4)
+#define SINGLE_SIZE(dlc)    (FRAME_OVERHEAD + 7 + (dlc))   /* CMD_SEND_UPSTREAM frame */
+
+static UpBatch_t batch;
+static uint8_t data[64];
+
+/*
+ * Checks the record at *ppRec against what was added and steps past it
+ */
+static bool _RecordIs(const uint8_t ** ppRec, uint8_t type, uint32_t identifier, uint8_t dlc,
+        uint16_t delta)
+{
+    const uint8_t * pRec = *ppRec;
+    const uint32_t idSize = ((type & RX_TYPE_EXT) == 0) ? 2 : 4;
+    uint32_t outId = pRec[4] | (pRec[5] << 8);
+
+    if(idSize == 4) {
+        outId |= ((uint32_t)pRec[6] << 16) | ((uint32_t)pRec[7] << 24);
+    }
+    *ppRec += 4 + idSize + pRec[1];
+    return (pRec[0] == type) && (pRec[1] == dlc) && ((pRec[2] | (pRec[3] << 8)) == delta) &&
+            (outId == identifier) && (memcmp(&pRec[4 + idSize], data, dlc) == 0);
+}
+
+static void test_record_size(void)
+{
+    // FRAME_SPECIFICATION.md: 14 bytes for a classic 8-byte standard ID frame
+    CHECK(UPBATCH_RecordSize(0, 8) == 14);
+    CHECK(UPBATCH_RecordSize(RX_TYPE_EXT, 8) == 16);
+    CHECK(UPBATCH_RecordSize(0, 0) == 6);
+    CHECK(UPBATCH_RecordSize(RX_TYPE_EXT | 0x3, 64) == 72);
+}
+
+static void test_mixed_dlc(void)
+{
+    const uint8_t * pRec;
+    uint32_t n;
+    uint32_t len;
+    bool ok = true;
+
+    UPBATCH_Init(&batch);
+    CHECK(UPBATCH_Finish(&batch) == 0);
+
+    // Alternating standard and extended IDs, DLC 0, 1, 2, ... up to 20
+    for(n = 0; n <= 20; n++) {
+        const uint8_t type = ((n % 2) == 0) ? 0 : RX_TYPE_EXT;
+        ok = ok && UPBATCH_Add(&batch, type, 0x100 + n, (uint8_t)n, data,
+                0x12345678UL + (n * 7), CONFIG_UPSTREAM_BATCH_SIZE);
+    }
+    CHECK(ok);
+    CHECK(batch.count == 21);
+
+    len = UPBATCH_Finish(&batch);
+    CHECK(len == (batch.len + 1));
+    CHECK(batch.buffer[PAYLOAD_OFFSET] == CMD_SEND_UPSTREAM_BATCH);
+    CHECK(batch.buffer[UPBATCH_COUNT_OFFSET] == 21);
+    CHECK(batch.buffer[UPBATCH_BASE_TS_OFFSET] == 0x78);
+    CHECK(batch.buffer[UPBATCH_BASE_TS_OFFSET + 3] == 0x12);
+
+    pRec = &batch.buffer[UPBATCH_RECORD_OFFSET];
+    for(n = 0; n <= 20; n++) {
+        const uint8_t type = ((n % 2) == 0) ? 0 : RX_TYPE_EXT;
+        ok = ok && _RecordIs(&pRec, type, 0x100 + n, (uint8_t)n, (uint16_t)(n * 7));
+    }
+    CHECK(ok);
+    CHECK(pRec == &batch.buffer[len - 1]);
+
+    // Largest records: 64-byte CAN-FD frames with extended IDs
+    UPBATCH_Init(&batch);
+    for(n = 0; UPBATCH_Add(&batch, RX_TYPE_EXT, 0x1FFFFFFF, 64, data, 0,
+            CONFIG_UPSTREAM_BATCH_SIZE); n++) {
+    }
+    CHECK(n == ((CONFIG_UPSTREAM_BATCH_SIZE - UPBATCH_RECORD_OFFSET - 1) / 72));
+    pRec = &batch.buffer[UPBATCH_RECORD_OFFSET];
+    CHECK(_RecordIs(&pRec, RX_TYPE_EXT, 0x1FFFFFFF, 64, 0));
+}
+
+static void test_full_batch(void)
+{
+    const uint32_t base = 0xFFFFFFF0UL;
+    uint32_t n;
+    uint32_t len;
+
+    // 35 classic 8-byte records fill 505 of the 512 bytes, a 36th does not fit
+    UPBATCH_Init(&batch);
+    for(n = 0; n < 35; n++) {
+        CHECK(UPBATCH_Add(&batch, 0, 0x123, 8, data, n, CONFIG_UPSTREAM_BATCH_SIZE));
+    }
+    len = batch.len;
+    CHECK(!UPBATCH_Add(&batch, 0, 0x123, 8, data, n, CONFIG_UPSTREAM_BATCH_SIZE));
+    CHECK((batch.count == 35) && (batch.len == len));
+    CHECK(UPBATCH_Finish(&batch) == (UPBATCH_RECORD_OFFSET + (35 * 14) + 1));
+    CHECK(UPBATCH_Finish(&batch) <= CONFIG_UPSTREAM_BATCH_SIZE);
+
+    // A smaller record still fits the remaining 6 bytes
+    CHECK(UPBATCH_Add(&batch, 0, 0x123, 0, data, n, CONFIG_UPSTREAM_BATCH_SIZE));
+    CHECK(UPBATCH_Finish(&batch) == CONFIG_UPSTREAM_BATCH_SIZE);
+
+    // The space left in the USB Tx buffer limits the batch as well
+    UPBATCH_Init(&batch);
+    for(n = 0; UPBATCH_Add(&batch, 0, 0x123, 8, data, n, 100); n++) {
+    }
+    CHECK(n == 6);
+    CHECK(UPBATCH_Finish(&batch) <= 100);
+
+    // An empty batch takes the record whatever the capacity
+    UPBATCH_Init(&batch);
+    CHECK(UPBATCH_Add(&batch, 0, 0x123, 8, data, 0, 0));
+    CHECK(batch.count == 1);
+
+    // The 16-bit timestamp delta ends a batch too
+    UPBATCH_Init(&batch);
+    CHECK(UPBATCH_Add(&batch, 0, 0x123, 8, data, base, CONFIG_UPSTREAM_BATCH_SIZE));
+    CHECK(UPBATCH_Add(&batch, 0, 0x123, 8, data, base + UINT16_MAX,
+            CONFIG_UPSTREAM_BATCH_SIZE));
+    CHECK(!UPBATCH_Add(&batch, 0, 0x123, 8, data, base + UINT16_MAX + 1,
+            CONFIG_UPSTREAM_BATCH_SIZE));
+    CHECK(batch.count == 2);
+}
+
+static void test_flush_on_age(void)
+{
+    const uint32_t base = 0xFFFFFFC0UL;
+
+    UPBATCH_Init(&batch);
+    CHECK(!UPBATCH_IsDue(&batch, 1000000, CONFIG_UPSTREAM_BATCH_AGE));
+
+    // Age counts from the first record, across the TIM2 wrap
+    CHECK(UPBATCH_Add(&batch, 0, 0x123, 8, data, base, CONFIG_UPSTREAM_BATCH_SIZE));
+    CHECK(UPBATCH_Add(&batch, 0, 0x124, 8, data, base + 0x30, CONFIG_UPSTREAM_BATCH_SIZE));
+    CHECK(!UPBATCH_IsDue(&batch, base, CONFIG_UPSTREAM_BATCH_AGE));
+    CHECK(!UPBATCH_IsDue(&batch, base + CONFIG_UPSTREAM_BATCH_AGE - 1,
+            CONFIG_UPSTREAM_BATCH_AGE));
+    CHECK(UPBATCH_IsDue(&batch, base + CONFIG_UPSTREAM_BATCH_AGE,
+            CONFIG_UPSTREAM_BATCH_AGE));
+    CHECK(UPBATCH_IsDue(&batch, base + 10, 10));
+
+    // A flushed batch is no longer due and starts a new base timestamp
+    CHECK(UPBATCH_Finish(&batch) > 0);
+    UPBATCH_Init(&batch);
+    CHECK(!UPBATCH_IsDue(&batch, base + CONFIG_UPSTREAM_BATCH_AGE,
+            CONFIG_UPSTREAM_BATCH_AGE));
+    CHECK(UPBATCH_Add(&batch, 0, 0x125, 8, data, 500, CONFIG_UPSTREAM_BATCH_SIZE));
+    CHECK(batch.baseTs == 500);
+}
+
+/*
+ * Bytes on the wire per CAN frame, and encoder frames/s on this host, for
+ * a stream of classic 8-byte frames
+ */
+static void test_throughput(void)
+{
+    const uint32_t frames = 2000000;
+    uint32_t bytes = 0;
+    uint32_t n;
+    clock_t start;
+    double seconds;
+
+    UPBATCH_Init(&batch);
+    start = clock();
+    for(n = 0; n < frames; n++) {
+        if(!UPBATCH_Add(&batch, 0, 0x123, 8, data, n, CONFIG_UPSTREAM_BATCH_SIZE)) {
+            bytes += UPBATCH_Finish(&batch);
+            UPBATCH_Init(&batch);
+            (void)UPBATCH_Add(&batch, 0, 0x123, 8, data, n, CONFIG_UPSTREAM_BATCH_SIZE);
+        }
+    }
+    bytes += UPBATCH_Finish(&batch);
+    seconds = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    // 506 bytes per 35 frames against 25 bytes a frame one by one
+    CHECK((bytes * 100UL / frames) < 1450);
+    printf("upstream batch: %.2f bytes/frame (single: %u), %.0f frames/s\n",
+            (double)bytes / frames, SINGLE_SIZE(8), (seconds > 0) ? (frames / seconds) : 0.0);
+}
+
+int main(void)
+{
+    uint32_t n;
+
+    for(n = 0; n < sizeof(data); n++) {
+        data[n] = (uint8_t)(0xA0 + n);
+    }
+    test_record_size();
+    test_mixed_dlc();
+    test_full_batch();
+    test_flush_on_age();
+    test_throughput();
+    return TEST_RESULT();
+}
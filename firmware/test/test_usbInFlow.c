@@ -0,0 +1,229 @@
+#include "string.h"
+#include "test.h"
+#include "UTIL_ringbuf.h"
+
+/*
+ * Host simulation of the USB IN path of usbd_cdc_if.c: upstream frames are
+ * reserved and committed in usbTxRb the way PARSER_ReserveFrame() and
+ * PARSER_CommitFrame() do, and sent as multi-packet transfers straight from
+ * the ring the way CDC_StartTx() and CDC_TransmitCplt_FS() do.
+ *
+ * Time runs in packet slots, 19 bulk packets to a 1 ms full-speed frame.
+ * The endpoint sends one packet per slot while a transfer is active; a
+ * transfer that is a multiple of the packet size ends with a ZLP, as in
+ * USBD_CDC_DataIn().
+ */
+#define PACKET_SIZE         (64)
+#define SLOTS_PER_MS        (19)
+#define RB_SIZE             (2048)  /* USB_TX_RB_SIZE */
+#define SPILL_SIZE          (1024)  /* FRAME_TX_SPILL_SIZE */
+#define MAX_TRANSFER        (1024)  /* CDC_TX_MAX_TRANSFER */
+#define SIM_BYTES           (4UL * 1024 * 1024)
+
+typedef struct {
+    const uint8_t * pData;  // transfer in progress, NULL if idle
+    uint32_t size;
+    uint32_t sent;
+    bool zlp;               // ZLP still to send
+
+    uint32_t transfers;
+    uint32_t packets;       // ZLPs included
+    uint32_t zlps;
+    uint32_t fullTransfers; // transfers that are a multiple of the packet size
+    uint32_t badSpans;      // transfers not inside the ring
+} InEndpoint_t;
+
+static tRingBufObject usbTxRb;
+static uint8_t usbTxRbSto[RB_SIZE + SPILL_SIZE];
+static InEndpoint_t ep;
+static uint32_t seed;
+static uint32_t txCount;    // bytes committed by the producer
+static uint32_t rxCount;    // bytes received by the host
+static uint32_t rxErrors;
+
+static uint32_t _Rand(void)
+{
+    seed = seed * 1103515245UL + 12345UL;
+    return seed >> 8;
+}
+
+static uint8_t _StreamByte(uint32_t n)
+{
+    return (uint8_t)(n ^ (n >> 8) ^ (n >> 16));
+}
+
+/*
+ * CDC_Transmit_FS()
+ */
+static void _Transmit(const uint8_t * pBuf, uint32_t size)
+{
+    if((pBuf < usbTxRb.pucBuf) || ((pBuf + size) > &usbTxRb.pucBuf[usbTxRb.ulSize])) {
+        ep.badSpans++;
+    }
+    ep.pData = pBuf;
+    ep.size = size;
+    ep.sent = 0;
+    ep.zlp = ((size % PACKET_SIZE) == 0);
+    ep.fullTransfers += ep.zlp ? 1 : 0;
+    ep.transfers++;
+}
+
+/*
+ * CDC_StartTx()
+ */
+static void _StartTx(void)
+{
+    uint32_t size;
+
+    if(ep.pData != NULL) {
+        return;
+    }
+    size = UTIL_RingBufContigUsed(&usbTxRb);
+    if(size > MAX_TRANSFER) {
+        size = MAX_TRANSFER;
+    }
+    if(size != 0) {
+        _Transmit(&usbTxRb.pucBuf[usbTxRb.ulReadIndex], size);
+    }
+}
+
+/*
+ * CDC_TransmitCplt_FS()
+ */
+static void _TransmitCplt(uint32_t len)
+{
+    UTIL_RingBufAdvanceRead(&usbTxRb, len);
+    _StartTx();
+}
+
+/*
+ * One packet slot on the bus
+ */
+static void _Slot(void)
+{
+    uint32_t len;
+    uint32_t n;
+
+    if(ep.pData == NULL) {
+        return;
+    }
+    len = ep.size - ep.sent;
+    if(len > PACKET_SIZE) {
+        len = PACKET_SIZE;
+    }
+    if(len == 0) {
+        // The ZLP of a transfer that filled its last packet
+        ep.zlp = false;
+        ep.zlps++;
+    } else {
+        for(n = 0; n < len; n++) {
+            rxErrors += (ep.pData[ep.sent + n] != _StreamByte(rxCount + n)) ? 1 : 0;
+        }
+        ep.sent += len;
+        rxCount += len;
+    }
+    ep.packets++;
+    if((ep.sent == ep.size) && !ep.zlp) {
+        const uint32_t size = ep.size;
+
+        ep.pData = NULL;
+        _TransmitCplt(size);
+    }
+}
+
+/*
+ * PARSER_ReserveFrame() and PARSER_CommitFrame(): reserves room for the
+ * largest frame the caller may build, commits the frame it did build
+ */
+static bool _Produce(uint32_t maxLen, uint32_t len)
+{
+    uint8_t * pBuf = UTIL_RingBufReserve(&usbTxRb, maxLen);
+    uint32_t n;
+
+    if(pBuf == NULL) {
+        return false;
+    }
+    for(n = 0; n < len; n++) {
+        pBuf[n] = _StreamByte(txCount + n);
+    }
+    UTIL_RingBufCommit(&usbTxRb, len);
+    txCount += len;
+    return true;
+}
+
+/*
+ * Runs until SIM_BYTES were committed and all of it received. The producer commits a frame in
+ * about one slot out of producerRate, a single CAN frame or a batch. The
+ * main loop calls CDC_ProcessTx() in one slot out of four. Returns the
+ * number of slots taken.
+ */
+static uint32_t _Run(uint32_t producerRate)
+{
+    uint32_t slots;
+
+    UTIL_RingBufInitSpill(&usbTxRb, usbTxRbSto, RB_SIZE, SPILL_SIZE);
+    memset(&ep, 0, sizeof(ep));
+    seed = 1;
+    txCount = 0;
+    rxCount = 0;
+    rxErrors = 0;
+
+    for(slots = 0; (txCount < SIM_BYTES) || (rxCount < txCount); slots++) {
+        if((txCount < SIM_BYTES) && ((_Rand() % producerRate) == 0)) {
+            if((_Rand() % 4) == 0) {
+                // Upstream batch, reserved at its largest size
+                (void)_Produce(512 + 3, 16 + (_Rand() % 497));
+            } else {
+                // CMD_SEND_UPSTREAM, classic or CAN-FD
+                const uint32_t dlc = ((_Rand() % 2) == 0) ? 8 : 64;
+                (void)_Produce(17 + dlc + 3, 17 + (_Rand() % (dlc + 1)));
+            }
+        }
+        _Slot();
+        if((_Rand() % 4) == 0) {
+            _StartTx();     // CDC_ProcessTx()
+        }
+    }
+    return slots;
+}
+
+static void test_spans(void)
+{
+    // A producer faster than the bus keeps the ring full: every byte arrives
+    // in order, transfers never reach into the spill area, and each one
+    // ends on a short packet or a ZLP
+    _Run(1);
+    CHECK(rxErrors == 0);
+    CHECK(rxCount == txCount);
+    CHECK(ep.badSpans == 0);
+    CHECK(ep.transfers > (SIM_BYTES / MAX_TRANSFER));
+    CHECK(ep.zlps > 0);
+    CHECK(ep.zlps == ep.fullTransfers);
+    CHECK(UTIL_RingBufEmpty(&usbTxRb));
+
+    // A slow producer leaves the endpoint idle between frames, so the main
+    // loop restarts it
+    _Run(40);
+    CHECK(rxErrors == 0);
+    CHECK(rxCount == txCount);
+    CHECK(ep.badSpans == 0);
+}
+
+static void test_throughput(void)
+{
+    uint32_t slots = _Run(1);
+    const double bytesPerSecond = (double)rxCount * SLOTS_PER_MS * 1000.0 / slots;
+
+    // Full-speed bulk carries at most 19 x 64 bytes per 1 ms frame. Only
+    // the last packet of a transfer and the ZLPs fall short of it.
+    CHECK((rxCount * 100ULL) >= ((uint64_t)ep.packets * PACKET_SIZE * 90));
+    printf("upstream: %.0f bytes/s of %u, %.1f bytes per transfer\n",
+            bytesPerSecond, SLOTS_PER_MS * PACKET_SIZE * 1000, (double)rxCount / ep.transfers);
+}
+
+int main(void)
+{
+    test_spans();
+    test_throughput();
+    return TEST_RESULT();
+}
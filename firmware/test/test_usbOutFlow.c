@@ -0,0 +1,253 @@
+#include "string.h"
+#include "test.h"
+#include "frameDecoder.h"
+#include "frameParser.h"
+
+/*
+ * Host simulation of the USB OUT flow control of usbd_cdc_if.c against a
+ * host that sends as fast as the endpoint takes packets.
+ *
+ * The endpoint model accepts a packet into a free packet memory buffer
+ * while STAT_RX is VALID. Single buffered, the hardware sets STAT_RX to
+ * NAK after each packet and only USBD_CDC_ReceivePacket() sets it VALID
+ * again. Double buffered, STAT_RX stays VALID and the hardware keeps
+ * filling the other buffer, unless it is set to NAK explicitly.
+ *
+ * CDC_Receive_FS() and CDC_ProcessRx() are modelled line by line on top
+ * of the real frame decoder.
+ */
+#define PACKET_SIZE         (64)
+#define RESUME_SPACE        (PACKET_SIZE)   /* CDC_RX_RESUME_SPACE */
+#define SIM_FRAMES          (20000)
+
+typedef enum {
+    EP_SINGLE,          // the firmware configuration
+    EP_DOUBLE,          // double buffered, paused by not re-arming only
+    EP_DOUBLE_NAK       // double buffered, STAT_RX set to NAK while paused
+} EpMode_t;
+
+typedef struct {
+    EpMode_t mode;
+    bool armed;         // a receive is pending (USBD_CDC_ReceivePacket)
+    bool paused;        // rxPaused
+    uint32_t held;      // packets in the packet memory, not delivered yet
+    uint8_t pma[2][PACKET_SIZE];
+    uint32_t pmaLen[2];
+    uint32_t pmaNext;   // oldest held buffer
+
+    uint32_t naks;      // packets the host had to retry
+    uint32_t pauses;
+    uint32_t strays;    // packets taken while no receive was pending
+    uint32_t overflows; // PARSER_Store() failures
+} Endpoint_t;
+
+static FrameDecoder_t dec;
+static Endpoint_t ep;
+static uint32_t seed;
+
+static uint32_t _Rand(void)
+{
+    seed = seed * 1103515245UL + 12345UL;
+    return seed >> 8;
+}
+
+static uint32_t _BuildFrame(uint8_t * pBuf, uint32_t payloadLen, uint16_t seq)
+{
+    const uint32_t len = FRAME_OVERHEAD + payloadLen;
+    uint8_t sum = 0;
+    uint32_t n;
+
+    pBuf[TAG_OFFSET] = TAG_SOF;
+    pBuf[LEN_OFFSET] = (uint8_t)(len & 0xFF);
+    pBuf[LEN_OFFSET + 1] = (uint8_t)(len >> 8);
+    memset(&pBuf[TIMESTAMP_OFFSET], 0, 4);
+    pBuf[PACKET_SEQ_OFFSET] = (uint8_t)(seq & 0xFF);
+    pBuf[PACKET_SEQ_OFFSET + 1] = (uint8_t)(seq >> 8);
+    for(n = 0; n < payloadLen; n++) {
+        pBuf[PAYLOAD_OFFSET + n] = (uint8_t)(seq + n);
+    }
+    for(n = 0; n < (len - 1); n++) {
+        sum += pBuf[n];
+    }
+    pBuf[len - 1] = (uint8_t)((~sum) + 1);
+    return len;
+}
+
+/*
+ * CDC_Receive_FS()
+ */
+static void _Receive(const uint8_t * pBuf, uint32_t len)
+{
+    if(DECODER_Store(&dec, pBuf, len) != true) {
+        ep.overflows++;
+    }
+    if(DECODER_Free(&dec) >= RESUME_SPACE) {
+        ep.paused = false;
+        ep.armed = true;
+    } else {
+        ep.paused = true;
+        ep.pauses++;
+    }
+}
+
+/*
+ * Transfer complete interrupts: a held packet completes the pending receive
+ */
+static void _Isr(void)
+{
+    while(ep.armed && (ep.held > 0)) {
+        const uint32_t buf = ep.pmaNext;
+
+        ep.armed = false;
+        ep.held--;
+        ep.pmaNext ^= (ep.mode == EP_SINGLE) ? 0 : 1;
+        _Receive(ep.pma[buf], ep.pmaLen[buf]);
+    }
+}
+
+/*
+ * The host sends one packet, returns false if it was NAKed
+ */
+static bool _HostSend(const uint8_t * pBuf, uint32_t len)
+{
+    bool valid;
+    uint32_t buf;
+
+    switch(ep.mode) {
+        case EP_SINGLE:
+            valid = ep.armed && (ep.held == 0);
+            break;
+        case EP_DOUBLE:
+            valid = (ep.held < 2);
+            break;
+        default:
+            valid = (ep.held < 2) && !ep.paused;
+            break;
+    }
+    if(!valid) {
+        ep.naks++;
+        return false;
+    }
+    if(!ep.armed) {
+        ep.strays++;
+    }
+
+    buf = (ep.mode == EP_SINGLE) ? 0 : ((ep.pmaNext + ep.held) & 1);
+    memcpy(ep.pma[buf], pBuf, len);
+    ep.pmaLen[buf] = len;
+    ep.held++;
+    _Isr();
+    return true;
+}
+
+/*
+ * CDC_ProcessRx()
+ */
+static void _ProcessRx(void)
+{
+    if(ep.paused && (DECODER_Free(&dec) >= RESUME_SPACE)) {
+        ep.paused = false;
+        ep.armed = true;
+        _Isr();
+    }
+}
+
+/*
+ * Sends SIM_FRAMES frames through the endpoint while a slower main loop
+ * decodes them. Returns the number of frames decoded in order.
+ */
+static uint32_t _Run(EpMode_t mode)
+{
+    static uint8_t stream[2 * FRAME_MAX_SIZE];
+    uint32_t streamLen = 0;
+    uint32_t streamPos = 0;
+    uint16_t txSeq = 0;
+    uint16_t rxSeq = 0;
+    uint32_t decoded = 0;
+    uint32_t slots;
+
+    DECODER_Init(&dec);
+    memset(&ep, 0, sizeof(ep));
+    ep.mode = mode;
+    ep.armed = true;
+    seed = 1;
+
+    // A stuck endpoint gives up after a generous number of packet slots
+    for(slots = 0; (decoded < SIM_FRAMES) && (slots < (SIM_FRAMES * 1000UL)); slots++) {
+        // The host refills its write with one or more frames, mostly short
+        // ones, sometimes up to the maximum frame size
+        if((streamPos == streamLen) && (txSeq < SIM_FRAMES)) {
+            streamLen = 0;
+            streamPos = 0;
+            do {
+                const uint32_t payloadLen = ((_Rand() % 16) == 0) ?
+                        (_Rand() % (FRAME_MAX_SIZE - FRAME_OVERHEAD + 1)) : (_Rand() % 80);
+                streamLen += _BuildFrame(&stream[streamLen], payloadLen, txSeq++);
+            } while(((_Rand() % 2) == 0) && (streamLen < FRAME_MAX_SIZE) && (txSeq < SIM_FRAMES));
+        }
+
+        // Saturating sender: a packet every slot, retried after a NAK
+        if(streamPos < streamLen) {
+            uint32_t len = streamLen - streamPos;
+
+            if(len > PACKET_SIZE) {
+                len = PACKET_SIZE;
+            }
+            if(_HostSend(&stream[streamPos], len)) {
+                streamPos += len;
+            }
+        }
+
+        // The main loop gets to run in one slot out of four, and a frame
+        // at a time per pass, so the parser falls behind the bus
+        if((_Rand() % 4) == 0) {
+            const uint8_t * pFrame;
+            uint32_t len;
+
+            pFrame = DECODER_Next(&dec, &len);
+            if(pFrame != NULL) {
+                const uint16_t seq = (uint16_t)(pFrame[PACKET_SEQ_OFFSET] |
+                        (pFrame[PACKET_SEQ_OFFSET + 1] << 8));
+                if(seq != rxSeq) {
+                    return decoded;
+                }
+                rxSeq++;
+                decoded++;
+                DECODER_Consume(&dec);
+            }
+            _ProcessRx();
+        }
+    }
+    return decoded;
+}
+
+static void test_single_buffered(void)
+{
+    // Every frame arrives, the host is held off instead
+    CHECK(_Run(EP_SINGLE) == SIM_FRAMES);
+    CHECK(ep.overflows == 0);
+    CHECK(ep.strays == 0);
+    CHECK(ep.pauses > 0);
+    CHECK(ep.naks > 0);
+}
+
+static void test_double_buffered(void)
+{
+    // Not re-arming does not stop a double-buffered endpoint: it takes
+    // packets into the other buffer with no receive pending
+    _Run(EP_DOUBLE);
+    CHECK(ep.strays > 0);
+
+    // Setting STAT_RX to NAK while paused does
+    CHECK(_Run(EP_DOUBLE_NAK) == SIM_FRAMES);
+    CHECK(ep.overflows == 0);
+    CHECK(ep.strays == 0);
+    CHECK(ep.pauses > 0);
+}
+
+int main(void)
+{
+    test_single_buffered();
+    test_double_buffered();
+    return TEST_RESULT();
+}